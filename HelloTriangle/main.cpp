@@ -3,6 +3,8 @@
 // The GLM_FORCE_RADIANS definition is necessary to make sure that functions like glm::rotate use radians as arguments,
 //  to avoid any possible confusion.
 #define GLM_FORCE_RADIANS
+// Vulkan's depth range is 0 to 1, OpenGL's -1 to 1
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include <glm/glm.hpp> // Linear algebra
 // The glm/gtc/matrix_transform.hpp header exposes functions that can be used to generate model transformations 
 // like glm::rotate, view transformations like glm::lookAt and projection transformations like glm::perspective. 
@@ -13,7 +15,7 @@
 
 // For catching and reporting errors
 #include <iostream>
-#include <fstream>  // For reading the SPIR-V byte code
+#include <fstream>  // For writing the trace and the pipeline cache
 #include <stdexcept>
 #include <algorithm> // Necessary for std::clamp
 // The chrono standard library header exposes functions to do precise timekeeping. We'll use this to make sure 
@@ -21,19 +23,308 @@
 #include <chrono>
 #include <vector>   // For creating arrays
 #include <map>      // For creating maps
+#include <deque>    // For the in flight submissions of the staging ring
 #include <cstring>
+#include <cctype> // For std::tolower
 #include <optional> // For checking queue family
 #include <set> // For creating sets
 // For EXIT_SUCCESS and EXIT_FAILURE macros
 #include <cstdlib>
+#include <cstdio> // For std::rename
 #include <cstdint> // Necessary for uint32_t
 #include <limits> // Necessary for std::numeric_limits
+#include <cmath>
+#include <mutex> // For guarding the memory allocator
+#include <thread> // For recording command buffers in parallel
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <future> // For handing decoded assets back from the loader threads
+#include <memory>
+#include <filesystem> // For checking which texture file exists
+#include <unordered_map> // For sharing the vertices of OBJ faces
+#include <charconv> // For parsing OBJ numbers without locales
+#ifdef HT_SHADERC
+#include <shaderc/shaderc.hpp> // For compiling GLSL at runtime, see make SHADERC=1
+#endif
+#include <utility>
+#include <bit> // For rounding the sample count to a power of two
+#if defined(__SSE2__)
+#include <immintrin.h> // For the batched transforms
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include <sys/mman.h> // For mapping asset files into memory
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 const uint32_t WIDTH = 800; // Defining the width of the GLFW window
 const uint32_t HEIGHT = 600; // Defining the height of the GLFW window
 const char TITLE[7] = "Vulkan"; // Defining the title of the GLFW window
-const int MAX_FRAMES_IN_FLIGHT = 2; // How many frames to process concurrently
+const uint32_t MAX_FRAMES_IN_FLIGHT = 4; // Upper limit of the frames processed concurrently, see AppConfig::framesInFlight
+const char PIPELINE_CACHE_FILE[] = "pipeline_cache.bin"; // Compiled pipelines kept between runs
+const char TEXTURE_FILE[] = "textures/texture.jpg"; // Decoded at startup, the mip levels are generated on the GPU
+const char COMPRESSED_TEXTURE_FILE[] = "textures/texture.ktx2"; // Block compressed with its mip levels, used instead if present
+const uint32_t MAX_BINDLESS_TEXTURES = 1024; // Size of the bindless texture array, lowered to the device limits
+const char MODEL_FILE[] = "models/model.mesh"; // Drawn if present and HT_MODEL isn't set, otherwise a quad is drawn
+
+// Reads a boolean environment variable, "0", "false" and "off" count as false
+// Returns defaultValue if the variable isn't set
+bool environmentFlag(const char* name, bool defaultValue) {
+    const char* value = std::getenv(name);
+    if (value == nullptr || *value == '\0') {
+        return defaultValue;
+    }
+    std::string flag(value);
+    return !(flag == "0" || flag == "false" || flag == "off");
+}
+
+// Reads a comma separated environment variable, empty entries are skipped
+// Returns an empty list if the variable isn't set
+std::vector<std::string> environmentList(const char* name) {
+    std::vector<std::string> items;
+    const char* value = std::getenv(name);
+    if (value == nullptr) {
+        return items;
+    }
+    std::string list(value);
+    for (size_t start = 0; start < list.size();) {
+        size_t end = std::min(list.find(',', start), list.size());
+        if (end > start) {
+            items.push_back(list.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return items;
+}
+
+// Compute passes that HT_ASYNC_COMPUTE can move to the compute queue
+const std::array<const char*, 1> ASYNC_COMPUTE_PASSES = {"cull"};
+
+// Settings that can be changed at runtime without recompiling
+// Read from environment variables, all prefixed with HT_
+struct AppConfig {
+    // HT_INDIRECT_DRAW: Issue the draw list from a GPU buffer with vkCmdDrawIndexedIndirect(Count)
+    // instead of one vkCmdDrawIndexed per draw
+    bool indirectDraw = true;
+    // HT_GPU_CULLING: Frustum cull the draw list in a compute shader before drawing
+    // Needs indirect drawing and drawIndirectCount
+    bool gpuCulling = true;
+    // HT_ASYNC_COMPUTE: Comma separated compute passes submitted to a compute only queue, overlapping the rendering
+    // "cull" runs the GPU culling there, "all" every pass in ASYNC_COMPUTE_PASSES. The passes stay on the graphics
+    // queue on devices without a compute only queue family
+    std::vector<std::string> asyncComputePasses;
+    // HT_INSTANCE_COUNT: Copies of the mesh drawn with a single instanced draw, laid out in a grid
+    uint32_t instanceCount = 1;
+    // HT_PROFILE: Time the frames on the CPU and GPU, shows the frame times in the window title
+    bool profile = false;
+    // HT_TRACE_FILE: Writes the profiled frames to this file as Chrome trace JSON on exit, implies HT_PROFILE
+    std::string traceFile;
+    // HT_HEADLESS or --headless: Renders offscreen without a window or swapchain for benchmarkFrames frames
+    // and prints the throughput as JSON, always profiles
+    bool headless = false;
+    // HT_BENCHMARK_FRAMES or --frames N: Number of frames rendered in headless mode
+    uint32_t benchmarkFrames = 1000;
+    // HT_FIXED_TIMESTEP: Seconds the animation advances per frame, 0 follows the wall clock
+    // Headless mode defaults to 1/60 so every run renders the same frames
+    float fixedTimestep = 0.0f;
+    // HT_FRAMES_IN_FLIGHT: How many frames the CPU may record ahead of the GPU, 1 to MAX_FRAMES_IN_FLIGHT
+    // More frames hide stalls better, fewer reduce the input latency
+    uint32_t framesInFlight = 2;
+    // HT_PRESENT_MODE: immediate, mailbox, fifo or fifo_relaxed, falls back to fifo if unsupported
+    // immediate has the lowest latency but tears, mailbox doesn't tear but renders frames that are never shown,
+    // fifo is vsync and fifo_relaxed is vsync that tears instead of waiting when a frame is late
+    VkPresentModeKHR presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+    // HT_SWAPCHAIN_IMAGES: Images in the swap chain, 0 uses one more than the minimum
+    // Fewer images queue fewer frames ahead of the screen
+    uint32_t swapchainImages = 0;
+    // HT_FPS_LIMIT: Sleeps before acquiring an image so no more than this many frames are drawn a second, 0 is unlimited
+    float frameRateLimit = 0.0f;
+    // HT_PRESENT_WAIT: With VK_KHR_present_wait, waits until the previous frame is on screen before starting a new one
+    // Keeps the presentation queue short, so the frames shown are as fresh as possible
+    bool presentWait = true;
+    // HT_DYNAMIC_RENDERING: Render with vkCmdBeginRendering instead of a render pass and framebuffers
+    // Falls back to the render pass on devices without dynamic rendering
+    bool dynamicRendering = true;
+    // HT_MSAA: Samples per pixel, 1 disables multisampling. Rounded down to what the device supports
+    uint32_t msaaSamples = 4;
+    // HT_BINDLESS: One partially bound array with every texture, each instance picks its texture by index
+    // Falls back to a single texture binding on devices without descriptor indexing
+    bool bindless = true;
+    // HT_SHADER_HOT_RELOAD: Watches the shaders and swaps in a rebuilt graphics pipeline when they change
+    // Recompiles the GLSL when built with shaderc, otherwise picks up the .spv files written by compile.sh
+    bool shaderHotReload = false;
+    // HT_ANIMATE_INSTANCES: Every instance spins at its own rate, its matrix is recomputed every frame
+    // Otherwise the instance matrices are uploaded once
+    bool animateInstances = false;
+    // HT_PACKED_VERTICES: Upload the vertices as 16 byte PackedVertex instead of the 32 byte Vertex
+    // Unset only the built-in quad is packed, half float positions lose precision on large models
+    std::optional<bool> packedVertices;
+    // HT_DEVICE or --device: The GPU to render on. Its index or UUID as printed by --list-devices, "low-power" 
+    // for an integrated GPU over a discrete one, or empty for the highest scoring device
+    std::string device;
+    // HT_REQUIRE: Comma separated capabilities the device must have, e.g. descriptor_indexing,dynamic_rendering
+    // Devices without them are skipped instead of falling back to the slower path
+    std::vector<std::string> requiredCapabilities;
+    // HT_LIST_DEVICES or --list-devices: Prints every device with its score and capabilities and exits
+    bool listDevices = false;
+    // HT_MODEL or --model PATH: The mesh to draw, a .obj file or a .mesh file converted from one
+    std::string modelFile;
+    // --convert-mesh OBJ MESH: Converts an OBJ file to a .mesh file and exits without rendering
+    std::string convertSource;
+    std::string convertTarget;
+    // --self-test: Runs the checks of the parts that need no GPU and exits, see "make check"
+    bool selfTest = false;
+
+    static AppConfig fromEnvironment() {
+        AppConfig config;
+        config.indirectDraw = environmentFlag("HT_INDIRECT_DRAW", config.indirectDraw);
+        config.gpuCulling = environmentFlag("HT_GPU_CULLING", config.gpuCulling);
+        if (const char* value = std::getenv("HT_TRACE_FILE")) {
+            config.traceFile = value;
+        }
+        config.profile = environmentFlag("HT_PROFILE", !config.traceFile.empty());
+        if (const char* value = std::getenv("HT_INSTANCE_COUNT")) {
+            config.instanceCount = std::max(1ul, std::strtoul(value, nullptr, 10));
+        }
+        config.headless = environmentFlag("HT_HEADLESS", config.headless);
+        if (const char* value = std::getenv("HT_BENCHMARK_FRAMES")) {
+            config.benchmarkFrames = std::max(1ul, std::strtoul(value, nullptr, 10));
+        }
+        if (const char* value = std::getenv("HT_FIXED_TIMESTEP")) {
+            config.fixedTimestep = std::max(0.0f, std::strtof(value, nullptr));
+        }
+        if (const char* value = std::getenv("HT_PRESENT_MODE")) {
+            std::string mode(value);
+            if (mode == "immediate") {
+                config.presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+            } else if (mode == "mailbox") {
+                config.presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+            } else if (mode == "fifo") {
+                config.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+            } else if (mode == "fifo_relaxed") {
+                config.presentMode = VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+            } else {
+                throw std::invalid_argument("unknown HT_PRESENT_MODE " + mode + "!");
+            }
+        }
+        if (const char* value = std::getenv("HT_SWAPCHAIN_IMAGES")) {
+            config.swapchainImages = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+        }
+        if (const char* value = std::getenv("HT_FPS_LIMIT")) {
+            config.frameRateLimit = std::max(0.0f, std::strtof(value, nullptr));
+        }
+        config.presentWait = environmentFlag("HT_PRESENT_WAIT", config.presentWait);
+        config.dynamicRendering = environmentFlag("HT_DYNAMIC_RENDERING", config.dynamicRendering);
+        if (const char* value = std::getenv("HT_PACKED_VERTICES"); value != nullptr && *value != '\0') {
+            config.packedVertices = environmentFlag("HT_PACKED_VERTICES", true);
+        }
+        config.animateInstances = environmentFlag("HT_ANIMATE_INSTANCES", config.animateInstances);
+        config.bindless = environmentFlag("HT_BINDLESS", config.bindless);
+        if (const char* value = std::getenv("HT_MSAA")) {
+            config.msaaSamples = std::bit_floor(static_cast<uint32_t>(std::clamp(std::strtoul(value, nullptr, 10), 1ul, 64ul)));
+        }
+        config.shaderHotReload = environmentFlag("HT_SHADER_HOT_RELOAD", config.shaderHotReload);
+        if (const char* value = std::getenv("HT_MODEL")) {
+            config.modelFile = value;
+        }
+        if (const char* value = std::getenv("HT_DEVICE")) {
+            config.device = value;
+        }
+        config.requiredCapabilities = environmentList("HT_REQUIRE");
+        config.asyncComputePasses = environmentList("HT_ASYNC_COMPUTE");
+        for (const std::string& pass : config.asyncComputePasses) {
+            if (pass != "all" && std::find(ASYNC_COMPUTE_PASSES.begin(), ASYNC_COMPUTE_PASSES.end(), pass) == ASYNC_COMPUTE_PASSES.end()) {
+                throw std::invalid_argument("unknown HT_ASYNC_COMPUTE pass " + pass + "!");
+            }
+        }
+        config.listDevices = environmentFlag("HT_LIST_DEVICES", config.listDevices);
+        if (const char* value = std::getenv("HT_FRAMES_IN_FLIGHT")) {
+            config.framesInFlight = static_cast<uint32_t>(std::clamp(std::strtoul(value, nullptr, 10), 1ul, 
+                static_cast<unsigned long>(MAX_FRAMES_IN_FLIGHT)));
+        }
+        return config;
+    }
+
+    // True if HT_ASYNC_COMPUTE asks for the pass to run on the compute queue
+    bool asyncCompute(const std::string& pass) const {
+        return std::find(asyncComputePasses.begin(), asyncComputePasses.end(), pass) != asyncComputePasses.end()
+            || std::find(asyncComputePasses.begin(), asyncComputePasses.end(), "all") != asyncComputePasses.end();
+    }
+
+    // Environment settings overridden by the command line
+    static AppConfig fromArguments(int argc, char** argv) {
+        AppConfig config = fromEnvironment();
+        for (int i = 1; i < argc; i++) {
+            std::string argument(argv[i]);
+            if (argument == "--headless") {
+                config.headless = true;
+            } else if (argument == "--frames" && i + 1 < argc) {
+                config.benchmarkFrames = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+            } else if (argument == "--device" && i + 1 < argc) {
+                config.device = argv[++i];
+            } else if (argument == "--list-devices") {
+                config.listDevices = true;
+            } else if (argument == "--model" && i + 1 < argc) {
+                config.modelFile = argv[++i];
+            } else if (argument == "--convert-mesh" && i + 2 < argc) {
+                config.convertSource = argv[++i];
+                config.convertTarget = argv[++i];
+            } else if (argument == "--self-test") {
+                config.selfTest = true;
+            } else {
+                throw std::invalid_argument("unknown argument " + argument + "!");
+            }
+        }
+
+        if (config.listDevices) {
+            config.headless = true; // Only the instance is created, there is no surface to check against
+        }
+        if (config.headless) {
+            config.profile = true; // The report needs the GPU timings
+            if (std::getenv("HT_FIXED_TIMESTEP") == nullptr) {
+                config.fixedTimestep = 1.0f / 60.0f;
+            }
+        }
+        return config;
+    }
+};
+
+// Optional features of the picked device the renderer adapts to
+struct DeviceCapabilities {
+    bool multiDrawIndirect = false; // More than one draw per vkCmdDrawIndexedIndirect
+    bool drawIndirectCount = false; // Draw count read from a buffer, core in Vulkan 1.2
+    bool timelineSemaphore = false; // Required, every submission is tracked on one timeline
+    bool presentWait = false; // VK_KHR_present_id and VK_KHR_present_wait, waiting for a frame to reach the screen
+    bool dynamicRendering = false; // Rendering without render pass and framebuffer objects
+    bool dynamicRenderingCore = false; // Dynamic rendering is core (Vulkan 1.3), otherwise it needs VK_KHR_dynamic_rendering
+    bool textureCompressionBC = false; // BC1-7 textures, usually desktop GPUs
+    bool textureCompressionASTC = false; // ASTC LDR textures, usually mobile GPUs
+    bool textureCompressionETC2 = false; // ETC2 and EAC textures
+    bool descriptorIndexing = false; // Partially bound runtime sized sampler arrays with non uniform indexing
+    bool samplerAnisotropy = false; // Anisotropic texture filtering
+    bool synchronization2 = false; // vkCmdPipelineBarrier2 and the 64 bit stage and access flags
+    bool synchronization2Core = false; // Synchronization2 is core (Vulkan 1.3), otherwise it needs VK_KHR_synchronization2
+};
+
+// Names of the capabilities, as used by HT_REQUIRE and the device report
+const std::array<std::pair<const char*, bool DeviceCapabilities::*>, 13> CAPABILITY_NAMES = {{
+    {"multi_draw_indirect", &DeviceCapabilities::multiDrawIndirect},
+    {"draw_indirect_count", &DeviceCapabilities::drawIndirectCount},
+    {"timeline_semaphore", &DeviceCapabilities::timelineSemaphore},
+    {"present_wait", &DeviceCapabilities::presentWait},
+    {"dynamic_rendering", &DeviceCapabilities::dynamicRendering},
+    {"dynamic_rendering_core", &DeviceCapabilities::dynamicRenderingCore},
+    {"texture_compression_bc", &DeviceCapabilities::textureCompressionBC},
+    {"texture_compression_astc", &DeviceCapabilities::textureCompressionASTC},
+    {"texture_compression_etc2", &DeviceCapabilities::textureCompressionETC2},
+    {"descriptor_indexing", &DeviceCapabilities::descriptorIndexing},
+    {"sampler_anisotropy", &DeviceCapabilities::samplerAnisotropy},
+    {"synchronization2", &DeviceCapabilities::synchronization2},
+    {"synchronization2_core", &DeviceCapabilities::synchronization2Core},
+}};
 
 // Name of the validation layer
 const std::vector<const char*> validationLayers = {
@@ -79,15 +370,294 @@ struct QueueFamilyIndices {
 
     std::optional<uint32_t> presentFamily;  // Queue used for presenting the rendered frames
 
-    // Not availabe for this device
-    // std::optional<uint32_t> transferFamily; 
     // Queue used to transfer data from buffer accessible by CPU to buffer for the GPU
+    // Falls back to the graphics family when the device has no dedicated transfer family
+    std::optional<uint32_t> transferFamily; 
+
+    // Queue used for the async compute passes, a family without graphics so it can run beside the graphics queue
+    // Falls back to the graphics family when the device has no compute only family
+    std::optional<uint32_t> computeFamily;
 
     bool isComplete() {
         return graphicsFamily.has_value() && presentFamily.has_value();
     }
 };
 
+// One submission of uploads to the GPU
+// With a separate transfer queue family the copies run on the transfer queue and the graphics queue
+// acquires the resources in acquireCommandBuffer once transferFinished is signaled
+struct UploadBatch {
+    VkCommandBuffer transferCommandBuffer = VK_NULL_HANDLE;
+    VkCommandBuffer acquireCommandBuffer = VK_NULL_HANDLE; // Only used with a separate transfer family
+    VkSemaphore transferFinished = VK_NULL_HANDLE; // Only used with a separate transfer family
+    uint64_t value = 0; // GPU timeline value signaled once the whole batch has finished
+};
+
+/**
+ * Destroys Vulkan objects once the GPU is done with them, without waiting for the device to go idle
+ * 
+ * An object is retired with the GPU timeline value of the last submission that may use it, together with a
+ * function destroying it. flush() runs the functions whose value the timeline has reached, oldest first.
+ */
+class DeletionQueue {
+    public:
+        void retire(uint64_t value, std::function<void()> destroy) {
+            // Kept sorted by value, almost always appended at the end
+            auto position = std::upper_bound(entries.begin(), entries.end(), value, 
+                [](uint64_t value, const Entry& entry) { return value < entry.value; });
+            entries.insert(position, {value, std::move(destroy)});
+        }
+
+        // Destroys everything retired with a value up to completedValue, UINT64_MAX destroys everything
+        void flush(uint64_t completedValue) {
+            while (!entries.empty() && entries.front().value <= completedValue) {
+                std::function<void()> destroy = std::move(entries.front().destroy);
+                entries.pop_front(); // Before calling, destroy may retire more objects
+                destroy();
+            }
+        }
+
+    private:
+        struct Entry {
+            uint64_t value;
+            std::function<void()> destroy;
+        };
+        std::deque<Entry> entries;
+};
+
+/**
+ * A read only view of a whole file, mapped into memory with mmap
+ *
+ * The loaders read straight from the mapped pages, there is no heap copy of the file. The pages are
+ * backed by the page cache, so a texture goes from the page cache into the staging ring with one memcpy.
+ * The mapping is page aligned, which also satisfies the uint32_t alignment SPIR-V code needs.
+ */
+class FileView {
+    public:
+        FileView() = default;
+        FileView(const FileView&) = delete;
+        FileView& operator=(const FileView&) = delete;
+
+        FileView(FileView&& other) noexcept 
+            : mapping(std::exchange(other.mapping, nullptr)), length(std::exchange(other.length, 0)) {}
+
+        FileView& operator=(FileView&& other) noexcept {
+            if (this != &other) {
+                unmap();
+                mapping = std::exchange(other.mapping, nullptr);
+                length = std::exchange(other.length, 0);
+            }
+            return *this;
+        }
+
+        ~FileView() {
+            unmap();
+        }
+
+        /**
+         * Maps the file at path, returns false if it can't be opened or mapped
+         *
+         * MAP_POPULATE reads the whole file in right away, so the disk reads happen on the calling thread
+         * (the loader's I/O thread) instead of page faults on whichever thread touches the data first.
+         */
+        bool open(const std::string& path) {
+            unmap();
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat status;
+            if (fstat(fd, &status) != 0) {
+                ::close(fd);
+                return false;
+            }
+            // An empty file can't be mapped, it is just an empty view
+            if (status.st_size > 0) {
+                void* address = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+                if (address == MAP_FAILED) {
+                    ::close(fd);
+                    return false;
+                }
+                mapping = address;
+                length = static_cast<size_t>(status.st_size);
+                madvise(mapping, length, MADV_SEQUENTIAL); // The loaders read front to back
+            }
+            ::close(fd); // The mapping keeps the file alive
+            return true;
+        }
+
+        const char* data() const {
+            return static_cast<const char*>(mapping);
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+    private:
+        void unmap() {
+            if (mapping) {
+                munmap(mapping, length);
+                mapping = nullptr;
+                length = 0;
+            }
+        }
+
+        void* mapping = nullptr;
+        size_t length = 0;
+};
+
+/**
+ * A texture in CPU memory, ready to be staged for upload
+ *
+ * Either the mip levels of a KTX2 file, which are uploaded as they are stored in the file, or an image
+ * decoded to RGBA8 whose lower mip levels are generated on the GPU.
+ */
+struct TextureData {
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> levels; // Offset and size of every stored mip level in bytes(), largest first
+    bool generateMipmaps = false; // Only the first level is stored, the rest are blitted from it
+    FileView file; // The mapped KTX2 file the levels point into
+    std::unique_ptr<stbi_uc, void(*)(void*)> pixels{nullptr, stbi_image_free}; // The decoded image
+
+    const char* bytes() const {
+        return pixels ? reinterpret_cast<const char*>(pixels.get()) : file.data();
+    }
+};
+
+// Texels per block and bytes per block of a format, 1x1 blocks for uncompressed formats
+struct FormatBlock {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t bytes = 0; // 0 for formats a texture file can't be checked against
+};
+
+// The block of the color formats a texture can be stored in, the ranges follow the order of VkFormat
+FormatBlock formatBlock(VkFormat format) {
+    auto in = [format](VkFormat first, VkFormat last) { return format >= first && format <= last; };
+    if (in(VK_FORMAT_R8_UNORM, VK_FORMAT_R8_SRGB)) return {1, 1, 1};
+    if (in(VK_FORMAT_R8G8_UNORM, VK_FORMAT_R8G8_SRGB)) return {1, 1, 2};
+    if (in(VK_FORMAT_R8G8B8_UNORM, VK_FORMAT_B8G8R8_SRGB)) return {1, 1, 3};
+    if (in(VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_A2B10G10R10_SINT_PACK32)) return {1, 1, 4};
+    if (in(VK_FORMAT_R16_UNORM, VK_FORMAT_R16_SFLOAT)) return {1, 1, 2};
+    if (in(VK_FORMAT_R16G16_UNORM, VK_FORMAT_R16G16_SFLOAT)) return {1, 1, 4};
+    if (in(VK_FORMAT_R16G16B16_UNORM, VK_FORMAT_R16G16B16_SFLOAT)) return {1, 1, 6};
+    if (in(VK_FORMAT_R16G16B16A16_UNORM, VK_FORMAT_R16G16B16A16_SFLOAT)) return {1, 1, 8};
+    if (in(VK_FORMAT_R32_UINT, VK_FORMAT_R32_SFLOAT)) return {1, 1, 4};
+    if (in(VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32_SFLOAT)) return {1, 1, 8};
+    if (in(VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32_SFLOAT)) return {1, 1, 12};
+    if (in(VK_FORMAT_R32G32B32A32_UINT, VK_FORMAT_R32G32B32A32_SFLOAT)) return {1, 1, 16};
+    if (in(VK_FORMAT_B10G11R11_UFLOAT_PACK32, VK_FORMAT_E5B9G9R9_UFLOAT_PACK32)) return {1, 1, 4};
+    // BC1 and BC4 pack a 4x4 block into 8 bytes, the other BC formats into 16
+    if (in(VK_FORMAT_BC1_RGB_UNORM_BLOCK, VK_FORMAT_BC1_RGBA_SRGB_BLOCK)) return {4, 4, 8};
+    if (in(VK_FORMAT_BC2_UNORM_BLOCK, VK_FORMAT_BC3_SRGB_BLOCK)) return {4, 4, 16};
+    if (in(VK_FORMAT_BC4_UNORM_BLOCK, VK_FORMAT_BC4_SNORM_BLOCK)) return {4, 4, 8};
+    if (in(VK_FORMAT_BC5_UNORM_BLOCK, VK_FORMAT_BC7_SRGB_BLOCK)) return {4, 4, 16};
+    // The same for ETC2 without alpha and single channel EAC
+    if (in(VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK, VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK)) return {4, 4, 8};
+    if (in(VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK, VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK)) return {4, 4, 16};
+    if (in(VK_FORMAT_EAC_R11_UNORM_BLOCK, VK_FORMAT_EAC_R11_SNORM_BLOCK)) return {4, 4, 8};
+    if (in(VK_FORMAT_EAC_R11G11_UNORM_BLOCK, VK_FORMAT_EAC_R11G11_SNORM_BLOCK)) return {4, 4, 16};
+    // Every ASTC block is 16 bytes, each footprint comes as UNORM and SRGB
+    if (in(VK_FORMAT_ASTC_4x4_UNORM_BLOCK, VK_FORMAT_ASTC_12x12_SRGB_BLOCK)) {
+        const uint32_t footprints[14][2] = {{4, 4}, {5, 4}, {5, 5}, {6, 5}, {6, 6}, {8, 5}, {8, 6}, {8, 8}, 
+            {10, 5}, {10, 6}, {10, 8}, {10, 10}, {12, 10}, {12, 12}};
+        const uint32_t* footprint = footprints[(format - VK_FORMAT_ASTC_4x4_UNORM_BLOCK) / 2];
+        return {footprint[0], footprint[1], 16};
+    }
+    return {};
+}
+
+/**
+ * Parses a KTX2 file, see https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html
+ * 
+ * Only 2D textures without supercompression are read, the mip levels are uploaded as they are stored.
+ * Throws if the file isn't a KTX2 texture that can be uploaded directly, or if its size, level count or
+ * level lengths don't fit together. Every level has to hold at least what its copy to the image reads.
+ */
+TextureData parseKtx2(FileView file, const std::string& path) {
+    TextureData texture;
+    texture.file = std::move(file);
+    size_t fileSize = texture.file.size();
+
+    // 12 byte identifier, 9 header fields, the index of the data blocks, then one level index entry per mip level
+    const unsigned char identifier[12] = {0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+    const size_t levelIndexOffset = 80;
+    if (fileSize < levelIndexOffset || std::memcmp(texture.file.data(), identifier, sizeof(identifier)) != 0) {
+        throw std::runtime_error("failed to read " + path + ", not a KTX2 file!");
+    }
+    // vkFormat, typeSize, pixelWidth, pixelHeight, pixelDepth, layerCount, faceCount, levelCount, supercompressionScheme
+    uint32_t header[9];
+    std::memcpy(header, texture.file.data() + sizeof(identifier), sizeof(header));
+
+    // Basis Universal textures have no Vulkan format until they are transcoded
+    if (header[0] == VK_FORMAT_UNDEFINED || header[8] != 0) {
+        throw std::runtime_error("failed to read " + path + ", transcoding and supercompression aren't supported!");
+    }
+    // A height of 0 is a 1D texture
+    if (header[2] == 0 || header[3] == 0 || header[4] > 1 || header[5] > 1 || header[6] != 1) {
+        throw std::runtime_error("failed to read " + path + ", only 2D textures are supported!");
+    }
+    texture.format = static_cast<VkFormat>(header[0]);
+    texture.width = header[2];
+    texture.height = header[3];
+    FormatBlock block = formatBlock(texture.format);
+    if (block.bytes == 0) {
+        throw std::runtime_error("failed to read " + path + ", the format isn't supported!");
+    }
+
+    // A level count of 0 asks for the mip levels to be generated, only the base level is stored then
+    texture.generateMipmaps = header[7] == 0;
+    uint32_t levelCount = std::max(1u, header[7]);
+    // Every level halves the size until it is 1x1
+    if (levelCount > std::bit_width(std::max(texture.width, texture.height))) {
+        throw std::runtime_error("failed to read " + path + ", it has more mip levels than its size allows!");
+    }
+    if (fileSize < levelIndexOffset + levelCount * 3 * sizeof(uint64_t)) {
+        throw std::runtime_error("failed to read " + path + ", the file is truncated!");
+    }
+    for (uint32_t i = 0; i < levelCount; i++) {
+        // byteOffset, byteLength, uncompressedByteLength
+        uint64_t level[3];
+        std::memcpy(level, texture.file.data() + levelIndexOffset + i * sizeof(level), sizeof(level));
+        if (level[1] > fileSize || level[0] > fileSize - level[1]) { // Written so the sum can't overflow
+            throw std::runtime_error("failed to read " + path + ", the file is truncated!");
+        }
+        // What copyBufferToImage reads for the level, partial blocks at the edges are stored whole
+        uint64_t blocksWide = (std::max(1u, texture.width >> i) + block.width - 1) / block.width;
+        uint64_t blocksHigh = (std::max(1u, texture.height >> i) + block.height - 1) / block.height;
+        if (level[1] < blocksWide * blocksHigh * block.bytes) {
+            throw std::runtime_error("failed to read " + path + ", mip level " + std::to_string(i) + " is too short!");
+        }
+        texture.levels.emplace_back(level[0], level[1]);
+    }
+    return texture;
+}
+
+// Decodes a JPEG, PNG, ... file to RGBA8, the mip levels are generated on upload
+// stb_image decodes from the mapped file, the mapping is released once the pixels are decoded
+TextureData decodeImage(FileView file, const std::string& path) {
+    TextureData texture;
+    int texWidth, texHeight, texChannels;
+    // STBI_rgb_alpha forces to load alpha channel even if there are none
+    // texChannels stores the actual number of channels in the image
+    texture.pixels.reset(stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(file.data()), static_cast<int>(file.size()), 
+        &texWidth, &texHeight, &texChannels, STBI_rgb_alpha));
+    if (!texture.pixels) {
+        throw std::runtime_error("failed to load texture image " + path + "!");
+    }
+
+    texture.format = VK_FORMAT_R8G8B8A8_SRGB;
+    texture.width = static_cast<uint32_t>(texWidth);
+    texture.height = static_cast<uint32_t>(texHeight);
+    // The pixels are stored row by row 4 bytes per pixel, 1 byte per channel(rgba)
+    texture.levels.emplace_back(0, static_cast<uint64_t>(texWidth) * texHeight * 4);
+    texture.generateMipmaps = true;
+    return texture;
+}
+
 // Struct to check if the device swap chain is suitable with the window surface
 struct SwapChainSupportDetails {
     VkSurfaceCapabilitiesKHR capabilities;  // Store the capabilities of the device surface
@@ -124,7 +694,7 @@ struct Vertex {
         // vec2: VK_FORMAT_R32G32_SFLOAT
         // vec3: VK_FORMAT_R32G32B32_SFLOAT
         // vec4: VK_FORMAT_R32G32B32A32_SFLOAT
-        attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT; // Type of data 
+        attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT; // Type of data, pos is a vec3
         // offset parameter specifies the number of bytes since the start of the per-vertex data to read from
         attributeDescriptions[0].offset = offsetof(Vertex, pos); 
 
@@ -145,6 +715,95 @@ struct Vertex {
 };
 
 
+// Converts a float to a IEEE half float, rounding to nearest even
+// Values too large for a half become infinity, NaN stays NaN
+uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t exponent = (bits >> 23) & 0xFF;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (exponent == 0xFF) { // Infinity or NaN
+        return static_cast<uint16_t>(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+    }
+    int32_t halfExponent = static_cast<int32_t>(exponent) - 127 + 15;
+    if (halfExponent >= 31) { // Too large
+        return static_cast<uint16_t>(sign | 0x7C00);
+    }
+    if (halfExponent <= 0) { // Subnormal half or zero
+        if (halfExponent < -10) return static_cast<uint16_t>(sign);
+        mantissa |= 0x800000; // The implicit leading one
+        uint32_t shift = static_cast<uint32_t>(14 - halfExponent);
+        uint32_t half = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1))) half++;
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = (static_cast<uint32_t>(halfExponent) << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1FFF;
+    // Rounding can carry into the exponent, which is still the right result
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) half++;
+    return static_cast<uint16_t>(sign | half);
+}
+
+/**
+ * The Vertex packed into 16 bytes instead of 32, halving the vertex fetch bandwidth and memory
+ * 
+ * The position and texture coordinate are half floats (about 3 significant digits, up to 65504) and
+ * the color is 8 bit unorm. The vertex input converts them back to floats, so the vertex shader reads
+ * the same vec3/vec3/vec2 inputs as with the full Vertex.
+ */
+struct PackedVertex {
+    uint16_t pos[4]; // Half xyz, the fourth half pads to a 4 component format which every device supports
+    uint8_t color[4]; // Unorm rgb, a is unused
+    uint16_t texCoord[2]; // Half uv
+
+    static PackedVertex pack(const Vertex& vertex) {
+        PackedVertex packed{};
+        for (int i = 0; i < 3; i++) {
+            packed.pos[i] = floatToHalf(vertex.pos[i]);
+            packed.color[i] = static_cast<uint8_t>(std::lround(std::clamp(vertex.color[i], 0.0f, 1.0f) * 255.0f));
+        }
+        packed.pos[3] = floatToHalf(1.0f);
+        packed.color[3] = 255;
+        packed.texCoord[0] = floatToHalf(vertex.texCoord.x);
+        packed.texCoord[1] = floatToHalf(vertex.texCoord.y);
+        return packed;
+    }
+
+    static VkVertexInputBindingDescription getBindingDescription() {
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 0;
+        bindingDescription.stride = sizeof(PackedVertex);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        return bindingDescription;
+    }
+
+    // Same locations as Vertex, the formats are all required for vertex buffers by the specification
+    static std::array<VkVertexInputAttributeDescription, 3> getAttributeDescriptions() {
+        std::array<VkVertexInputAttributeDescription, 3> attributeDescriptions{};
+        attributeDescriptions[0].binding = 0;
+        attributeDescriptions[0].location = 0;
+        attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_SFLOAT;
+        attributeDescriptions[0].offset = offsetof(PackedVertex, pos);
+
+        attributeDescriptions[1].binding = 0;
+        attributeDescriptions[1].location = 1;
+        attributeDescriptions[1].format = VK_FORMAT_R8G8B8A8_UNORM;
+        attributeDescriptions[1].offset = offsetof(PackedVertex, color);
+
+        attributeDescriptions[2].binding = 0;
+        attributeDescriptions[2].location = 2;
+        attributeDescriptions[2].format = VK_FORMAT_R16G16_SFLOAT;
+        attributeDescriptions[2].offset = offsetof(PackedVertex, texCoord);
+
+        return attributeDescriptions;
+    }
+};
+
+// The built-in quad, drawn when no model file is given
 // interleaving vertex attributes
 // For Position
 // Cordinates range from -1 to 1 except the y axis is flipped
@@ -153,100 +812,2286 @@ struct Vertex {
 // For texture coordinate
 // (0,0) is top left corner
 // (1,1) is bottom right corner 
-const std::vector<Vertex> vertices = {
+const std::vector<Vertex> quadVertices = {
    {{-0.5f, -0.5f, 0.0f}, {1.0f, 0.0f, 0.0f}, {1.0f, 0.0f}},
     {{0.5f, -0.5f, 0.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 0.0f}},
     {{0.5f, 0.5f, 0.0f}, {0.0f, 0.0f, 1.0f}, {0.0f, 1.0f}},
     {{-0.5f, 0.5f, 0.0f}, {1.0f, 1.0f, 1.0f}, {1.0f, 1.0f}}      
 };
 // Indices of the vertices of each triangle
-// Possible to use uint32_t if more unique indices are present
-const std::vector<uint16_t> indices = {
+const std::vector<uint32_t> quadIndices = {
     0, 1, 2, 2, 3, 0, 
 };
 
-// Setting the descriptor to modify the vertices when the model is transformed
+/**
+ * Header of a binary mesh file (.mesh), written by --convert-mesh
+ * 
+ * The header is followed by vertexCount vertices in the Vertex layout, then indexCount indices of indexSize
+ * bytes each. The file is the GPU layout already, loading it is mapping it and copying both arrays
+ * into the staging ring.
+ */
+struct MeshFileHeader {
+    char magic[4]; // MESH_FILE_MAGIC
+    uint32_t version; // MESH_FILE_VERSION, bumped whenever the Vertex layout changes
+    uint32_t vertexStride; // sizeof(Vertex) of the writer, checked against ours
+    uint32_t indexSize; // 2 or 4 bytes
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    float boundsMin[3]; // Bounding box of the positions
+    float boundsMax[3];
+};
+const char MESH_FILE_MAGIC[4] = {'H', 'T', 'M', 'S'};
+const uint32_t MESH_FILE_VERSION = 1;
+
+/**
+ * A mesh in CPU memory, ready to be staged for upload
+ * 
+ * The vertices and indices point either into a mapped .mesh file or into the arrays built by a loader.
+ * Both stay at the same address when the MeshData is moved.
+ */
+struct MeshData {
+    uint32_t vertexCount = 0;
+    uint32_t indexCount = 0;
+    // 16 bit indices halve the index buffer and only fit meshes with up to 65536 vertices
+    VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+    glm::vec3 boundsMin{0.0f};
+    glm::vec3 boundsMax{0.0f};
+    const Vertex* vertices = nullptr;
+    const char* indices = nullptr;
+
+    FileView file; // The mapped .mesh file
+    std::vector<Vertex> ownedVertices; // Or the geometry built by a loader
+    std::vector<char> ownedIndices;
+
+    uint32_t indexSize() const {
+        return indexType == VK_INDEX_TYPE_UINT16 ? 2 : 4;
+    }
+
+    // Sphere around the bounding box as center (xyz) and radius (w), close enough for culling
+    glm::vec4 boundingSphere() const {
+        return glm::vec4((boundsMin + boundsMax) * 0.5f, glm::length(boundsMax - boundsMin) * 0.5f);
+    }
+};
+
+// Makes a mesh out of triangle lists, picking the smallest index type that fits the vertices
+MeshData buildMesh(std::vector<Vertex> vertices, const std::vector<uint32_t>& indices) {
+    MeshData mesh;
+    mesh.vertexCount = static_cast<uint32_t>(vertices.size());
+    mesh.indexCount = static_cast<uint32_t>(indices.size());
+    mesh.indexType = vertices.size() <= 65536 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+
+    mesh.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+    mesh.boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+    for (const Vertex& vertex : vertices) {
+        mesh.boundsMin = glm::min(mesh.boundsMin, vertex.pos);
+        mesh.boundsMax = glm::max(mesh.boundsMax, vertex.pos);
+    }
+
+    mesh.ownedIndices.resize(static_cast<size_t>(mesh.indexCount) * mesh.indexSize());
+    if (mesh.indexType == VK_INDEX_TYPE_UINT16) {
+        for (size_t i = 0; i < indices.size(); i++) {
+            uint16_t index = static_cast<uint16_t>(indices[i]);
+            memcpy(mesh.ownedIndices.data() + i * sizeof(index), &index, sizeof(index));
+        }
+    } else {
+        memcpy(mesh.ownedIndices.data(), indices.data(), mesh.ownedIndices.size());
+    }
+    mesh.ownedVertices = std::move(vertices);
+    mesh.vertices = mesh.ownedVertices.data();
+    mesh.indices = mesh.ownedIndices.data();
+    return mesh;
+}
+
+/**
+ * Maps a binary mesh file, see MeshFileHeader
+ * 
+ * The vertices and indices are used in place, only the indices are read to check they are in range.
+ * Throws if the file was written for another vertex layout, is truncated or its indices are out of range.
+ */
+MeshData parseMesh(FileView file, const std::string& path) {
+    MeshFileHeader header;
+    if (file.size() < sizeof(header)) {
+        throw std::runtime_error("failed to read " + path + ", not a mesh file!");
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC)) != 0) {
+        throw std::runtime_error("failed to read " + path + ", not a mesh file!");
+    }
+    if (header.version != MESH_FILE_VERSION || header.vertexStride != sizeof(Vertex) 
+        || (header.indexSize != 2 && header.indexSize != 4)) {
+        throw std::runtime_error("failed to read " + path + ", the mesh was converted for another vertex layout!");
+    }
+    uint64_t vertexBytes = static_cast<uint64_t>(header.vertexCount) * sizeof(Vertex);
+    uint64_t indexBytes = static_cast<uint64_t>(header.indexCount) * header.indexSize;
+    if (file.size() < sizeof(header) + vertexBytes + indexBytes) {
+        throw std::runtime_error("failed to read " + path + ", the file is truncated!");
+    }
+    // Empty buffers can't be created, and the index buffer is drawn as a triangle list
+    if (header.vertexCount == 0 || header.indexCount == 0 || header.indexCount % 3 != 0) {
+        throw std::runtime_error("invalid mesh file " + path + ", it has no triangles!");
+    }
+    const char* indices = file.data() + sizeof(header) + vertexBytes;
+    for (uint32_t i = 0; i < header.indexCount; i++) {
+        uint32_t index = 0;
+        if (header.indexSize == 2) {
+            uint16_t shortIndex;
+            memcpy(&shortIndex, indices + i * sizeof(shortIndex), sizeof(shortIndex));
+            index = shortIndex;
+        } else {
+            memcpy(&index, indices + i * sizeof(index), sizeof(index));
+        }
+        if (index >= header.vertexCount) {
+            throw std::runtime_error("invalid mesh file " + path + ", index out of range!");
+        }
+    }
+
+    MeshData mesh;
+    mesh.vertexCount = header.vertexCount;
+    mesh.indexCount = header.indexCount;
+    mesh.indexType = header.indexSize == 2 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    mesh.boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    mesh.boundsMax = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+    // The header is 48 bytes, so the vertices are as aligned as the page aligned mapping needs them
+    mesh.vertices = reinterpret_cast<const Vertex*>(file.data() + sizeof(header));
+    mesh.indices = indices;
+    mesh.file = std::move(file);
+    return mesh;
+}
+
+/**
+ * Loads a Wavefront OBJ file, see https://paulbourke.net/dataformats/obj/
+ * 
+ * Reads the positions (with optional vertex colors), texture coordinates and faces, faces with more than
+ * three corners are split into a triangle fan. Corners with the same position and texture coordinate share
+ * a vertex. Normals, groups and materials are skipped. Slow compared to a .mesh file, convert large models.
+ */
+MeshData loadObj(FileView file, const std::string& path) {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> colors;
+    std::vector<glm::vec2> texCoords;
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    std::unordered_map<uint64_t, uint32_t> uniqueVertices; // Position and texture coordinate index to vertex
+
+    const char* cursor = file.data();
+    const char* end = file.data() + file.size();
+    uint32_t lineNumber = 0;
+
+    auto skipSpaces = [&]() {
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t')) cursor++;
+    };
+    auto readFloat = [&](float& value) {
+        skipSpaces();
+        auto result = std::from_chars(cursor, end, value);
+        if (result.ec != std::errc()) return false;
+        cursor = result.ptr;
+        return true;
+    };
+    auto fail = [&](const char* reason) {
+        return std::runtime_error("failed to read " + path + " line " + std::to_string(lineNumber) + ", " + reason + "!");
+    };
+    // OBJ indices start at 1, negative ones count back from the last element
+    auto resolveIndex = [&](long index, size_t count) {
+        long resolved = index < 0 ? static_cast<long>(count) + index : index - 1;
+        if (resolved < 0 || resolved >= static_cast<long>(count)) throw fail("index out of range");
+        return static_cast<uint32_t>(resolved);
+    };
+
+    while (cursor < end) {
+        lineNumber++;
+        const char* lineEnd = std::find(cursor, end, '\n');
+        skipSpaces();
+
+        if (lineEnd - cursor > 2 && cursor[0] == 'v' && cursor[1] == ' ') {
+            cursor += 2;
+            glm::vec3 position;
+            if (!readFloat(position.x) || !readFloat(position.y) || !readFloat(position.z)) throw fail("bad position");
+            // One more value is the optional weight w, which is ignored
+            // Three more are the vertex colors some exporters write after the position
+            float extra[3];
+            int extraCount = 0;
+            while (extraCount < 3 && readFloat(extra[extraCount])) extraCount++;
+            if (extraCount == 2) throw fail("bad vertex color");
+            glm::vec3 color = extraCount == 3 ? glm::vec3(extra[0], extra[1], extra[2]) : glm::vec3(1.0f);
+            positions.push_back(position);
+            colors.push_back(color);
+        } else if (lineEnd - cursor > 3 && cursor[0] == 'v' && cursor[1] == 't' && cursor[2] == ' ') {
+            cursor += 3;
+            glm::vec2 texCoord;
+            if (!readFloat(texCoord.x) || !readFloat(texCoord.y)) throw fail("bad texture coordinate");
+            // OBJ has (0,0) at the bottom left, the texture at the top left
+            texCoords.push_back(glm::vec2(texCoord.x, 1.0f - texCoord.y));
+        } else if (lineEnd - cursor > 2 && cursor[0] == 'f' && cursor[1] == ' ') {
+            cursor += 2;
+            std::vector<uint32_t> corners;
+            while (true) {
+                skipSpaces();
+                if (cursor >= lineEnd || *cursor == '\r') break;
+                // v, v/vt, v//vn or v/vt/vn
+                long positionIndex = 0, texCoordIndex = 0;
+                auto result = std::from_chars(cursor, lineEnd, positionIndex);
+                if (result.ec != std::errc()) throw fail("bad face");
+                cursor = result.ptr;
+                bool hasTexCoord = false;
+                if (cursor < lineEnd && *cursor == '/') {
+                    cursor++;
+                    result = std::from_chars(cursor, lineEnd, texCoordIndex);
+                    hasTexCoord = result.ec == std::errc();
+                    cursor = result.ptr;
+                    while (cursor < lineEnd && *cursor != ' ' && *cursor != '\t' && *cursor != '\r') cursor++; // The normal
+                }
+
+                uint32_t position = resolveIndex(positionIndex, positions.size());
+                uint32_t texCoord = hasTexCoord ? resolveIndex(texCoordIndex, texCoords.size()) : UINT32_MAX;
+                uint64_t key = (static_cast<uint64_t>(position) << 32) | texCoord;
+                auto [vertex, inserted] = uniqueVertices.try_emplace(key, static_cast<uint32_t>(vertices.size()));
+                if (inserted) {
+                    vertices.push_back({positions[position], colors[position], 
+                        hasTexCoord ? texCoords[texCoord] : glm::vec2(0.0f)});
+                }
+                corners.push_back(vertex->second);
+            }
+            if (corners.size() < 3) throw fail("face with fewer than 3 corners");
+            for (size_t i = 1; i + 1 < corners.size(); i++) {
+                indices.insert(indices.end(), {corners[0], corners[i], corners[i + 1]});
+            }
+        }
+        cursor = lineEnd < end ? lineEnd + 1 : end;
+    }
+
+    if (indices.empty()) {
+        throw std::runtime_error("failed to read " + path + ", there are no faces!");
+    }
+    return buildMesh(std::move(vertices), indices);
+}
+
+// Loads a mesh by its extension, .obj files are parsed and anything else is read as a .mesh file
+MeshData loadMesh(FileView file, const std::string& path) {
+    if (std::filesystem::path(path).extension() == ".obj") {
+        return loadObj(std::move(file), path);
+    }
+    return parseMesh(std::move(file), path);
+}
+
+// Writes a mesh as a .mesh file, which loads without any parsing
+void writeMeshFile(const MeshData& mesh, const std::string& path) {
+    MeshFileHeader header{};
+    memcpy(header.magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC));
+    header.version = MESH_FILE_VERSION;
+    header.vertexStride = sizeof(Vertex);
+    header.indexSize = mesh.indexSize();
+    header.vertexCount = mesh.vertexCount;
+    header.indexCount = mesh.indexCount;
+    for (int i = 0; i < 3; i++) {
+        header.boundsMin[i] = mesh.boundsMin[i];
+        header.boundsMax[i] = mesh.boundsMax[i];
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(mesh.vertices), static_cast<std::streamsize>(mesh.vertexCount) * sizeof(Vertex));
+    file.write(mesh.indices, static_cast<std::streamsize>(mesh.indexCount) * mesh.indexSize());
+    file.close();
+    if (!file) {
+        throw std::runtime_error("failed to write mesh file " + path + "!");
+    }
+}
+
+// The camera, only rewritten when it changes
 // alignas function is there to align the data as specified by vulkan
+// Every frame in flight has a slot in one uniform buffer, picked with a dynamic offset
 struct UniformBufferObject {
-    alignas(16) glm::mat4 model;
     alignas(16) glm::mat4 view;
     alignas(16) glm::mat4 proj;
 };
 
-class HelloTriangleApplication {
+// Per draw data of the graphics pipeline, too small to be worth a buffer
+// Matches PushConstants in shaders/vertex_shader.vert
+struct DrawConstants {
+    glm::mat4 model; // Transforms the mesh when it is animated
+};
+
+// Matches PushConstants in shaders/cull.comp
+struct CullConstants {
+    glm::mat4 model; // Same as DrawConstants::model, the spheres are moved by it
+    uint32_t objectCount; // The number of objects to test
+};
+
+// Upper limit of the threads recording secondary command buffers
+const uint32_t MAX_RECORDING_THREADS = 4;
+
+// One indexed draw of the scene
+// The draw list is split into slices that are recorded on separate threads
+// Every instance of a draw reads its transform from the instance buffer, starting at firstInstance
+struct DrawItem {
+    uint32_t indexCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t instanceCount;
+    uint32_t firstInstance;
+    glm::vec4 boundingSphere; // Center (xyz) and radius (w) enclosing all instances before the model matrix, used for culling
+};
+
+// A draw as seen by the culling compute shader, laid out to match CullObject in shaders/cull.comp (std430)
+struct CullObject {
+    glm::vec4 boundingSphere;
+    uint32_t indexCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+    uint32_t instanceCount;
+    uint32_t padding[3]; // std430 rounds the struct up to the alignment of the vec4
+};
+
+// Data of one instance, laid out to match InstanceData in shaders/vertex_shader.vert (std430)
+struct InstanceData {
+    glm::mat4 model; // Applied before the model matrix
+    uint32_t textureIndex; // Into the bindless texture array, ignored without bindless
+    uint32_t padding[3]; // std430 rounds the struct up to the alignment of the mat4
+};
+
+/**
+ * Four floats processed at once, with SSE on x86-64 and NEON on AArch64
+ * 
+ * Only the few operations the transform system needs. Both are part of the baseline of their 64 bit 
+ * architectures, so no extra compiler flags are needed. Other targets, 32 bit ARM too, get a plain loop.
+ */
+#if defined(__SSE2__)
+using Float4 = __m128;
+inline Float4 splat4(float value) { return _mm_set1_ps(value); }
+inline Float4 load4(const float* data) { return _mm_loadu_ps(data); }
+inline void store4(float* data, Float4 value) { _mm_storeu_ps(data, value); }
+inline Float4 add4(Float4 a, Float4 b) { return _mm_add_ps(a, b); }
+inline Float4 sub4(Float4 a, Float4 b) { return _mm_sub_ps(a, b); }
+inline Float4 mul4(Float4 a, Float4 b) { return _mm_mul_ps(a, b); }
+inline Float4 min4(Float4 a, Float4 b) { return _mm_min_ps(a, b); }
+inline Float4 max4(Float4 a, Float4 b) { return _mm_max_ps(a, b); }
+inline Float4 round4(Float4 value) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(value)); } // To nearest, the default rounding mode
+// Turns four rows into four columns
+inline void transpose4(Float4& a, Float4& b, Float4& c, Float4& d) { _MM_TRANSPOSE4_PS(a, b, c, d); }
+#elif defined(__aarch64__)
+using Float4 = float32x4_t;
+inline Float4 splat4(float value) { return vdupq_n_f32(value); }
+inline Float4 load4(const float* data) { return vld1q_f32(data); }
+inline void store4(float* data, Float4 value) { vst1q_f32(data, value); }
+inline Float4 add4(Float4 a, Float4 b) { return vaddq_f32(a, b); }
+inline Float4 sub4(Float4 a, Float4 b) { return vsubq_f32(a, b); }
+inline Float4 mul4(Float4 a, Float4 b) { return vmulq_f32(a, b); }
+inline Float4 min4(Float4 a, Float4 b) { return vminq_f32(a, b); }
+inline Float4 max4(Float4 a, Float4 b) { return vmaxq_f32(a, b); }
+inline Float4 round4(Float4 value) { return vrndnq_f32(value); }
+inline void transpose4(Float4& a, Float4& b, Float4& c, Float4& d) {
+    float32x4x2_t ab = vtrnq_f32(a, b);
+    float32x4x2_t cd = vtrnq_f32(c, d);
+    a = vcombine_f32(vget_low_f32(ab.val[0]), vget_low_f32(cd.val[0]));
+    b = vcombine_f32(vget_low_f32(ab.val[1]), vget_low_f32(cd.val[1]));
+    c = vcombine_f32(vget_high_f32(ab.val[0]), vget_high_f32(cd.val[0]));
+    d = vcombine_f32(vget_high_f32(ab.val[1]), vget_high_f32(cd.val[1]));
+}
+#else
+struct Float4 { float v[4]; };
+template<typename Op> inline Float4 map4(Float4 a, Float4 b, Op op) { 
+    return {{op(a.v[0], b.v[0]), op(a.v[1], b.v[1]), op(a.v[2], b.v[2]), op(a.v[3], b.v[3])}}; 
+}
+inline Float4 splat4(float value) { return {{value, value, value, value}}; }
+inline Float4 load4(const float* data) { return {{data[0], data[1], data[2], data[3]}}; }
+inline void store4(float* data, Float4 value) { memcpy(data, value.v, sizeof(value.v)); }
+inline Float4 add4(Float4 a, Float4 b) { return map4(a, b, [](float x, float y) { return x + y; }); }
+inline Float4 sub4(Float4 a, Float4 b) { return map4(a, b, [](float x, float y) { return x - y; }); }
+inline Float4 mul4(Float4 a, Float4 b) { return map4(a, b, [](float x, float y) { return x * y; }); }
+inline Float4 min4(Float4 a, Float4 b) { return map4(a, b, [](float x, float y) { return std::min(x, y); }); }
+inline Float4 max4(Float4 a, Float4 b) { return map4(a, b, [](float x, float y) { return std::max(x, y); }); }
+inline Float4 round4(Float4 value) { return map4(value, value, [](float x, float) { return std::nearbyint(x); }); }
+inline void transpose4(Float4& a, Float4& b, Float4& c, Float4& d) {
+    Float4 rows[4] = {a, b, c, d};
+    for (int i = 0; i < 4; i++) {
+        a.v[i] = rows[i].v[0]; b.v[i] = rows[i].v[1]; c.v[i] = rows[i].v[2]; d.v[i] = rows[i].v[3];
+    }
+}
+#endif
+
+/**
+ * Sine of four angles, within 4e-7 of std::sin for angles up to 20000 radians
+ * 
+ * The angle is wrapped to [-pi, pi] and folded onto [-pi/2, pi/2], where the Taylor series up to x^11 
+ * is within float precision. No table, no branches, so every lane runs the same instructions.
+ */
+inline Float4 sin4(Float4 x) {
+    const float pi = 3.14159265358979f;
+    // 2 pi split in two, the first part has few enough bits that turns * 6.28125 is exact (Cody-Waite)
+    Float4 turns = round4(mul4(x, splat4(0.5f / pi)));
+    x = sub4(x, mul4(turns, splat4(6.28125f)));
+    x = sub4(x, mul4(turns, splat4(0.00193530717958647692f)));
+    // sin(x) = sin(pi - x) = sin(-pi - x)
+    x = min4(x, sub4(splat4(pi), x));
+    x = max4(x, sub4(splat4(-pi), x));
+
+    Float4 x2 = mul4(x, x);
+    Float4 series = splat4(-1.0f / 39916800.0f);
+    series = add4(mul4(series, x2), splat4(1.0f / 362880.0f));
+    series = add4(mul4(series, x2), splat4(-1.0f / 5040.0f));
+    series = add4(mul4(series, x2), splat4(1.0f / 120.0f));
+    series = add4(mul4(series, x2), splat4(-1.0f / 6.0f));
+    series = add4(mul4(series, x2), splat4(1.0f));
+    return mul4(series, x);
+}
+
+/**
+ * The local transforms of the scene's objects, turned into world matrices in batches of four
+ * 
+ * The transforms are kept as structure of arrays: every component has its own array, so four objects'
+ * worth of a component is a single load. An object is placed at its position, turned about the Z (up)
+ * axis and uniformly scaled; the turn advances with time at the object's own spin rate.
+ * 
+ * update() only reads the arrays, so threads can each update a range of objects. The matrices are written
+ * with 16 byte stores straight into their InstanceData, the texture index next to them is left alone.
+ */
+class TransformSystem {
     public:
-        // This fuction is used to start the application
-        void run() {
-            initWindow();
-            initVulkan();
-            mainLoop();
-            cleanup();
+        void add(glm::vec3 position, float yaw, float scale, float spin) {
+            // Padding the arrays to whole batches, so the last batch can be loaded like any other
+            for (std::vector<float>* component : {&positionX, &positionY, &positionZ, &yaws, &scales, &spins}) {
+                component->resize((count + 4) & ~size_t(3));
+            }
+            positionX[count] = position.x;
+            positionY[count] = position.y;
+            positionZ[count] = position.z;
+            yaws[count] = yaw;
+            scales[count] = scale;
+            spins[count] = spin;
+            count++;
+        }
+
+        void clear() {
+            for (std::vector<float>* component : {&positionX, &positionY, &positionZ, &yaws, &scales, &spins}) {
+                component->clear();
+            }
+            count = 0;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        // Writes the world matrices of the objects [first, last) at time into instances[first, last)
+        // first has to be a multiple of 4
+        void update(float time, size_t first, size_t last, InstanceData* instances) const {
+            Float4 timeSplat = splat4(time);
+            Float4 zero = splat4(0.0f);
+            Float4 one = splat4(1.0f);
+            for (size_t i = first; i < last; i += 4) {
+                Float4 angle = add4(load4(&yaws[i]), mul4(load4(&spins[i]), timeSplat));
+                Float4 scale = load4(&scales[i]);
+                Float4 sine = mul4(sin4(angle), scale);
+                Float4 cosine = mul4(sin4(add4(angle, splat4(1.57079632679f))), scale);
+
+                // Every row holds one matrix element of the four objects, the transposes make columns of them
+                Float4 columns[4][4] = {
+                    {cosine, sine, zero, zero},
+                    {sub4(zero, sine), cosine, zero, zero},
+                    {zero, zero, scale, zero},
+                    {load4(&positionX[i]), load4(&positionY[i]), load4(&positionZ[i]), one},
+                };
+                for (auto& column : columns) {
+                    transpose4(column[0], column[1], column[2], column[3]);
+                }
+
+                size_t batch = std::min<size_t>(4, last - i);
+                for (size_t object = 0; object < batch; object++) {
+                    float* model = &instances[i + object].model[0][0];
+                    for (int column = 0; column < 4; column++) {
+                        store4(model + 4 * column, columns[column][object]);
+                    }
+                }
+            }
+        }
+
+    private:
+        std::vector<float> positionX, positionY, positionZ;
+        std::vector<float> yaws; // Radians about Z at time 0
+        std::vector<float> scales;
+        std::vector<float> spins; // Radians per second
+        size_t count = 0;
+};
+
+// Work group size of shaders/cull.comp
+const uint32_t CULL_WORKGROUP_SIZE = 64;
+
+/**
+ * A stage of the graphics pipeline, as GLSL source and as the SPIR-V compile.sh makes of it
+ * 
+ * Built with shaderc (make SHADERC=1) hot reloading compiles the source, otherwise it reloads the binary
+ * whenever compile.sh has been run again.
+ */
+struct ShaderStageFiles {
+    std::string source;
+    std::string binary;
+    VkShaderStageFlagBits stage;
+    std::vector<std::string> defines; // Preprocessor macros, matching the glslc -D flags of compile.sh
+};
+
+// The file hot reloading watches for a stage
+const std::string& watchedShaderFile(const ShaderStageFiles& files) {
+#ifdef HT_SHADERC
+    return files.source;
+#else
+    return files.binary;
+#endif
+}
+
+// Compiles a stage to SPIR-V, or reads the compiled binary without shaderc
+// Throws with the compiler messages when it doesn't compile
+std::vector<uint32_t> loadShaderStage(const ShaderStageFiles& files) {
+#ifdef HT_SHADERC
+    std::ifstream file(files.source);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file " + files.source + "!");
+    }
+    std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    shaderc::Compiler compiler;
+    shaderc::CompileOptions options;
+    options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_2);
+    options.SetOptimizationLevel(shaderc_optimization_level_performance);
+    for (const std::string& define : files.defines) {
+        options.AddMacroDefinition(define);
+    }
+    shaderc_shader_kind kind = files.stage == VK_SHADER_STAGE_VERTEX_BIT ? shaderc_glsl_vertex_shader 
+        : files.stage == VK_SHADER_STAGE_FRAGMENT_BIT ? shaderc_glsl_fragment_shader : shaderc_glsl_compute_shader;
+    shaderc::SpvCompilationResult result = compiler.CompileGlslToSpv(source, kind, files.source.c_str(), options);
+    if (result.GetCompilationStatus() != shaderc_compilation_status_success) {
+        throw std::runtime_error("failed to compile " + files.source + "!\n" + result.GetErrorMessage());
+    }
+    return std::vector<uint32_t>(result.cbegin(), result.cend());
+#else
+    // glslc may still be truncating and rewriting the file, so it is read instead of mapped
+    // A mapping faults on pages past the new end of the file, a read just comes up short
+    std::ifstream file(files.binary, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file " + files.binary + "!");
+    }
+    size_t fileSize = static_cast<size_t>(file.tellg());
+    std::vector<uint32_t> code(fileSize / sizeof(uint32_t));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(code.data()), static_cast<std::streamsize>(code.size() * sizeof(uint32_t)));
+    // A short read, a size that isn't whole words or a missing header is a file glslc isn't done with
+    if (!file || code.size() < 5 || fileSize % sizeof(uint32_t) != 0 || code[0] != 0x07230203) {
+        throw std::runtime_error("incomplete SPIR-V in " + files.binary + "!");
+    }
+    return code;
+#endif
+}
+
+/**
+ * Polls files for changes on its own thread and calls a function when any of them was written
+ * 
+ * The function runs on the watcher thread, so slow work like compiling shaders never holds up a frame.
+ * Polling the modification times twice a second is cheap and works on every platform.
+ */
+class FileWatcher {
+    public:
+        void start(std::vector<std::string> watchedPaths, std::function<void()> changed) {
+            paths = std::move(watchedPaths);
+            onChange = std::move(changed);
+            stopping = false;
+            writeTimes.clear();
+            for (const std::string& path : paths) {
+                writeTimes.push_back(lastWriteTime(path));
+            }
+            thread = std::thread(&FileWatcher::watchLoop, this);
+        }
+
+        void stop() {
+            if (!thread.joinable()) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            thread.join();
+        }
+
+        ~FileWatcher() {
+            stop();
         }
 
     private:
+        // A missing file, e.g. while an editor replaces it, counts as unchanged
+        static std::filesystem::file_time_type lastWriteTime(const std::string& path) {
+            std::error_code error;
+            auto time = std::filesystem::last_write_time(path, error);
+            return error ? std::filesystem::file_time_type::min() : time;
+        }
+
+        void watchLoop() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!wake.wait_for(lock, std::chrono::milliseconds(500), [this] { return stopping; })) {
+                bool changed = false;
+                for (size_t i = 0; i < paths.size(); i++) {
+                    auto time = lastWriteTime(paths[i]);
+                    if (time != std::filesystem::file_time_type::min() && time != writeTimes[i]) {
+                        writeTimes[i] = time;
+                        changed = true;
+                    }
+                }
+                if (changed) {
+                    lock.unlock();
+                    onChange();
+                    lock.lock();
+                }
+            }
+        }
+
+        std::vector<std::string> paths;
+        std::vector<std::filesystem::file_time_type> writeTimes;
+        std::function<void()> onChange;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake; // Signaled when stopping
+        bool stopping = false;
+};
+
+/**
+ * Worker threads taking tasks from a shared queue, first in first out
+ *
+ * Unlike the RecordingThreadPool the tasks are independent, push() returns right away and any
+ * free worker runs the task. Tasks report their results themselves (e.g. through a promise).
+ */
+class WorkQueue {
+    public:
+        void start(uint32_t threadCount) {
+            stopping = false;
+            for (uint32_t i = 0; i < threadCount; i++) {
+                workers.emplace_back(&WorkQueue::workerLoop, this);
+            }
+        }
+
+        // Finishes the queued tasks, then joins the workers
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            workers.clear();
+        }
+
+        void push(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back(std::move(task));
+            }
+            wake.notify_one();
+        }
+
+        ~WorkQueue() {
+            stop(); // Joins the workers if it wasn't stopped, e.g. when initialisation throws
+        }
+
+    private:
+        void workerLoop() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return; // Only when stopping
+
+                std::function<void()> task = std::move(tasks.front());
+                tasks.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake; // Signaled when a task is queued or the queue stops
+        std::deque<std::function<void()>> tasks;
+        bool stopping = false;
+};
+
+/**
+ * Everything that tells two graphics pipelines apart
+ * 
+ * The rest of the state (viewport, multisampling, layout) is the same for every pipeline of the application.
+ * Equal descriptions always produce the same pipeline, so they share it through the PipelineRegistry.
+ */
+struct PipelineDesc {
+    std::string vertexShader; // SPIR-V file
+    std::string fragmentShader;
+    bool packedVertices = false; // PackedVertex or Vertex input layout
+    bool blend = false; // Alpha blending, opaque otherwise
+    VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+    VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    VkFormat colorFormat = VK_FORMAT_UNDEFINED; // The render target formats, used by dynamic rendering
+    VkFormat depthFormat = VK_FORMAT_UNDEFINED; // Undefined without a depth attachment
+    VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+
+    bool operator==(const PipelineDesc&) const = default;
+};
+
+struct PipelineDescHash {
+    size_t operator()(const PipelineDesc& desc) const {
+        // Boost style hash combining, the fields are few and small
+        size_t seed = std::hash<std::string>{}(desc.vertexShader);
+        auto combine = [&seed](size_t value) { seed ^= value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2); };
+        combine(std::hash<std::string>{}(desc.fragmentShader));
+        combine(desc.packedVertices | desc.blend << 1);
+        combine(desc.cullMode);
+        combine(desc.topology);
+        combine(desc.colorFormat);
+        combine(desc.depthFormat);
+        combine(desc.samples);
+        return seed;
+    }
+};
+
+/**
+ * Creates each graphics pipeline once and hands out the same VkPipeline for equal descriptions
+ * 
+ * A pipeline is created the first time get() asks for it, or ahead of time on a worker thread by prewarm().
+ * Entries hold a shared future, so a description asked for while it is compiling waits for that compile
+ * instead of starting another one. The builder runs without the lock held and has to be thread safe,
+ * vkCreateGraphicsPipelines with an internally synchronized pipeline cache is.
+ */
+class PipelineRegistry {
+    public:
+        using Builder = std::function<VkPipeline(const PipelineDesc&)>;
+
+        void start(Builder pipelineBuilder, uint32_t threadCount) {
+            build = std::move(pipelineBuilder);
+            compilers.start(threadCount);
+        }
+
+        // Waits for the prewarming compiles
+        void stop() {
+            compilers.stop();
+        }
+
+        // Returns the pipeline of the description, creating it if nobody did yet
+        VkPipeline get(const PipelineDesc& desc) {
+            std::shared_ptr<std::promise<VkPipeline>> promise;
+            std::shared_future<VkPipeline> pipeline = lookup(desc, promise);
+            if (promise) {
+                compile(desc, *promise);
+            }
+            return pipeline.get(); // Rethrows the error of a failed compile
+        }
+
+        // Starts compiling the description on a worker thread, if it isn't known yet
+        void prewarm(const PipelineDesc& desc) {
+            std::shared_ptr<std::promise<VkPipeline>> promise;
+            lookup(desc, promise);
+            if (promise) {
+                compilers.push([this, desc, promise]() { compile(desc, *promise); });
+            }
+        }
+
+        std::vector<PipelineDesc> descriptions() {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<PipelineDesc> result;
+            for (const auto& [desc, pipeline] : pipelines) {
+                result.push_back(desc);
+            }
+            return result;
+        }
+
+        // Puts a rebuilt pipeline in place of the current one, which is returned for retiring
+        // The returned pipeline may still be compiling on a worker, so it isn't waited for here
+        std::shared_future<VkPipeline> replace(const PipelineDesc& desc, VkPipeline pipeline) {
+            std::promise<VkPipeline> ready;
+            ready.set_value(pipeline);
+            std::lock_guard<std::mutex> lock(mutex);
+            return std::exchange(pipelines[desc], ready.get_future().share());
+        }
+
+        // Hands every pipeline back for destruction and forgets them, call after stop()
+        std::vector<VkPipeline> clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<VkPipeline> result;
+            for (auto& [desc, pipeline] : pipelines) {
+                try {
+                    result.push_back(pipeline.get());
+                } catch (const std::exception&) {
+                    // The compile failed, there is nothing to destroy
+                }
+            }
+            pipelines.clear();
+            return result;
+        }
+
+    private:
+        // Finds the entry of the description, or adds one and hands out the promise to fulfil it
+        std::shared_future<VkPipeline> lookup(const PipelineDesc& desc, std::shared_ptr<std::promise<VkPipeline>>& promise) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto entry = pipelines.find(desc);
+            if (entry != pipelines.end()) {
+                return entry->second;
+            }
+            promise = std::make_shared<std::promise<VkPipeline>>();
+            std::shared_future<VkPipeline> pipeline = promise->get_future().share();
+            pipelines.emplace(desc, pipeline);
+            return pipeline;
+        }
+
+        void compile(const PipelineDesc& desc, std::promise<VkPipeline>& promise) {
+            try {
+                promise.set_value(build(desc));
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+            }
+        }
+
+        Builder build;
+        WorkQueue compilers;
+        std::mutex mutex; // Guards pipelines
+        std::unordered_map<PipelineDesc, std::shared_future<VkPipeline>, PipelineDescHash> pipelines;
+};
+
+/**
+ * Loads assets in the background, in two stages
+ *
+ * 1. The file is mapped and read in on a single I/O thread, so reads don't compete for the disk
+ * 2. The mapped bytes are decoded on a pool of decode threads, one per spare core
+ *
+ * The result is handed back through a future. Staging and uploading stay on the main thread, which
+ * owns the upload recorder. Assets requested early decode while the device and pipelines are created,
+ * and many assets decode in parallel.
+ */
+class AssetLoader {
+    public:
+        void start() {
+            uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+            io.start(1);
+            decoders.start(std::max(1u, cores - 1)); // The main thread keeps a core
+        }
+
+        void stop() {
+            io.stop(); // Queues the last decodes before the decoders stop
+            decoders.stop();
+        }
+
+        /**
+         * Maps path, then runs decode(file, path) on a decode thread
+         * 
+         * An exception from reading or decoding is rethrown by the future's get()
+         */
+        template<typename T>
+        std::future<T> load(const std::string& path, std::function<T(FileView, const std::string&)> decode) {
+            auto promise = std::make_shared<std::promise<T>>();
+            std::future<T> future = promise->get_future();
+            io.push([this, path, decode, promise]() {
+                auto file = std::make_shared<FileView>();
+                if (!file->open(path)) {
+                    promise->set_exception(std::make_exception_ptr(std::runtime_error("failed to open file " + path + "!")));
+                    return;
+                }
+                decoders.push([path, decode, promise, file]() {
+                    try {
+                        promise->set_value(decode(std::move(*file), path));
+                    } catch (...) {
+                        promise->set_exception(std::current_exception());
+                    }
+                });
+            });
+            return future;
+        }
+
+        ~AssetLoader() {
+            stop();
+        }
+
+    private:
+        WorkQueue io;
+        WorkQueue decoders;
+};
+
+/**
+ * A fixed set of worker threads that run one task per thread and wait for all of them
+ *
+ * Work is always handed to the worker with the same index, so anything owned by a thread
+ * (like its command pools) is only touched by that thread.
+ * An exception thrown by a task is rethrown on the calling thread by run().
+ */
+class RecordingThreadPool {
+    public:
+        void start(uint32_t threadCount) {
+            for (uint32_t i = 0; i < threadCount; i++) {
+                workers.emplace_back(&RecordingThreadPool::workerLoop, this, i);
+            }
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            workers.clear();
+        }
+
+        uint32_t threadCount() const {
+            return static_cast<uint32_t>(workers.size());
+        }
+
+        // Runs task(i) on worker i for every i below count and blocks until they all returned
+        void run(uint32_t count, const std::function<void(uint32_t)>& function) {
+            if (count == 0) return;
+            if (count > workers.size()) {
+                throw std::invalid_argument("more tasks than recording threads!");
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            task = &function;
+            taskCount = count;
+            pending = count;
+            error = nullptr;
+            generation++;
+            wake.notify_all();
+
+            done.wait(lock, [this] { return pending == 0; });
+            task = nullptr;
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+    private:
+        void workerLoop(uint32_t index) {
+            uint64_t seenGeneration = 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+                if (stopping) return;
+                seenGeneration = generation;
+                if (index >= taskCount) continue;
+
+                // The task runs unlocked so the workers record in parallel
+                const std::function<void(uint32_t)>* function = task;
+                lock.unlock();
+                std::exception_ptr taskError;
+                try {
+                    (*function)(index);
+                } catch (...) {
+                    taskError = std::current_exception();
+                }
+                lock.lock();
+
+                if (taskError && !error) {
+                    error = taskError;
+                }
+                if (--pending == 0) {
+                    done.notify_one();
+                }
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake; // Signaled when there is new work or the pool stops
+        std::condition_variable done; // Signaled when the last task of a run finished
+        const std::function<void(uint32_t)>* task = nullptr;
+        uint32_t taskCount = 0;
+        uint32_t pending = 0; // Tasks of the current run that haven't finished
+        uint64_t generation = 0; // Incremented for every run so the workers notice new work
+        bool stopping = false;
+        std::exception_ptr error; // First exception thrown by a task of the current run
+};
+
+// Size of the device memory blocks the allocator sub-allocates from
+const VkDeviceSize MEMORY_BLOCK_SIZE = 64 * 1024 * 1024; // 64 MiB
+
+// A region of device memory handed out by the DeviceMemoryAllocator
+// Resources are bound to (memory, offset) instead of owning a VkDeviceMemory each
+struct MemoryAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE; // The block the region lives in. Owned by the allocator
+    VkDeviceSize offset = 0;    // Offset of the region from the start of the block
+    VkDeviceSize size = 0;      // Size of the region in bytes
+    void* mapped = nullptr;     // CPU pointer to the region if the block is host visible, else nullptr
+    uint32_t memoryTypeIndex = 0; // Memory type the block was allocated from
+    uint32_t blockIndex = 0;    // Index of the block in its pool, used when freeing
+    bool linear = true;         // Buffers and linear images are kept apart from optimal images
+};
+
+// Usage numbers of the allocator, summed over all memory types
+struct MemoryStats {
+    uint32_t blockCount = 0;        // No. of vkAllocateMemory calls currently alive
+    uint32_t allocationCount = 0;   // No. of sub-allocations currently alive
+    VkDeviceSize blockBytes = 0;    // Bytes reserved from the driver
+    VkDeviceSize usedBytes = 0;     // Bytes handed out to resources
+};
+
+/**
+ * Sub-allocates buffers and images from a few large VkDeviceMemory blocks
+ *
+ * Drivers limit the no. of live allocations (maxMemoryAllocationCount, as low as 4096) and
+ * vkAllocateMemory is slow, so instead of one allocation per resource we allocate big blocks
+ * for each memory type and hand out aligned regions of them.
+ *
+ * Every block keeps a free list of (offset, size) ranges sorted by offset. Allocation is first fit
+ * and freed ranges are merged with their neighbours so the space can be reused.
+ *
+ * Linear resources (buffers) and optimal images live in separate blocks so we never have to
+ * care about bufferImageGranularity.
+ * Host visible blocks are mapped once when created and stay mapped until destroyed.
+ */
+class DeviceMemoryAllocator {
+    public:
+        void init(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize blockSize = MEMORY_BLOCK_SIZE) {
+            this->device = device;
+            this->blockSize = blockSize;
+            vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+            maxAllocationCount = properties.limits.maxMemoryAllocationCount;
+        }
+
+        /**
+         * Finds space for a resource in a block of the given memory type
+         * Creates a new block if none of the existing ones have enough space
+         *
+         * @param requirements Size, alignment and memory types of the resource
+         * @param memoryTypeIndex Memory type to allocate from, as returned by findMemoryType
+         * @param linear True for buffers and linear images, false for optimal images
+         */
+        MemoryAllocation allocate(const VkMemoryRequirements& requirements, uint32_t memoryTypeIndex, bool linear) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<MemoryBlock>& pool = pools[poolIndex(memoryTypeIndex, linear)];
+
+            MemoryAllocation allocation{};
+            allocation.memoryTypeIndex = memoryTypeIndex;
+            allocation.linear = linear;
+            allocation.size = requirements.size;
+
+            // First fit over the existing blocks
+            for (uint32_t i = 0; i < pool.size(); i++) {
+                if (pool[i].memory != VK_NULL_HANDLE && carve(pool[i], requirements.size, requirements.alignment, allocation.offset)) {
+                    return finish(pool[i], i, allocation);
+                }
+            }
+
+            // Resources bigger than a block get a block of their own
+            VkDeviceSize newBlockSize = std::max(blockSize, requirements.size);
+            // Keeping blocks small on small heaps (like the 256 MiB host visible VRAM window)
+            VkDeviceSize heapSize = memProperties.memoryHeaps[memProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+            if (newBlockSize > heapSize / 4 && requirements.size <= heapSize / 4) {
+                newBlockSize = heapSize / 4;
+            }
+
+            uint32_t blockIndex = createBlock(pool, memoryTypeIndex, newBlockSize);
+            if (!carve(pool[blockIndex], requirements.size, requirements.alignment, allocation.offset)) {
+                throw std::runtime_error("failed to sub-allocate device memory!");
+            }
+            return finish(pool[blockIndex], blockIndex, allocation);
+        }
+
+        // Returns the region to the free list of its block
+        // The handle is reset so that freeing twice is harmless
+        void free(MemoryAllocation& allocation) {
+            if (allocation.memory == VK_NULL_HANDLE) return;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<MemoryBlock>& pool = pools[poolIndex(allocation.memoryTypeIndex, allocation.linear)];
+            MemoryBlock& block = pool[allocation.blockIndex];
+
+            // Inserting the range and merging it with the free ranges right before and after it
+            VkDeviceSize offset = allocation.offset;
+            VkDeviceSize size = allocation.size;
+            auto next = block.freeRanges.lower_bound(offset);
+            if (next != block.freeRanges.end() && offset + size == next->first) {
+                size += next->second;
+                next = block.freeRanges.erase(next);
+            }
+            if (next != block.freeRanges.begin()) {
+                auto prev = std::prev(next);
+                if (prev->first + prev->second == offset) {
+                    offset = prev->first;
+                    size += prev->second;
+                    block.freeRanges.erase(prev);
+                }
+            }
+            block.freeRanges[offset] = size;
+
+            block.usedBytes -= allocation.size;
+            block.allocationCount--;
+
+            // Keeping one empty block around for reuse, releasing the rest back to the driver
+            if (block.allocationCount == 0) {
+                bool otherEmptyBlock = false;
+                for (uint32_t i = 0; i < pool.size(); i++) {
+                    if (i != allocation.blockIndex && pool[i].memory != VK_NULL_HANDLE && pool[i].allocationCount == 0) {
+                        otherEmptyBlock = true;
+                    }
+                }
+                if (otherEmptyBlock || block.size > blockSize) {
+                    destroyBlock(block);
+                }
+            }
+
+            allocation = MemoryAllocation{};
+        }
+
+        MemoryStats getStats() {
+            std::lock_guard<std::mutex> lock(mutex);
+            MemoryStats stats{};
+            for (const auto& pool : pools) {
+                for (const auto& block : pool) {
+                    if (block.memory == VK_NULL_HANDLE) continue;
+                    stats.blockCount++;
+                    stats.allocationCount += block.allocationCount;
+                    stats.blockBytes += block.size;
+                    stats.usedBytes += block.usedBytes;
+                }
+            }
+            return stats;
+        }
+
+        // Prints the usage of every memory type that has at least one block
+        void printStats(std::ostream& out) {
+            std::lock_guard<std::mutex> lock(mutex);
+            out << "device memory:" << std::endl;
+            for (uint32_t type = 0; type < memProperties.memoryTypeCount; type++) {
+                for (bool linear : {true, false}) {
+                    uint32_t blocks = 0, allocations = 0;
+                    VkDeviceSize reserved = 0, used = 0;
+                    for (const auto& block : pools[poolIndex(type, linear)]) {
+                        if (block.memory == VK_NULL_HANDLE) continue;
+                        blocks++;
+                        allocations += block.allocationCount;
+                        reserved += block.size;
+                        used += block.usedBytes;
+                    }
+                    if (blocks == 0) continue;
+                    out << "  type " << type << (linear ? " (linear): " : " (optimal): ")
+                        << allocations << " allocations in " << blocks << " blocks, "
+                        << used / 1024 << " KiB used of " << reserved / 1024 << " KiB" << std::endl;
+                }
+            }
+            out << "  " << liveBlockCount << " of " << maxAllocationCount << " vkAllocateMemory allocations in use" << std::endl;
+        }
+
+        // Frees every block. All resources bound to them must already be destroyed
+        void destroy() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& pool : pools) {
+                for (auto& block : pool) {
+                    destroyBlock(block);
+                }
+                pool.clear();
+            }
+        }
+
+    private:
+        struct MemoryBlock {
+            VkDeviceMemory memory = VK_NULL_HANDLE;
+            VkDeviceSize size = 0;
+            void* mapped = nullptr;
+            std::map<VkDeviceSize, VkDeviceSize> freeRanges; // offset -> size of the unused ranges
+            VkDeviceSize usedBytes = 0;
+            uint32_t allocationCount = 0;
+        };
+
+        VkDevice device = VK_NULL_HANDLE;
+        VkPhysicalDeviceMemoryProperties memProperties{};
+        VkDeviceSize blockSize = MEMORY_BLOCK_SIZE;
+        uint32_t maxAllocationCount = 0;
+        uint32_t liveBlockCount = 0;
+
+        // One list of blocks per (memory type, linear) pair
+        std::array<std::vector<MemoryBlock>, VK_MAX_MEMORY_TYPES * 2> pools;
+        std::mutex mutex;
+
+        static uint32_t poolIndex(uint32_t memoryTypeIndex, bool linear) {
+            return memoryTypeIndex * 2 + (linear ? 0 : 1);
+        }
+
+        // Searches the free list of a block for a range that fits the size after aligning its start
+        // On success the range is split and the aligned offset is returned through offset
+        static bool carve(MemoryBlock& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset) {
+            for (auto it = block.freeRanges.begin(); it != block.freeRanges.end(); it++) {
+                VkDeviceSize rangeStart = it->first;
+                VkDeviceSize rangeEnd = it->first + it->second;
+                // Alignment is always a power of two
+                VkDeviceSize alignedStart = (rangeStart + alignment - 1) & ~(alignment - 1);
+                if (alignedStart + size > rangeEnd) continue;
+
+                block.freeRanges.erase(it);
+                // The padding in front and the rest after the region stay free
+                if (alignedStart > rangeStart) {
+                    block.freeRanges[rangeStart] = alignedStart - rangeStart;
+                }
+                if (alignedStart + size < rangeEnd) {
+                    block.freeRanges[alignedStart + size] = rangeEnd - (alignedStart + size);
+                }
+                offset = alignedStart;
+                return true;
+            }
+            return false;
+        }
+
+        static MemoryAllocation finish(MemoryBlock& block, uint32_t blockIndex, MemoryAllocation allocation) {
+            block.usedBytes += allocation.size;
+            block.allocationCount++;
+            allocation.memory = block.memory;
+            allocation.blockIndex = blockIndex;
+            allocation.mapped = block.mapped ? static_cast<char*>(block.mapped) + allocation.offset : nullptr;
+            return allocation;
+        }
+
+        // Allocates a new block, reusing the slot of a released block if there is one
+        uint32_t createBlock(std::vector<MemoryBlock>& pool, uint32_t memoryTypeIndex, VkDeviceSize size) {
+            VkMemoryAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            allocInfo.allocationSize = size;
+            allocInfo.memoryTypeIndex = memoryTypeIndex;
+
+            MemoryBlock block{};
+            block.size = size;
+            if (vkAllocateMemory(device, &allocInfo, nullptr, &block.memory) != VK_SUCCESS) {
+                throw std::runtime_error("failed to allocate device memory block!");
+            }
+            liveBlockCount++;
+
+            // Mapping host visible blocks once for their whole lifetime
+            if (memProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+                if (vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to map device memory block!");
+                }
+            }
+            block.freeRanges[0] = size;
+
+            for (uint32_t i = 0; i < pool.size(); i++) {
+                if (pool[i].memory == VK_NULL_HANDLE) {
+                    pool[i] = std::move(block);
+                    return i;
+                }
+            }
+            pool.push_back(std::move(block));
+            return static_cast<uint32_t>(pool.size() - 1);
+        }
+
+        // Releases the memory of a block but keeps its slot so block indices stay valid
+        void destroyBlock(MemoryBlock& block) {
+            if (block.memory == VK_NULL_HANDLE) return;
+            // Freeing the memory also unmaps it
+            vkFreeMemory(device, block.memory, nullptr);
+            liveBlockCount--;
+            block = MemoryBlock{};
+        }
+};
+
+// Size of the persistently mapped buffer every upload is staged through
+const VkDeviceSize STAGING_RING_SIZE = 64 * 1024 * 1024; // 64 MiB
+
+// A piece of the staging ring reserved for one upload
+struct StagingRegion {
+    VkBuffer buffer = VK_NULL_HANDLE; // The ring buffer, used as the source of the copy
+    VkDeviceSize offset = 0;  // Offset of the region in the ring buffer
+    VkDeviceSize size = 0;
+    void* data = nullptr;     // CPU pointer to write the upload data to
+};
+
+/**
+ * Hands out pieces of one host visible buffer for staging uploads
+ *
+ * Instead of creating, mapping and destroying a staging buffer for every upload, uploads are written
+ * one after the other into a ring buffer that stays mapped for the lifetime of the application.
+ *
+ * The space can't be reused until the GPU has finished the copies reading from it, so every submission
+ * tags the regions allocated since the previous one with a value. Once the GPU has completed that
+ * value, reclaim() moves the tail past them.
+ *
+ * Head and tail are virtual offsets that only ever grow, the real offset is the value modulo the size.
+ */
+class StagingRing {
+    public:
+        void init(VkBuffer buffer, void* mapped, VkDeviceSize size) {
+            this->buffer = buffer;
+            this->mapped = static_cast<char*>(mapped);
+            this->size = size;
+            head = tail = 0;
+            inFlight.clear();
+        }
+
+        // Reserves size bytes with the given alignment (a power of two)
+        // Returns false if the ring doesn't have enough free space right now
+        bool tryAllocate(VkDeviceSize allocationSize, VkDeviceSize alignment, StagingRegion& region) {
+            if (allocationSize > size) {
+                throw std::runtime_error("upload is larger than the staging ring!");
+            }
+
+            VkDeviceSize start = (head + alignment - 1) & ~(alignment - 1);
+            // Regions never wrap around the end of the buffer, skipping to the beginning instead
+            if (start % size + allocationSize > size) {
+                start = (start / size + 1) * size;
+            }
+            if (start + allocationSize - tail > size) {
+                return false;
+            }
+
+            head = start + allocationSize;
+            region.buffer = buffer;
+            region.offset = start % size;
+            region.size = allocationSize;
+            region.data = mapped + region.offset;
+            return true;
+        }
+
+        // Everything allocated since the last call is read by the work that signals value
+        void submit(uint64_t value) {
+            if (head == (inFlight.empty() ? tail : inFlight.back().second)) return; // Nothing new
+            inFlight.emplace_back(value, head);
+        }
+
+        // Frees the regions of all submissions up to and including completedValue
+        void reclaim(uint64_t completedValue) {
+            while (!inFlight.empty() && inFlight.front().first <= completedValue) {
+                tail = inFlight.front().second;
+                inFlight.pop_front();
+            }
+        }
+
+        // Value of the oldest submission still holding space, false if there is none
+        bool oldestInFlight(uint64_t& value) const {
+            if (inFlight.empty()) return false;
+            value = inFlight.front().first;
+            return true;
+        }
+
+    private:
+        VkBuffer buffer = VK_NULL_HANDLE;
+        char* mapped = nullptr;
+        VkDeviceSize size = 0;
+        VkDeviceSize head = 0; // Where the next region is allocated
+        VkDeviceSize tail = 0; // Start of the oldest region the GPU may still read
+        std::deque<std::pair<uint64_t, VkDeviceSize>> inFlight; // (value, head after the submission)
+};
+
+/**
+ * Collects the commands of an upload batch and records them with as few barriers as possible
+ *
+ * Every upload follows the same pattern: make the destination writable, copy, then hand it to the
+ * stage that reads it. Instead of a pipeline barrier around every copy, the barriers are queued into
+ * three groups and each group becomes a single vkCmdPipelineBarrier:
+ *
+ * - BEFORE_COPIES: layout changes into TRANSFER_DST
+ * - AFTER_COPIES: making the copies visible, or releasing them to another queue family
+ * - ACQUIRE: acquiring released resources, recorded on the graphics queue
+ *
+ * Work that needs a graphics queue (e.g. blitting mip levels) is queued with graphicsCommands() and
+ * recorded after the acquire barriers, on the graphics queue.
+ *
+ * Copies between the same pair of resources are merged into one command with several regions.
+ * Each resource is expected to be written once per batch, as nothing orders two copies to the same place.
+ */
+class UploadRecorder {
+    public:
+        enum Phase { BEFORE_COPIES, AFTER_COPIES, ACQUIRE };
+
+        void bufferBarrier(Phase phase, const VkBufferMemoryBarrier& barrier, 
+            VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage) {
+            BarrierGroup& group = groups[phase];
+            group.buffers.push_back(barrier);
+            group.srcStages |= srcStage;
+            group.dstStages |= dstStage;
+        }
+
+        void imageBarrier(Phase phase, const VkImageMemoryBarrier& barrier, 
+            VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage) {
+            BarrierGroup& group = groups[phase];
+            group.images.push_back(barrier);
+            group.srcStages |= srcStage;
+            group.dstStages |= dstStage;
+        }
+
+        void copyBuffer(VkBuffer src, VkBuffer dst, const VkBufferCopy& region) {
+            if (bufferCopies.empty() || bufferCopies.back().src != src || bufferCopies.back().dst != dst) {
+                bufferCopies.push_back({src, dst, {}});
+            }
+            bufferCopies.back().regions.push_back(region);
+        }
+
+        void copyBufferToImage(VkBuffer src, VkImage dst, const VkBufferImageCopy& region) {
+            if (imageCopies.empty() || imageCopies.back().src != src || imageCopies.back().dst != dst) {
+                imageCopies.push_back({src, dst, {}});
+            }
+            imageCopies.back().regions.push_back(region);
+        }
+
+        // Commands recorded once the copies are done and released resources are acquired
+        void graphicsCommands(std::function<void(VkCommandBuffer)> commands) {
+            graphicsWork.push_back(std::move(commands));
+        }
+
+        bool empty() const {
+            return bufferCopies.empty() && imageCopies.empty() && graphicsWork.empty()
+                && groups[BEFORE_COPIES].empty() && groups[AFTER_COPIES].empty() && groups[ACQUIRE].empty();
+        }
+
+        // Stages the acquire barriers wait at, the acquiring submission waits on its semaphore there
+        VkPipelineStageFlags acquireStages() const {
+            return groups[ACQUIRE].dstStages;
+        }
+
+        // Records the queued commands into the transfer command buffer
+        // The acquire barriers and graphics commands go into acquireCommandBuffer, 
+        // which is VK_NULL_HANDLE if the transfer command buffer runs on the graphics queue
+        void record(VkCommandBuffer commandBuffer, VkCommandBuffer acquireCommandBuffer) const {
+            groups[BEFORE_COPIES].record(commandBuffer);
+            for (const auto& copy : bufferCopies) {
+                vkCmdCopyBuffer(commandBuffer, copy.src, copy.dst, static_cast<uint32_t>(copy.regions.size()), copy.regions.data());
+            }
+            for (const auto& copy : imageCopies) {
+                vkCmdCopyBufferToImage(commandBuffer, copy.src, copy.dst, 
+                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, // The destination is already in optimal layout
+                    static_cast<uint32_t>(copy.regions.size()), copy.regions.data());
+            }
+            groups[AFTER_COPIES].record(commandBuffer);
+            VkCommandBuffer graphicsCommandBuffer = commandBuffer;
+            if (acquireCommandBuffer != VK_NULL_HANDLE) {
+                groups[ACQUIRE].record(acquireCommandBuffer);
+                graphicsCommandBuffer = acquireCommandBuffer;
+            }
+            for (const auto& commands : graphicsWork) {
+                commands(graphicsCommandBuffer);
+            }
+        }
+
+        void clear() {
+            for (auto& group : groups) {
+                group = BarrierGroup{};
+            }
+            bufferCopies.clear();
+            imageCopies.clear();
+            graphicsWork.clear();
+        }
+
+    private:
+        struct BarrierGroup {
+            VkPipelineStageFlags srcStages = 0;
+            VkPipelineStageFlags dstStages = 0;
+            std::vector<VkBufferMemoryBarrier> buffers;
+            std::vector<VkImageMemoryBarrier> images;
+
+            bool empty() const {
+                return buffers.empty() && images.empty();
+            }
+
+            void record(VkCommandBuffer commandBuffer) const {
+                if (empty()) return;
+                vkCmdPipelineBarrier(commandBuffer, srcStages, dstStages, 0,
+                    0, nullptr,
+                    static_cast<uint32_t>(buffers.size()), buffers.data(),
+                    static_cast<uint32_t>(images.size()), images.data());
+            }
+        };
+
+        struct BufferCopyCommand {
+            VkBuffer src;
+            VkBuffer dst;
+            std::vector<VkBufferCopy> regions;
+        };
+
+        struct ImageCopyCommand {
+            VkBuffer src;
+            VkImage dst;
+            std::vector<VkBufferImageCopy> regions;
+        };
+
+        std::array<BarrierGroup, 3> groups;
+        std::vector<BufferCopyCommand> bufferCopies;
+        std::vector<ImageCopyCommand> imageCopies;
+        std::vector<std::function<void(VkCommandBuffer)>> graphicsWork;
+};
+
+// What a render target is created for, targets with equal keys are interchangeable
+struct RenderTargetKey {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+    VkImageUsageFlags usage = 0;
+
+    bool operator==(const RenderTargetKey&) const = default;
+};
+
+// An image only ever used as an attachment, with its view and memory
+struct RenderTarget {
+    RenderTargetKey key;
+    VkImage image = VK_NULL_HANDLE;
+    VkImageView view = VK_NULL_HANDLE;
+    MemoryAllocation allocation;
+};
+
+/**
+ * Keeps released render targets around so that the next request for the same key reuses them
+ * 
+ * Swap chain recreation releases the depth and multisampled color targets and asks for new ones. When the
+ * extent comes back (restoring a window, a present mode change, toggling between two sizes) the old images
+ * are handed out again instead of allocating new ones. The free list is capped, the oldest target is
+ * destroyed when it overflows.
+ * 
+ * Reusing right away is safe: the attachments are only written inside render passes on the graphics queue,
+ * which are ordered against the earlier frames by the external subpass dependency (or the barriers of
+ * dynamic rendering). Only destroying has to wait for the GPU, so the destroy function is expected to defer.
+ */
+class RenderTargetPool {
+    public:
+        using Create = std::function<RenderTarget(const RenderTargetKey&)>;
+        using Destroy = std::function<void(RenderTarget&)>;
+
+        void init(Create createTarget, Destroy destroyTarget, size_t maxFreeTargets = 4) {
+            create = std::move(createTarget);
+            destroy = std::move(destroyTarget);
+            maxFree = maxFreeTargets;
+        }
+
+        RenderTarget acquire(const RenderTargetKey& key) {
+            for (auto target = freeTargets.begin(); target != freeTargets.end(); target++) {
+                if (target->key == key) {
+                    RenderTarget reused = *target;
+                    freeTargets.erase(target);
+                    return reused;
+                }
+            }
+            return create(key);
+        }
+
+        void release(RenderTarget& target) {
+            if (target.image == VK_NULL_HANDLE) return;
+            freeTargets.push_back(target);
+            target = RenderTarget{};
+            if (freeTargets.size() > maxFree) {
+                destroy(freeTargets.front());
+                freeTargets.pop_front();
+            }
+        }
+
+        // Destroys the unused targets
+        void clear() {
+            for (RenderTarget& target : freeTargets) {
+                destroy(target);
+            }
+            freeTargets.clear();
+        }
+
+    private:
+        Create create;
+        Destroy destroy;
+        size_t maxFree = 4;
+        std::deque<RenderTarget> freeTargets; // Oldest first
+};
+
+// Access flags that write memory, a use with any of them is a write
+const VkAccessFlags2 WRITE_ACCESS_FLAGS = VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT 
+    | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_HOST_WRITE_BIT 
+    | VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+
+/**
+ * The passes of a frame with the resources they use, recorded with the barriers between them worked out
+ * 
+ * Passes are added in the order they run and declare every image and buffer they use, with the stages, the
+ * access and for images the layout. execute() tracks the state of each resource through the passes and puts
+ * the barriers a pass needs in front of it, batched into a single vkCmdPipelineBarrier2:
+ * - a write or a layout change waits for every earlier use, only the writes have to be made available,
+ * - a read waits for the latest write, unless it was already made visible to that stage and access,
+ * - reads after reads in the same layout need no barrier at all.
+ * Images start in the layout they are imported with, UNDEFINED discards their contents.
+ * 
+ * A pass recording a VkRenderPass is marked as such, the render pass changes the layouts of its attachments
+ * and waits for them through its subpass dependencies. The graph then only takes over the state it leaves
+ * them in, the layouts having to be the final layouts of the attachments.
+ * 
+ * Without synchronization2 the barriers are recorded with vkCmdPipelineBarrier. Passes have to stick to the
+ * stages and access flags that have the same bit in the old flags. Only used from the main thread.
+ */
+class RenderGraph {
+    public:
+        using Resource = uint32_t;
+
+        // How a pass uses a resource
+        struct Use {
+            Resource resource;
+            VkPipelineStageFlags2 stages;
+            VkAccessFlags2 access;
+            VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED; // Ignored for buffers
+        };
+
+        using BeginScope = std::function<void(VkCommandBuffer, const char*)>;
+        using EndScope = std::function<void(VkCommandBuffer)>;
+
+        /**
+         * @param pipelineBarrier2Function vkCmdPipelineBarrier2 or its KHR version, null without synchronization2
+         * @param begin Optional, called with the name of every pass that records commands before its barriers, e.g. to time it
+         * @param end Called after the pass
+         */
+        void init(PFN_vkCmdPipelineBarrier2 pipelineBarrier2Function, BeginScope begin = nullptr, EndScope end = nullptr) {
+            pipelineBarrier2 = pipelineBarrier2Function;
+            beginScope = std::move(begin);
+            endScope = std::move(end);
+        }
+
+        // Removes the passes and resources, the graph is built again every frame
+        void reset() {
+            resources.clear();
+            passes.clear();
+        }
+
+        /**
+         * Adds an image the graph doesn't own, e.g. a swap chain image or a render target
+         * 
+         * @param layout The layout the image is in when the graph starts
+         * @param stages Stages that used the image before the graph, its first use waits for them
+         * @param writes Access of those stages that wrote to the image
+         */
+        Resource importImage(VkImage image, VkImageAspectFlags aspects, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED, 
+            VkPipelineStageFlags2 stages = VK_PIPELINE_STAGE_2_NONE, VkAccessFlags2 writes = VK_ACCESS_2_NONE) {
+            ResourceState state;
+            state.image = image;
+            state.aspects = aspects;
+            state.layout = layout;
+            state.writeStages = stages;
+            state.writeAccess = writes;
+            resources.push_back(state);
+            return static_cast<Resource>(resources.size() - 1);
+        }
+
+        // Adds a buffer the graph doesn't own, stages and writes are like for images
+        Resource importBuffer(VkBuffer buffer, VkPipelineStageFlags2 stages = VK_PIPELINE_STAGE_2_NONE, 
+            VkAccessFlags2 writes = VK_ACCESS_2_NONE) {
+            ResourceState state;
+            state.buffer = buffer;
+            state.writeStages = stages;
+            state.writeAccess = writes;
+            resources.push_back(state);
+            return static_cast<Resource>(resources.size() - 1);
+        }
+
+        /**
+         * Adds a pass, run in the order they were added
+         * 
+         * @param uses Every resource the pass uses, a resource may only appear once
+         * @param name Names the pass, must outlive the graph (a string literal)
+         * @param record Records the pass, empty for passes that only change the state of resources
+         * @param renderPass True if record begins and ends a VkRenderPass, which synchronizes the images itself
+         */
+        void addPass(const char* name, std::vector<Use> uses, std::function<void(VkCommandBuffer)> record = nullptr, 
+            bool renderPass = false) {
+            passes.push_back(Pass{name, std::move(uses), std::move(record), renderPass});
+        }
+
+        // Records every pass with the barriers in front of it
+        void execute(VkCommandBuffer commandBuffer) {
+            barrierCount = 0;
+            batchCount = 0;
+            for (const Pass& pass : passes) {
+                imageBarriers.clear();
+                bufferBarriers.clear();
+                for (const Use& use : pass.uses) {
+                    addBarrier(resources[use.resource], use, pass.renderPass);
+                }
+                bool scoped = pass.record && beginScope;
+                if (scoped) {
+                    beginScope(commandBuffer, pass.name);
+                }
+                recordBarriers(commandBuffer);
+                if (pass.record) {
+                    pass.record(commandBuffer);
+                }
+                if (scoped) {
+                    endScope(commandBuffer);
+                }
+            }
+        }
+
+        // Barriers recorded by the latest execute(), and the no. of calls they were batched into
+        uint32_t barriers() const {
+            return barrierCount;
+        }
+        uint32_t batches() const {
+            return batchCount;
+        }
+
+    private:
+        struct Pass {
+            const char* name;
+            std::vector<Use> uses;
+            std::function<void(VkCommandBuffer)> record;
+            bool renderPass;
+        };
+
+        struct ResourceState {
+            VkImage image = VK_NULL_HANDLE; // Either the image
+            VkBuffer buffer = VK_NULL_HANDLE; // or the buffer
+            VkImageAspectFlags aspects = 0;
+            VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+            VkPipelineStageFlags2 writeStages = VK_PIPELINE_STAGE_2_NONE; // Stages of the latest write
+            VkAccessFlags2 writeAccess = VK_ACCESS_2_NONE;
+            VkPipelineStageFlags2 readStages = VK_PIPELINE_STAGE_2_NONE; // Stages that read since the latest write
+            VkPipelineStageFlags2 visibleStages = VK_PIPELINE_STAGE_2_NONE; // What the latest write was made visible to
+            VkAccessFlags2 visibleAccess = VK_ACCESS_2_NONE;
+        };
+
+        // Adds the barrier the use needs to the pass's batch, if any, and moves the resource to its new state
+        void addBarrier(ResourceState& state, const Use& use, bool renderPass) {
+            bool write = (use.access & WRITE_ACCESS_FLAGS) != 0;
+            bool image = state.image != VK_NULL_HANDLE;
+            bool layoutChange = image && use.layout != state.layout;
+            VkPipelineStageFlags2 srcStages = VK_PIPELINE_STAGE_2_NONE;
+            VkAccessFlags2 srcAccess = VK_ACCESS_2_NONE;
+
+            if (write || layoutChange) {
+                srcStages = state.writeStages | state.readStages;
+                srcAccess = state.writeAccess;
+            } else if ((use.stages & ~state.visibleStages) || (use.access & ~state.visibleAccess)) {
+                srcStages = state.writeStages;
+                srcAccess = state.writeAccess;
+            }
+
+            // A render pass does its own barriers for its attachments
+            bool needed = layoutChange || srcStages != VK_PIPELINE_STAGE_2_NONE;
+            bool recorded = needed && !(renderPass && image);
+            if (recorded) {
+                if (image) {
+                    VkImageMemoryBarrier2 barrier{};
+                    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+                    barrier.srcStageMask = srcStages;
+                    barrier.srcAccessMask = srcAccess;
+                    barrier.dstStageMask = use.stages;
+                    barrier.dstAccessMask = use.access;
+                    barrier.oldLayout = state.layout;
+                    barrier.newLayout = use.layout;
+                    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    barrier.image = state.image;
+                    barrier.subresourceRange = {state.aspects, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS};
+                    imageBarriers.push_back(barrier);
+                } else {
+                    VkBufferMemoryBarrier2 barrier{};
+                    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+                    barrier.srcStageMask = srcStages;
+                    barrier.srcAccessMask = srcAccess;
+                    barrier.dstStageMask = use.stages;
+                    barrier.dstAccessMask = use.access;
+                    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    barrier.buffer = state.buffer;
+                    barrier.offset = 0;
+                    barrier.size = VK_WHOLE_SIZE;
+                    bufferBarriers.push_back(barrier);
+                }
+            }
+
+            if (write || layoutChange) {
+                // A layout change counts as a write at the stages of the use
+                state.writeStages = use.stages;
+                state.writeAccess = use.access & WRITE_ACCESS_FLAGS;
+                state.readStages = write ? VK_PIPELINE_STAGE_2_NONE : use.stages;
+                // A new write isn't visible to anything yet, even to the stage and access that wrote it
+                // A layout change for a read made the earlier writes visible to that read with its barrier
+                bool madeVisible = !write && recorded;
+                state.visibleStages = madeVisible ? use.stages : VK_PIPELINE_STAGE_2_NONE;
+                state.visibleAccess = madeVisible ? use.access : VK_ACCESS_2_NONE;
+                if (image) {
+                    state.layout = use.layout;
+                }
+            } else {
+                state.readStages |= use.stages;
+                if (recorded) {
+                    state.visibleStages |= use.stages;
+                    state.visibleAccess |= use.access;
+                }
+            }
+        }
+
+        void recordBarriers(VkCommandBuffer commandBuffer) {
+            if (imageBarriers.empty() && bufferBarriers.empty()) return;
+            barrierCount += static_cast<uint32_t>(imageBarriers.size() + bufferBarriers.size());
+            batchCount++;
+
+            if (pipelineBarrier2 != nullptr) {
+                VkDependencyInfo dependencyInfo{};
+                dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+                dependencyInfo.bufferMemoryBarrierCount = static_cast<uint32_t>(bufferBarriers.size());
+                dependencyInfo.pBufferMemoryBarriers = bufferBarriers.data();
+                dependencyInfo.imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size());
+                dependencyInfo.pImageMemoryBarriers = imageBarriers.data();
+                pipelineBarrier2(commandBuffer, &dependencyInfo);
+                return;
+            }
+
+            // The old barriers share one pair of stage masks, which waits a little longer for some of them
+            VkPipelineStageFlags srcStages = 0, dstStages = 0;
+            legacyImageBarriers.clear();
+            legacyBufferBarriers.clear();
+            for (const VkImageMemoryBarrier2& barrier : imageBarriers) {
+                srcStages |= static_cast<VkPipelineStageFlags>(barrier.srcStageMask);
+                dstStages |= static_cast<VkPipelineStageFlags>(barrier.dstStageMask);
+                VkImageMemoryBarrier legacy{};
+                legacy.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+                legacy.srcAccessMask = static_cast<VkAccessFlags>(barrier.srcAccessMask);
+                legacy.dstAccessMask = static_cast<VkAccessFlags>(barrier.dstAccessMask);
+                legacy.oldLayout = barrier.oldLayout;
+                legacy.newLayout = barrier.newLayout;
+                legacy.srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+                legacy.dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+                legacy.image = barrier.image;
+                legacy.subresourceRange = barrier.subresourceRange;
+                legacyImageBarriers.push_back(legacy);
+            }
+            for (const VkBufferMemoryBarrier2& barrier : bufferBarriers) {
+                srcStages |= static_cast<VkPipelineStageFlags>(barrier.srcStageMask);
+                dstStages |= static_cast<VkPipelineStageFlags>(barrier.dstStageMask);
+                VkBufferMemoryBarrier legacy{};
+                legacy.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+                legacy.srcAccessMask = static_cast<VkAccessFlags>(barrier.srcAccessMask);
+                legacy.dstAccessMask = static_cast<VkAccessFlags>(barrier.dstAccessMask);
+                legacy.srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+                legacy.dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+                legacy.buffer = barrier.buffer;
+                legacy.offset = barrier.offset;
+                legacy.size = barrier.size;
+                legacyBufferBarriers.push_back(legacy);
+            }
+            // The old flags have no NONE stage
+            vkCmdPipelineBarrier(commandBuffer, 
+                srcStages != 0 ? srcStages : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT), 
+                dstStages != 0 ? dstStages : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT), 0, 0, nullptr, 
+                static_cast<uint32_t>(legacyBufferBarriers.size()), legacyBufferBarriers.data(), 
+                static_cast<uint32_t>(legacyImageBarriers.size()), legacyImageBarriers.data());
+        }
+
+        PFN_vkCmdPipelineBarrier2 pipelineBarrier2 = nullptr;
+        BeginScope beginScope;
+        EndScope endScope;
+        std::vector<ResourceState> resources;
+        std::vector<Pass> passes;
+        // The batch of the pass being recorded, kept to not allocate every frame
+        std::vector<VkImageMemoryBarrier2> imageBarriers;
+        std::vector<VkBufferMemoryBarrier2> bufferBarriers;
+        std::vector<VkImageMemoryBarrier> legacyImageBarriers;
+        std::vector<VkBufferMemoryBarrier> legacyBufferBarriers;
+        uint32_t barrierCount = 0;
+        uint32_t batchCount = 0;
+};
+
+// The resources a frame graph was built with, see buildFrameGraph()
+struct FrameGraphResources {
+    RenderGraph::Resource target = 0; // The swap chain image, or the offscreen image in headless mode
+    RenderGraph::Resource depth = 0;
+    RenderGraph::Resource color = 0; // Multisampled color, only with MSAA
+    RenderGraph::Resource culledCommands = 0; // Only with GPU culling
+    RenderGraph::Resource culledCount = 0;
+};
+
+// Number of frames the profiler keeps for the percentiles
+const size_t PROFILER_HISTORY = 512;
+// Upper limit of trace events kept for the Chrome trace, later events are dropped
+const size_t PROFILER_MAX_EVENTS = 1 << 20;
+// Timestamp pairs each frame can write
+const uint32_t MAX_GPU_SCOPES = 4;
+
+/**
+ * Collects CPU and GPU timings of the frames
+ *
+ * Frame times go into a rolling history for percentiles. Every timed scope is also kept as a trace
+ * event that can be written as Chrome trace JSON (chrome://tracing or ui.perfetto.dev).
+ * Times are microseconds since init(). Only used from the main thread.
+ *
+ * GPU timestamps use their own clock, so each GPU frame is placed on the timeline starting at
+ * the time its command buffer was submitted. The durations are exact, the offset is approximate.
+ */
+class FrameProfiler {
+    public:
+        void init(bool enabled) {
+            active = enabled;
+            startTime = std::chrono::steady_clock::now();
+            lastFrameStart = -1.0;
+        }
+
+        bool enabled() const {
+            return active;
+        }
+
+        double now() const {
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - startTime).count();
+        }
+
+        // Called once at the start of every frame, the time since the previous call is the frame time
+        void beginFrame() {
+            if (!active) return;
+            double time = now();
+            if (lastFrameStart >= 0.0) {
+                pushHistory(cpuFrameTimes, time - lastFrameStart);
+            }
+            lastFrameStart = time;
+        }
+
+        void addCpuEvent(const char* name, double start, double end) {
+            if (!active) return;
+            addEvent(name, start, end - start, CPU_TRACK);
+        }
+
+        /**
+         * Adds the GPU scopes of one finished frame
+         * 
+         * @param names Name of each scope
+         * @param timestamps Begin and end timestamp of each scope, in ticks
+         * @param timestampPeriod Nanoseconds per tick
+         * @param submitTime CPU time the frame was submitted, where its first scope is placed
+         */
+        void addGpuFrame(const std::vector<const char*>& names, const std::vector<uint64_t>& timestamps, 
+            float timestampPeriod, double submitTime) {
+            if (!active || names.empty()) return;
+            uint64_t first = timestamps[0];
+            uint64_t last = timestamps[0];
+            for (size_t i = 0; i < names.size(); i++) {
+                uint64_t begin = timestamps[i * 2];
+                uint64_t end = std::max(timestamps[i * 2 + 1], begin);
+                first = std::min(first, begin);
+                last = std::max(last, end);
+                addEvent(names[i], submitTime + (begin - timestamps[0]) * timestampPeriod / 1000.0, 
+                    (end - begin) * timestampPeriod / 1000.0, GPU_TRACK);
+            }
+            pushHistory(gpuFrameTimes, (last - first) * timestampPeriod / 1000.0);
+        }
+
+        // Percentile (0-100) of the CPU frame times in microseconds, 0 without samples
+        double cpuPercentile(double p) const {
+            return percentile(cpuFrameTimes, p);
+        }
+
+        // Percentile (0-100) of the GPU frame times in microseconds, 0 without samples
+        double gpuPercentile(double p) const {
+            return percentile(gpuFrameTimes, p);
+        }
+
+        // Mean of the GPU frame times in microseconds, 0 without samples
+        double gpuAverage() const {
+            if (gpuFrameTimes.empty()) return 0.0;
+            double sum = 0.0;
+            for (double time : gpuFrameTimes) {
+                sum += time;
+            }
+            return sum / gpuFrameTimes.size();
+        }
+
+        void printSummary(std::ostream& out) const {
+            if (!active) return;
+            out << "frame time (last " << cpuFrameTimes.size() << " frames): "
+                << "cpu p50 " << cpuPercentile(50) / 1000.0 << " ms, p99 " << cpuPercentile(99) / 1000.0 << " ms";
+            if (!gpuFrameTimes.empty()) {
+                out << " | gpu p50 " << gpuPercentile(50) / 1000.0 << " ms, p99 " << gpuPercentile(99) / 1000.0 << " ms";
+            }
+            out << std::endl;
+        }
+
+        // Writes every kept event as Chrome trace JSON, returns false if the file can't be written
+        bool writeChromeTrace(const std::string& path) const {
+            std::ofstream file(path, std::ios::trunc);
+            if (!file.is_open()) {
+                return false;
+            }
+            file << "{\"traceEvents\":[\n";
+            file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << CPU_TRACK << ",\"args\":{\"name\":\"CPU\"}},\n";
+            file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << GPU_TRACK << ",\"args\":{\"name\":\"GPU\"}}";
+            for (const auto& event : events) {
+                file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.track
+                     << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}";
+            }
+            file << "\n]}\n";
+            return static_cast<bool>(file);
+        }
+
+    private:
+        enum Track { CPU_TRACK = 1, GPU_TRACK = 2 };
+
+        struct TraceEvent {
+            const char* name; // Always a string literal
+            double start;
+            double duration;
+            Track track;
+        };
+
+        void addEvent(const char* name, double start, double duration, Track track) {
+            if (events.size() < PROFILER_MAX_EVENTS) {
+                events.push_back({name, start, duration, track});
+            }
+        }
+
+        static void pushHistory(std::deque<double>& history, double value) {
+            history.push_back(value);
+            if (history.size() > PROFILER_HISTORY) {
+                history.pop_front();
+            }
+        }
+
+        static double percentile(const std::deque<double>& history, double p) {
+            if (history.empty()) return 0.0;
+            std::vector<double> sorted(history.begin(), history.end());
+            size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p / 100.0 * sorted.size()));
+            std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+            return sorted[index];
+        }
+
+        bool active = false;
+        std::chrono::steady_clock::time_point startTime;
+        double lastFrameStart = -1.0;
+        std::deque<double> cpuFrameTimes;
+        std::deque<double> gpuFrameTimes;
+        std::vector<TraceEvent> events;
+};
+
+// Times the enclosing block as a CPU event of the profiler
+class ProfileScope {
+    public:
+        ProfileScope(FrameProfiler& profiler, const char* name) : profiler(profiler), name(name) {
+            start = profiler.enabled() ? profiler.now() : 0.0;
+        }
+
+        ~ProfileScope() {
+            if (profiler.enabled()) {
+                profiler.addCpuEvent(name, start, profiler.now());
+            }
+        }
+
+        ProfileScope(const ProfileScope&) = delete;
+        ProfileScope& operator=(const ProfileScope&) = delete;
+
+    private:
+        FrameProfiler& profiler;
+        const char* name;
+        double start;
+};
+
+class HelloTriangleApplication {
+    public:
+        explicit HelloTriangleApplication(const AppConfig& config) : config(config) {}
+
+        // This fuction is used to start the application
+        void run() {
+            if (config.listDevices) {
+                createInstance();
+                listPhysicalDevices();
+                vkDestroyInstance(instance, nullptr);
+                return;
+            }
+            // Headless mode renders offscreen, there is no window to create
+            if (!config.headless) {
+                initWindow();
+            }
+            initVulkan();
+            if (config.headless) {
+                runBenchmark();
+            } else {
+                mainLoop();
+            }
+            cleanup();
+        }
+
+    private:
+
+        AppConfig config; // Runtime settings
 
-        GLFWwindow* window; // GLFW window instance /n Necessary to clean up
+        GLFWwindow* window = nullptr; // GLFW window instance /n Necessary to clean up
 
         VkInstance instance; // Vulkan instance /n Necessary to clean up
         VkDebugUtilsMessengerEXT debugMessenger; // Debug callback \n Necessary to clean up
-        VkSurfaceKHR surface; // Window system integration surface \n Necessary to clean up
+        VkSurfaceKHR surface = VK_NULL_HANDLE; // Window system integration surface \n Necessary to clean up
 
         VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;   // The physical graphics device (GPU) \n Automatically cleaned up with vkinstance
+        VkPhysicalDeviceProperties deviceProperties{}; // Properties and limits of the picked GPU, queried once
+        DeviceCapabilities deviceCapabilities; // Optional features of the picked GPU
         VkDevice device; // Logical Device, can have multiple /n Necessary to clean up
 
         VkQueue graphicsQueue;  // Stores the handle of graphics queue \n Automatically cleaned up
         VkQueue presentQueue;   // Stores the handle of presentation queue \n Automatically cleaned up
-
-        VkSwapchainKHR swapChain; // Handle of the swapchain
+        VkQueue transferQueue;  // Stores the handle of the queue uploads run on \n Automatically cleaned up
+        uint32_t graphicsQueueFamily = 0;
+        uint32_t transferQueueFamily = 0; // Same as graphicsQueueFamily without a dedicated transfer family
+        VkQueue computeQueue;   // Stores the handle of the queue the async compute passes run on \n Automatically cleaned up
+        uint32_t computeQueueFamily = 0; // Same as graphicsQueueFamily without a compute only family
+
+        VkSwapchainKHR swapChain = VK_NULL_HANDLE; // Handle of the swapchain
+        DeletionQueue deletionQueue; // Objects replaced at runtime, destroyed once their last frame finishes
         std::vector<VkImage> swapChainImages; // Images stored in the swap chain
+        std::vector<MemoryAllocation> offscreenImageAllocations; // Headless mode: memory of the images rendered to
+
+        // The attachments drawn to besides the swap chain image, sized like the swap chain
+        VkFormat depthFormat;
+        VkSampleCountFlagBits msaaSamples;
+        RenderTargetPool renderTargets; // Reuses the targets across swap chain recreation
+        RenderTarget depthTarget;
+        RenderTarget colorTarget; // Multisampled color, resolved into the swap chain image. Empty without MSAA
         VkFormat swapChainImageFormat; // Image format of the swapchain
         VkExtent2D swapChainExtent; // Extent, size of the image of the swapchain in pixels
 
         std::vector<VkImageView> swapChainImageViews; // Stores Image views. Needs to be cleaned up
         std::vector<VkFramebuffer> swapChainFramebuffers; // Frame buffer
 
-        VkRenderPass renderPass;
+        VkRenderPass renderPass = VK_NULL_HANDLE; // Not created with dynamic rendering
+        // True if rendering with vkCmdBeginRendering, without a render pass or framebuffers
+        bool dynamicRendering = false;
+        // Loaded from the device, as the entry points differ between core and VK_KHR_dynamic_rendering
+        PFN_vkCmdBeginRendering cmdBeginRendering = nullptr;
+        PFN_vkCmdEndRendering cmdEndRendering = nullptr;
+        // The barriers of every frame, built again each frame. See buildFrameGraph()
+        RenderGraph frameGraph;
+        RenderGraph computeGraph; // The async compute passes, see submitAsyncCompute()
+        bool synchronization2 = false; // True if the graphs record their barriers with vkCmdPipelineBarrier2
+        PFN_vkCmdPipelineBarrier2 cmdPipelineBarrier2 = nullptr; // Core or VK_KHR_synchronization2, like cmdBeginRendering
 
         VkDescriptorSetLayout descriptorSetLayout; // Holds all the descriptor bindings
         VkPipelineLayout pipelineLayout;
 
-        VkPipeline graphicsPipeline;
+        PipelineRegistry pipelines; // Every graphics pipeline, created once per description
+        PipelineDesc graphicsPipelineDesc; // The pipeline the scene is drawn with
+        VkPipeline graphicsPipeline; // Looked up from the registry when the description or its pipeline changes
+        // Shader hot reloading, the watcher thread builds the new pipelines and the next frame swaps them in
+        FileWatcher shaderWatcher;
+        std::mutex reloadMutex; // Guards reloadedPipelines
+        std::vector<std::pair<PipelineDesc, VkPipeline>> reloadedPipelines; // Built by the watcher, not yet in use
+        VkPipelineCache pipelineCache; // Used for every pipeline creation, saved to disk on cleanup
+
 
+        DeviceMemoryAllocator memoryAllocator; // Hands out the memory of every buffer and image
 
         VkCommandPool commandPool; // Manages the memory allocated to command buffers
         std::vector<VkCommandBuffer> commandBuffers;
+        // Secondary command buffers are recorded in parallel, each thread has its own pool for every frame in flight
+        // Indexed as [frame][thread], a pool is reset as a whole once its frame has finished
+        RecordingThreadPool recordingThreads;
+        std::vector<std::vector<VkCommandPool>> threadCommandPools;
+        std::vector<std::vector<VkCommandBuffer>> secondaryCommandBuffers;
+        std::vector<DrawItem> drawList; // Every draw of the scene
+        std::vector<glm::mat4> instanceTransforms; // Model matrix of every instance, applied before the model matrix
+        std::vector<uint32_t> instanceTextures; // Index into textureViews of every instance
+        VkBuffer instanceBuffer; // InstanceData of every instance on the GPU, indexed with gl_InstanceIndex
+        MemoryAllocation instanceBufferAllocation;
+        // Animated instances: the buffer has a slot per frame in flight, written by the CPU every frame
+        // Bound with a dynamic offset, which stays 0 for the single slot of static instances
+        VkDeviceSize instanceSlotSize = 0;
+        TransformSystem instanceTransformSystem; // The local transforms of the animated instances
+        // Indirect mode: the draw list as VkDrawIndexedIndirectCommands in GPU memory
+        VkBuffer indirectBuffer;
+        MemoryAllocation indirectBufferAllocation;
+        VkBuffer drawCountBuffer; // Number of commands to draw, read by vkCmdDrawIndexedIndirectCount
+        MemoryAllocation drawCountBufferAllocation;
+
+        // GPU culling: a compute pass compacts the visible draws into per frame command and count buffers
+        bool gpuCulling = false; // True if culling is enabled and supported
+        VkBuffer cullObjectBuffer; // Every draw with its bounding sphere
+        MemoryAllocation cullObjectBufferAllocation;
+        std::vector<VkBuffer> culledCommandBuffers;
+        std::vector<MemoryAllocation> culledCommandBuffersAllocation;
+        std::vector<VkBuffer> culledCountBuffers;
+        std::vector<MemoryAllocation> culledCountBuffersAllocation;
+        VkDescriptorSetLayout cullDescriptorSetLayout;
+        VkPipelineLayout cullPipelineLayout;
+        VkPipeline cullPipeline;
+        std::vector<VkDescriptorSet> cullDescriptorSets;
+
+        // Async compute: the culling is submitted to the compute queue ahead of the frame, see submitAsyncCompute()
+        bool asyncCulling = false; // True if HT_ASYNC_COMPUTE has cull and the device has a compute only family
+        VkCommandPool computeCommandPool = VK_NULL_HANDLE;
+        std::vector<VkCommandBuffer> computeCommandBuffers; // One per frame in flight
+        // Signaled by every compute queue submission. The GPU timeline is only signaled from the graphics queue,
+        // so its values finish in order, the compute queue counts on its own timeline instead
+        VkSemaphore computeTimeline = VK_NULL_HANDLE;
+        uint64_t computeTimelineValue = 0; // Value signaled by the latest compute submission
+
+        // Profiling, GPU scopes write a pair of timestamps into the queries of their frame
+        FrameProfiler profiler;
+        VkQueryPool timestampQueryPool = VK_NULL_HANDLE; // MAX_GPU_SCOPES * 2 queries per frame in flight
+        uint64_t timestampMask = ~0ull; // The timestampValidBits of the graphics queue, the bits above are undefined
+        std::vector<std::vector<const char*>> gpuScopeNames; // Scopes recorded for each frame in flight
+        std::vector<double> gpuSubmitTimes; // CPU time each frame in flight was submitted
+        double lastTitleUpdate = 0.0; // When the frame times were last shown in the window title
+        VkCommandPool transferCommandPool; // Command buffers recorded for the transfer queue
 
 
         // For effeciency it is suggested to use a single VkBuffer to store both vertices and indices buffers
         // This can be done using offsets and flags
         VkBuffer vertexBuffer;
-        VkDeviceMemory vertexBufferMemory;
+        MemoryAllocation vertexBufferAllocation;
         // Stores indices of the vertices used to make a triangle
         VkBuffer indexBuffer;
-        VkDeviceMemory indexBufferMemory;
+        VkIndexType indexType = VK_INDEX_TYPE_UINT16; // The index width of the mesh
+        bool packedVertices = false; // The vertex buffer holds PackedVertex instead of Vertex
+        MeshData mesh; // The geometry until it is uploaded
+        std::future<MeshData> meshLoad; // The model file being loaded, not valid when the quad is drawn
+        MemoryAllocation indexBufferAllocation;
+
+        // Persistently mapped buffer all uploads are staged through
+        VkBuffer stagingRingBuffer;
+        MemoryAllocation stagingRingAllocation;
+        StagingRing stagingRing;
+        // Uploads are batched into one submission and never waited on unless the staging ring is full
+        UploadRecorder uploadRecorder; // Commands queued for the next upload batch
+        std::deque<UploadBatch> uploadsInFlight; // Submitted batches, oldest first
+        std::vector<UploadBatch> freeUploadBatches; // Finished batches ready for reuse
 
         // Stores vulkan image objects
         VkImage textureImage;
-        VkDeviceMemory textureImageMemory;
+        MemoryAllocation textureImageAllocation;
+        VkFormat textureFormat = VK_FORMAT_R8G8B8A8_SRGB;
+        uint32_t textureMipLevels = 1;
+        AssetLoader assetLoader; // Reads and decodes files in the background
+        std::future<TextureData> textureLoad; // The texture, until createTextureImage() uploads it
 
         VkImageView textureImageView;
+        // Bindless mode: every texture, an InstanceData::textureIndex is a position in here
+        // Without bindless only the first one is bound
+        std::vector<VkImageView> textureViews;
+        bool bindless = false;
+        uint32_t bindlessTextureCount = 1; // Size of the texture array binding
         VkSampler textureSampler;
 
-        std::vector<VkBuffer> uniformBuffers;
-        std::vector<VkDeviceMemory> uniformBuffersMemory;
-        std::vector<void*> uniformBuffersMapped;
+        // One persistently mapped buffer with a UniformBufferObject slot for every frame in flight
+        // The slots are minUniformBufferOffsetAlignment apart, the frame's slot is bound with a dynamic offset
+        VkBuffer uniformBuffer;
+        MemoryAllocation uniformBufferAllocation;
+        VkDeviceSize uniformSlotSize = 0;
+        UniformBufferObject camera{}; // The camera of the latest frame
+        uint64_t cameraVersion = 0; // Incremented whenever the camera changes
+        std::vector<uint64_t> uniformSlotVersions; // The camera version written to each slot, 0 when never written
+        DrawConstants drawConstants{}; // Pushed with the draws of the current frame
 
         VkDescriptorPool descriptorPool;
-        std::vector<VkDescriptorSet> descriptorSets;
+        // A single set serves every frame, only the dynamic offset of the uniform buffer differs
+        VkDescriptorSet descriptorSet;
 
         std::vector<VkSemaphore> imageAvailableSemaphores; // Semaphores to signal that image has been acquired from swapchain
         std::vector<VkSemaphore> renderFinishedSemaphores; // Semaphores to signal the rendering is done and ready to be presented
-        std::vector<VkFence> inFlightFences;  // Making sure new frame is drawn only after the previous frame is finished
+
+        /**
+         * The GPU timeline, a timeline semaphore signaled by every submission to the graphics queue
+         * 
+         * Each submission signals the next value, in submission order, so a completed value means the
+         * submission that signaled it and all earlier ones are done. Everything that recycles memory keys
+         * off it: frames in flight, upload batches and the staging ring.
+         */
+        VkSemaphore gpuTimeline;
+        uint64_t gpuTimelineValue = 0; // Value signaled by the latest submission
+        std::vector<uint64_t> frameTimelineValues; // Value signaled by each frame in flight, waited on before reusing it
 
         bool framebufferResized = false;
 
         uint32_t currentFrame = 0;
 
+        // Frame pacing, see waitForFramePacing()
+        PFN_vkWaitForPresentKHR waitForPresent = nullptr; // Null without VK_KHR_present_wait
+        uint64_t presentId = 0; // Id of the latest present to the current swap chain
+        std::chrono::steady_clock::time_point nextFrameTime; // Earliest start of the next frame with HT_FPS_LIMIT
+        uint64_t frameNumber = 0; // Frames drawn so far, drives the animation with a fixed timestep
+
         // This defines the parameters of glfw window
         void initWindow() {
             glfwInit(); // Initialise the glfw library
@@ -273,85 +3118,226 @@ class HelloTriangleApplication {
 
         // All the code needed to initialise vulkan 
         void initVulkan() {
+            assetLoader.start();
+            requestTexture(); // Decodes on the loader threads while the device is set up
+            requestMesh();
             createInstance(); // Creates an instance of vulkan
             setupDebugMessenger(); // Creates the debug messenger
-            createSurface(); // Creates the surface to allow vulkan to render on to
+            if (!config.headless) {
+                createSurface(); // Creates the surface to allow vulkan to render on to
+            }
             pickPhysicalDevice(); // Picks a graphics card
             createLogicalDevice(); // Creates a logical device
-            createSwapChain(); // Creates the swap chain
+            gpuTimeline = createTimelineSemaphore(); // Tracks the progress of every submission
+            memoryAllocator.init(device, physicalDevice); // Sets up the sub-allocator for buffer and image memory
+            if (config.headless) {
+                createOffscreenImages(); // Images standing in for the swap chain
+            } else {
+                createSwapChain(); // Creates the swap chain
+            }
             createImageViews();
+            chooseRenderTargetFormats();
+            createRenderTargets();
             createRenderPass();
             createDescriptorSetLayout();
+            createPipelineCache(); // Loads the pipelines compiled by earlier runs
             createGraphicsPipeline();
             createFramebuffers();
             createCommandPool();
+            createStagingRing();
             createTextureImage();
             createTextureImageView();
             createTextureSampler();
+            loadMeshData(); // Waits for the mesh loaded in the background
             createVertexBuffer();
             createIndexBuffer();
+            createDrawList();
+            mesh = MeshData(); // The geometry is in the staging ring, unmapping the file
+            createInstanceBuffer();
+            createIndirectBuffers();
+            createCullingResources();
+            submitUpload(); // Sends every upload above to the GPU in one batch
             createUniformBuffers();
             createDescriptorPool();
             createDescriptorSets();
+            createCullingDescriptorSets();
             createCommandBuffer(); // Creates a single command buffer
+            createThreadCommandPools(); // Creates the pools of the recording threads and starts them
             createSyncObjects();
+            createProfiler();
+            // Created on a compile thread while the resources above were set up
+            graphicsPipeline = pipelines.get(graphicsPipelineDesc);
+            startShaderHotReload();
+
+            if (enableValidationLayers) {
+                printDeviceReport();
+                memoryAllocator.printStats(std::cout);
+            }
         }
 
         void mainLoop() {
             // Loops until the window is closed
             while (!glfwWindowShouldClose(window)) {
 
+                // Nothing can be drawn while the window is minimized, sleeping until it is restored
+                int width = 0, height = 0;
+                glfwGetFramebufferSize(window, &width, &height);
+                if (width == 0 || height == 0) {
+                    glfwWaitEvents();
+                    continue;
+                }
+
                 glfwPollEvents(); // Handles all the events in the event queue
 
                 drawFrame(); // Draws the frame
+                updateProfilerTitle();
             }
 
             vkDeviceWaitIdle(device); // Wait until logical device has finished before cleaning up
         }
 
+        /**
+         * Headless benchmark, draws a fixed number of frames as fast as possible
+         * 
+         * Prints a single JSON object to stdout so CI can compare runs:
+         * {"frames":..,"seconds":..,"fps":..,"cpu_ms_p50":..,"cpu_ms_p99":..,"gpu_ms_avg":..,"gpu_ms_p50":..,"gpu_ms_p99":..}
+         */
+        void runBenchmark() {
+            auto start = std::chrono::steady_clock::now();
+            for (uint32_t i = 0; i < config.benchmarkFrames; i++) {
+                drawFrame();
+            }
+            vkDeviceWaitIdle(device); // The last frames count towards the total time
+            // The final frames in flight haven't been read back yet
+            for (uint32_t i = 0; i < config.framesInFlight; i++) {
+                readGpuTimings();
+                currentFrame = (currentFrame + 1) % config.framesInFlight;
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::printf("{\"frames\":%u,\"seconds\":%.4f,\"fps\":%.2f,\"cpu_ms_p50\":%.4f,\"cpu_ms_p99\":%.4f,"
+                "\"gpu_ms_avg\":%.4f,\"gpu_ms_p50\":%.4f,\"gpu_ms_p99\":%.4f,\"barriers\":%u,\"barrier_batches\":%u}\n",
+                config.benchmarkFrames, seconds, config.benchmarkFrames / seconds,
+                profiler.cpuPercentile(50) / 1000.0, profiler.cpuPercentile(99) / 1000.0,
+                profiler.gpuAverage() / 1000.0, profiler.gpuPercentile(50) / 1000.0, profiler.gpuPercentile(99) / 1000.0,
+                frameGraph.barriers(), frameGraph.batches()); // Of the last frame, every frame has the same
+        }
+
         // This function is executed after the mainloop ends
         // It cleans up the instances created 
         // The order of destruction is important
         void cleanup() {
 
+            // Waits for a reload in progress, it uses the device and the pipeline cache
+            shaderWatcher.stop();
+            for (auto& [desc, pipeline] : reloadedPipelines) {
+                vkDestroyPipeline(device, pipeline, nullptr);
+            }
             cleanupSwapChain();
+            renderTargets.clear();
+            // Waits for the prewarming compiles, so no retired pipeline is still compiling
+            pipelines.stop();
+            deletionQueue.flush(UINT64_MAX); // The device is idle
             vkDestroySampler(device, textureSampler, nullptr);
             vkDestroyImageView(device, textureImageView, nullptr);
             vkDestroyImage(device, textureImage, nullptr);
-            vkFreeMemory(device, textureImageMemory, nullptr);
-            // Destroys the graphics pipeline
-            vkDestroyPipeline(device, graphicsPipeline, nullptr);
+            memoryAllocator.free(textureImageAllocation);
+            // Destroys the graphics pipelines
+            for (VkPipeline pipeline : pipelines.clear()) {
+                vkDestroyPipeline(device, pipeline, nullptr);
+            }
             // Destroys the pipeline layout
             vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+            // Writes the compiled pipelines to disk for the next run
+            savePipelineCache();
+            vkDestroyPipelineCache(device, pipelineCache, nullptr);
 
             // Destroys the render pass
             vkDestroyRenderPass(device, renderPass, nullptr);
 
-            for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-                vkDestroyBuffer(device, uniformBuffers[i], nullptr);
-                vkFreeMemory(device, uniformBuffersMemory[i], nullptr);
-            }
+            vkDestroyBuffer(device, uniformBuffer, nullptr);
+            memoryAllocator.free(uniformBufferAllocation);
             vkDestroyDescriptorPool(device, descriptorPool, nullptr); // Also frees up the descriptor sets associated with it
 
             vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 
             vkDestroyBuffer(device, indexBuffer, nullptr);
-            vkFreeMemory(device, indexBufferMemory, nullptr);
+            memoryAllocator.free(indexBufferAllocation);
 
             vkDestroyBuffer(device, vertexBuffer, nullptr);
-            vkFreeMemory(device, vertexBufferMemory, nullptr);
+            memoryAllocator.free(vertexBufferAllocation);
+
+            vkDestroyBuffer(device, instanceBuffer, nullptr);
+            memoryAllocator.free(instanceBufferAllocation);
+
+            vkDestroyBuffer(device, indirectBuffer, nullptr);
+            memoryAllocator.free(indirectBufferAllocation);
+            vkDestroyBuffer(device, drawCountBuffer, nullptr);
+            memoryAllocator.free(drawCountBufferAllocation);
+
+            if (gpuCulling) {
+                vkDestroyPipeline(device, cullPipeline, nullptr);
+                vkDestroyPipelineLayout(device, cullPipelineLayout, nullptr);
+                vkDestroyDescriptorSetLayout(device, cullDescriptorSetLayout, nullptr);
+                vkDestroyBuffer(device, cullObjectBuffer, nullptr);
+                memoryAllocator.free(cullObjectBufferAllocation);
+                for (size_t i = 0; i < config.framesInFlight; i++) {
+                    vkDestroyBuffer(device, culledCommandBuffers[i], nullptr);
+                    memoryAllocator.free(culledCommandBuffersAllocation[i]);
+                    vkDestroyBuffer(device, culledCountBuffers[i], nullptr);
+                    memoryAllocator.free(culledCountBuffersAllocation[i]);
+                }
+            }
+
+            vkDestroyBuffer(device, stagingRingBuffer, nullptr);
+            memoryAllocator.free(stagingRingAllocation);
+
+            // The device is idle, so every upload batch has finished
+            pollUploads();
+            for (auto& batch : freeUploadBatches) {
+                if (batch.transferFinished != VK_NULL_HANDLE) {
+                    vkDestroySemaphore(device, batch.transferFinished, nullptr);
+                }
+            }
+
+            // Releases the memory blocks after every resource bound to them is gone
+            memoryAllocator.destroy();
 
 
             // Destroys the syncronisation objects
-            for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            for (size_t i = 0; i < config.framesInFlight; i++) {
                 vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
                 vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-                vkDestroyFence(device, inFlightFences[i], nullptr);
             }
+            vkDestroySemaphore(device, gpuTimeline, nullptr);
 
             // Destroys command pool
             vkDestroyCommandPool(device, commandPool, nullptr);
+            vkDestroyCommandPool(device, transferCommandPool, nullptr);
+            if (asyncCulling) {
+                vkDestroyCommandPool(device, computeCommandPool, nullptr);
+                vkDestroySemaphore(device, computeTimeline, nullptr);
+            }
+            // Stops the recording threads before destroying the pools they use
+            recordingThreads.stop();
+            assetLoader.stop();
+            for (auto& framePools : threadCommandPools) {
+                for (VkCommandPool pool : framePools) {
+                    vkDestroyCommandPool(device, pool, nullptr);
+                }
+            }
             
+            if (timestampQueryPool != VK_NULL_HANDLE) {
+                vkDestroyQueryPool(device, timestampQueryPool, nullptr);
+            }
+            // The benchmark report replaces the summary in headless mode
+            if (!config.headless) {
+                profiler.printSummary(std::cout);
+            }
+            if (!config.traceFile.empty() && !profiler.writeChromeTrace(config.traceFile)) {
+                std::cerr << "failed to write trace file " << config.traceFile << std::endl;
+            }
+
             // Detroys the logical device
             vkDestroyDevice(device, nullptr);
 
@@ -361,12 +3347,16 @@ class HelloTriangleApplication {
             }
 
             // Destroys the surface where vulkan is rendered
-            vkDestroySurfaceKHR(instance, surface, nullptr);
+            if (surface != VK_NULL_HANDLE) {
+                vkDestroySurfaceKHR(instance, surface, nullptr);
+            }
             // Destroys the vulkan instance
             // Can take a callback pointer else nullptr
             vkDestroyInstance(instance, nullptr);            
 
-            glfwDestroyWindow(window); // Destroys the glfw window instance
+            if (window != nullptr) {
+                glfwDestroyWindow(window); // Destroys the glfw window instance
+            }
 
             glfwTerminate(); // Terminates the glfw library
         }
@@ -379,13 +3369,34 @@ class HelloTriangleApplication {
         // - Submit the recorded command buffer
         // - Present the swap chain image
         void drawFrame() {
-            // Wait until previous frame is finished
-            vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+            profiler.beginFrame();
+            ProfileScope frameScope(profiler, "frame");
+
+            // Wait until the previous use of this frame in flight is finished
+            {
+                ProfileScope scope(profiler, "wait for frame");
+                waitForGpuValue(frameTimelineValues[currentFrame]);
+            }
+            // The frame has finished, so its timestamps are available without waiting
+            readGpuTimings();
+            deletionQueue.flush(completedGpuValue()); // Destroys what the finished frames were the last to use
+            swapReloadedPipeline(); // The frame records with the newest shaders
+            // Starts the frame as late as possible, so it shows the freshest input
+            {
+                ProfileScope scope(profiler, "frame pacing");
+                waitForFramePacing();
+            }
             
             // Acquiring the image from the swapchain
             uint32_t imageIndex; // The index of the image available for rendering
+            VkResult result = VK_SUCCESS;
             // Defining the logical device, swapchain, timeout in nanoseconds, syncronization object, and where to store the image index
-            VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+            if (config.headless) {
+                imageIndex = currentFrame; // Every frame in flight has its own offscreen image
+            } else {
+                ProfileScope scope(profiler, "acquire");
+                result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+            }
             // If swap chain is out of date
             if (result == VK_ERROR_OUT_OF_DATE_KHR) {
                 recreateSwapChain();
@@ -394,23 +3405,48 @@ class HelloTriangleApplication {
                 throw std::runtime_error("failed to acquire swap chain image!");
             }
 
-            updateUniformBuffer(currentFrame);
-            // Reset the fence indicating the start of the frame
-            // Only reset fence if we are subbmiting the work
-            vkResetFences(device, 1, &inFlightFences[currentFrame]);
+            {
+                ProfileScope scope(profiler, "update uniforms");
+                updateUniformBuffer(currentFrame);
+            }
+            // Recycles finished uploads and sends any recorded since the last frame
+            // Uploads are submitted before the frame so the frame sees their data
+            pollUploads();
+            submitUpload();
+            // The compute queue starts culling while the frame is recorded, reading the uniforms and uploads above
+            if (asyncCulling) {
+                ProfileScope scope(profiler, "async compute");
+                submitAsyncCompute();
+            }
 
-            vkResetCommandBuffer(commandBuffers[currentFrame], /*VkCommandBufferResetFlagBits*/ 0);
-            recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+            {
+                ProfileScope scope(profiler, "record");
+                vkResetCommandBuffer(commandBuffers[currentFrame], /*VkCommandBufferResetFlagBits*/ 0);
+                recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+            }
 
             VkSubmitInfo submitInfo{};
             submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-            // Semaphores to wait on before executing the command
-            VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-            // Stage to wait on
-            VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-
-            submitInfo.waitSemaphoreCount = 1;
+            // Semaphores to wait on before executing the command, the stages that wait on them
+            // and the values of the timeline semaphores, binary semaphores ignore theirs
+            VkSemaphore waitSemaphores[2];
+            VkPipelineStageFlags waitStages[2];
+            uint64_t waitValues[2];
+            uint32_t waitCount = 0;
+            // Offscreen images are never acquired or presented, so there is nothing to wait on or signal
+            if (!config.headless) {
+                waitSemaphores[waitCount] = imageAvailableSemaphores[currentFrame];
+                waitStages[waitCount] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+                waitValues[waitCount++] = 0;
+            }
+            // The draws read the results of the culling on the compute queue
+            if (asyncCulling) {
+                waitSemaphores[waitCount] = computeTimeline;
+                waitStages[waitCount] = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+                waitValues[waitCount++] = computeTimelineValue;
+            }
+            submitInfo.waitSemaphoreCount = waitCount;
             submitInfo.pWaitSemaphores = waitSemaphores;
             submitInfo.pWaitDstStageMask = waitStages;
 
@@ -419,20 +3455,41 @@ class HelloTriangleApplication {
             submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
 
             // Semaphores to signal to once the command buffer(s) has finished execution
-            VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
-            submitInfo.signalSemaphoreCount = 1;
+            // The GPU timeline tells the CPU when this frame in flight can be reused, the binary semaphore is for presenting
+            frameTimelineValues[currentFrame] = ++gpuTimelineValue;
+            VkSemaphore signalSemaphores[] = {gpuTimeline, renderFinishedSemaphores[currentFrame]};
+            submitInfo.signalSemaphoreCount = config.headless ? 1 : 2;
             submitInfo.pSignalSemaphores = signalSemaphores;
 
-            if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, 
-                                inFlightFences[currentFrame] /* Signal CPU to wait until the command buffers have finished execution */) != VK_SUCCESS) {
-                throw std::runtime_error("failed to submit draw command buffer!");
+            // Values for the timeline semaphores, binary semaphores ignore theirs
+            uint64_t signalValues[] = {frameTimelineValues[currentFrame], 0};
+            VkTimelineSemaphoreSubmitInfo timelineInfo{};
+            timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+            timelineInfo.waitSemaphoreValueCount = submitInfo.waitSemaphoreCount;
+            timelineInfo.pWaitSemaphoreValues = waitValues;
+            timelineInfo.signalSemaphoreValueCount = submitInfo.signalSemaphoreCount;
+            timelineInfo.pSignalSemaphoreValues = signalValues;
+            submitInfo.pNext = &timelineInfo;
+
+            {
+                ProfileScope scope(profiler, "submit");
+                gpuSubmitTimes[currentFrame] = profiler.now();
+                if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to submit draw command buffer!");
+                }
+            }
+
+            if (config.headless) {
+                frameNumber++;
+                currentFrame = (currentFrame + 1) % config.framesInFlight;
+                return;
             }
 
             VkPresentInfoKHR presentInfo{};
             presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
             // Semaphore to wait on before executing
             presentInfo.waitSemaphoreCount = 1;
-            presentInfo.pWaitSemaphores = signalSemaphores;
+            presentInfo.pWaitSemaphores = &renderFinishedSemaphores[currentFrame];
 
             VkSwapchainKHR swapChains[] = {swapChain};
             presentInfo.swapchainCount = 1;
@@ -441,7 +3498,21 @@ class HelloTriangleApplication {
 
             presentInfo.pResults = nullptr; // Optional. Return array of vkResults if all images are presented to the swap chains
 
-            result = vkQueuePresentKHR(presentQueue, &presentInfo);
+            // Tags the present with an id that waitForFramePacing() can wait on
+            VkPresentIdKHR presentIdInfo{};
+            uint64_t id = presentId + 1;
+            if (waitForPresent != nullptr) {
+                presentIdInfo.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+                presentIdInfo.swapchainCount = 1;
+                presentIdInfo.pPresentIds = &id;
+                presentInfo.pNext = &presentIdInfo;
+            }
+
+            {
+                ProfileScope scope(profiler, "present");
+                result = vkQueuePresentKHR(presentQueue, &presentInfo);
+                presentId = id;
+            }
             // If swap chain is out of date or suboptimal, create a new swapchain and try drawing in the next cycle
             if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
                 framebufferResized = false;
@@ -450,7 +3521,119 @@ class HelloTriangleApplication {
                 throw std::runtime_error("failed to present swap chain image!");
             }
 
-            currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT; // Advance to next frame in flight and not exceed the max frames in flight
+            frameNumber++;
+            currentFrame = (currentFrame + 1) % config.framesInFlight; // Advance to next frame in flight and not exceed the max frames in flight
+        }
+
+        /**
+         * Holds back the start of a frame, called right before acquiring the next image
+         * 
+         * With VK_KHR_present_wait it waits until the frame before the latest one is on screen. At most
+         * one frame then waits for presentation, instead of the CPU running ahead by the whole swap chain.
+         * With HT_FPS_LIMIT it also sleeps until the next frame is due, rather than spinning on the CPU.
+         * Headless mode renders as fast as possible.
+         */
+        void waitForFramePacing() {
+            if (config.headless) return;
+
+            if (waitForPresent != nullptr && presentId > 1) {
+                // Times out after 100 ms, so a present that never finishes (e.g. a hidden window) can't hang the frame
+                VkResult result = waitForPresent(device, swapChain, presentId - 1, 100000000);
+                // Out of date swap chains are handled by acquire
+                if (result != VK_SUCCESS && result != VK_TIMEOUT && result != VK_SUBOPTIMAL_KHR && result != VK_ERROR_OUT_OF_DATE_KHR) {
+                    throw std::runtime_error("failed to wait for present!");
+                }
+            }
+
+            if (config.frameRateLimit > 0.0f) {
+                auto now = std::chrono::steady_clock::now();
+                if (now < nextFrameTime) {
+                    std::this_thread::sleep_until(nextFrameTime);
+                    now = nextFrameTime; // Oversleeping doesn't push the later frames back
+                }
+                // A late frame starts a new period instead of rushing the next ones
+                nextFrameTime = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(1.0 / config.frameRateLimit));
+            }
+        }
+
+        /**
+         * Sets up profiling if enabled with HT_PROFILE or HT_TRACE_FILE
+         * 
+         * GPU timing needs timestamp support on the graphics queue, otherwise only the CPU is timed.
+         */
+        void createProfiler() {
+            profiler.init(config.profile);
+            gpuSubmitTimes.assign(config.framesInFlight, 0.0);
+            gpuScopeNames.assign(config.framesInFlight, {});
+            if (!config.profile) return;
+
+            uint32_t queueFamilyCount = 0;
+            vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+            std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+            vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+            if (queueFamilies[graphicsQueueFamily].timestampValidBits == 0) {
+                std::cerr << "graphics queue has no timestamps, profiling the CPU only" << std::endl;
+                return;
+            }
+            uint32_t validBits = queueFamilies[graphicsQueueFamily].timestampValidBits;
+            timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+            VkQueryPoolCreateInfo queryPoolInfo{};
+            queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+            queryPoolInfo.queryCount = MAX_GPU_SCOPES * 2 * config.framesInFlight;
+            if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &timestampQueryPool) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create query pool!");
+            }
+        }
+
+        // Writes the begin timestamp of a named GPU scope, name has to be a string literal
+        // Scopes can't nest and at most MAX_GPU_SCOPES are kept per frame
+        void beginGpuScope(VkCommandBuffer commandBuffer, const char* name) {
+            if (timestampQueryPool == VK_NULL_HANDLE || gpuScopeNames[currentFrame].size() >= MAX_GPU_SCOPES) return;
+            uint32_t query = static_cast<uint32_t>(currentFrame * MAX_GPU_SCOPES + gpuScopeNames[currentFrame].size()) * 2;
+            gpuScopeNames[currentFrame].push_back(name);
+            // Written once all previous commands have started
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, query);
+        }
+
+        void endGpuScope(VkCommandBuffer commandBuffer) {
+            if (timestampQueryPool == VK_NULL_HANDLE || gpuScopeNames[currentFrame].empty()) return;
+            uint32_t query = static_cast<uint32_t>(currentFrame * MAX_GPU_SCOPES + gpuScopeNames[currentFrame].size() - 1) * 2 + 1;
+            // Written once all previous commands have finished
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, query);
+        }
+
+        // Hands the timestamps of the current frame slot to the profiler
+        // Called after the frame's fence so the results are ready, it never waits on the GPU
+        void readGpuTimings() {
+            if (timestampQueryPool == VK_NULL_HANDLE || gpuScopeNames[currentFrame].empty()) return;
+
+            const auto& names = gpuScopeNames[currentFrame];
+            std::vector<uint64_t> timestamps(names.size() * 2);
+            VkResult result = vkGetQueryPoolResults(device, timestampQueryPool, currentFrame * MAX_GPU_SCOPES * 2, 
+                static_cast<uint32_t>(timestamps.size()), timestamps.size() * sizeof(uint64_t), timestamps.data(), 
+                sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+            if (result == VK_SUCCESS) {
+                for (uint64_t& timestamp : timestamps) {
+                    timestamp &= timestampMask;
+                }
+                profiler.addGpuFrame(names, timestamps, deviceProperties.limits.timestampPeriod, gpuSubmitTimes[currentFrame]);
+            }
+            gpuScopeNames[currentFrame].clear();
+        }
+
+        // Shows the frame time percentiles in the window title, once a second
+        void updateProfilerTitle() {
+            if (!profiler.enabled() || window == nullptr || profiler.now() - lastTitleUpdate < 1000000.0) return;
+            lastTitleUpdate = profiler.now();
+
+            char title[128];
+            std::snprintf(title, sizeof(title), "%s | cpu p50 %.2f ms p99 %.2f ms | gpu p50 %.2f ms p99 %.2f ms", TITLE,
+                profiler.cpuPercentile(50) / 1000.0, profiler.cpuPercentile(99) / 1000.0,
+                profiler.gpuPercentile(50) / 1000.0, profiler.gpuPercentile(99) / 1000.0);
+            glfwSetWindowTitle(window, title);
         }
 
         void updateUniformBuffer(uint32_t currentImage) {
@@ -459,10 +3642,17 @@ class HelloTriangleApplication {
 
             auto currentTime = std::chrono::high_resolution_clock::now();
             float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
+            // A fixed timestep makes the animation depend only on the frame number, so runs can be replayed
+            if (config.fixedTimestep > 0.0f) {
+                time = frameNumber * config.fixedTimestep;
+            }
+
+            updateInstanceTransforms(currentImage, time);
+
+            // Rotates 90 degree per second, pushed with the draws
+            drawConstants.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 2.0f));
 
             UniformBufferObject ubo{};
-            // Rotates 90 degree per second
-            ubo.model =  glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 2.0f));
             // For the view transformation I've decided to look at the geometry from above at a 45 degree angle. 
             // The glm::lookAt function takes the eye position, center position and up axis as parameters.
             ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
@@ -471,7 +3661,20 @@ class HelloTriangleApplication {
  
             ubo.proj[1][1] *= -1; //GLM was originally designed for OpenGL, where the Y coordinate of the clip coordinates is inverted
 
-            memcpy(uniformBuffersMapped[currentImage], &ubo, sizeof(ubo));
+            // The camera only changes with the window size, a slot is only written if it holds an older camera
+            if (cameraVersion == 0 || memcmp(&ubo, &camera, sizeof(ubo)) != 0) {
+                camera = ubo;
+                cameraVersion++;
+            }
+            if (uniformSlotVersions[currentImage] != cameraVersion) {
+                memcpy(static_cast<char*>(uniformBufferAllocation.mapped) + uniformOffset(currentImage), &camera, sizeof(camera));
+                uniformSlotVersions[currentImage] = cameraVersion;
+            }
+        }
+
+        // Dynamic offset of a frame's slot in the uniform buffer
+        uint32_t uniformOffset(uint32_t frame) const {
+            return static_cast<uint32_t>(uniformSlotSize * frame);
         }
         // Function to create a vulkan instance
         void createInstance() {
@@ -488,7 +3691,9 @@ class HelloTriangleApplication {
             appInfo.applicationVersion = VK_MAKE_API_VERSION(0, 1, 0, 0); // Application version
             appInfo.pEngineName = "No Engine"; // Engine name. Not using a engine
             appInfo.engineVersion = VK_MAKE_API_VERSION(0, 1, 0, 0); // Engine version
-            appInfo.apiVersion = VK_API_VERSION_1_0; // Vulkan api version
+            // 1.3 for dynamic rendering and synchronization2 as core features
+            // 1.2 devices use their KHR extensions if they have them, otherwise render passes and vkCmdPipelineBarrier
+            appInfo.apiVersion = VK_API_VERSION_1_3; // Vulkan api version
 
             // Defining the specifications of the vulkan instance 
             VkInstanceCreateInfo createInfo{};
@@ -532,11 +3737,14 @@ class HelloTriangleApplication {
         std::vector<const char*> getRequiredExtensions() {
 
             uint32_t glfwExtensionCount = 0; // Holds to cout of glfw extensions
-            const char** glfwExtensions; // Array of the glfw extensions
+            const char** glfwExtensions = nullptr; // Array of the glfw extensions
             // This function returns an array of strings of the name of the extensions used 
             // And also stores the no of extension used to the count variable
             // The array is Null and the count is zero if an error occurs
-            glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+            // Headless mode has no surface, so it needs none of them
+            if (!config.headless) {
+                glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+            }
 
             std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
 
@@ -667,61 +3875,279 @@ class HelloTriangleApplication {
 
             std::vector<VkPhysicalDevice> devices(deviceCount); // Array to store graphics device handles
             vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data()); // Store the GPU devices handles
-            
-            // Use an ordered map to automatically sort candidates by increasing score
-            std::multimap<int, VkPhysicalDevice> candidates;
-            // Loop over the devices and store the device and its rating in candidates arrary
-            for (const auto& device : devices) {
-                int score = rateDeviceSuitability(device);
-                candidates.insert(std::make_pair(score, device));
-            }
 
-            // Check if the best candidate is suitable at all
-            if (candidates.rbegin()->first > 0) {
-                physicalDevice = candidates.rbegin()->second;
+            // An index or UUID from HT_DEVICE names the device directly, it still has to be able to run the renderer
+            std::optional<size_t> selected = selectDeviceByName(devices);
+            if (selected) {
+                if (rateDeviceSuitability(devices[*selected]) <= 0) {
+                    throw std::runtime_error("the device " + config.device + " can't run the renderer!");
+                }
+                physicalDevice = devices[*selected];
             } else {
-                throw std::runtime_error("failed to find a suitable GPU!");
+                // Use an ordered map to automatically sort candidates by increasing score
+                // The first device wins ties, like the order of the loader
+                std::multimap<int, VkPhysicalDevice, std::greater<int>> candidates;
+                // Loop over the devices and store the device and its rating in candidates arrary
+                for (const auto& device : devices) {
+                    int score = rateDeviceSuitability(device);
+                    candidates.insert(std::make_pair(score, device));
+                }
+
+                // Check if the best candidate is suitable at all
+                if (candidates.begin()->first <= 0) {
+                    throw std::runtime_error("failed to find a suitable GPU!");
+                }
+                physicalDevice = candidates.begin()->second;
             }
+            vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+            deviceCapabilities = queryDeviceCapabilities(physicalDevice);
         }
 
-        // Checks if the device is suitable for application
-        int rateDeviceSuitability(VkPhysicalDevice device) {
-            VkPhysicalDeviceProperties deviceProperties; // For storing the device's property
-            vkGetPhysicalDeviceProperties(device, &deviceProperties); // Gets the device's property
+        // Finds the device HT_DEVICE names by index or UUID, nothing for a preference like "low-power"
+        std::optional<size_t> selectDeviceByName(const std::vector<VkPhysicalDevice>& devices) {
+            const std::string& name = config.device;
+            if (name.empty() || name == "low-power") return std::nullopt;
 
-            // For storing the features(texture compression, 64 bit floats and multi viewport rendering (useful for VR)) 
-            // supported by the device
-            VkPhysicalDeviceFeatures deviceFeatures; 
-            vkGetPhysicalDeviceFeatures(device, &deviceFeatures); // Getting the features supported
+            if (std::all_of(name.begin(), name.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+                size_t index = std::stoul(name);
+                if (index >= devices.size()) {
+                    throw std::runtime_error("there is no device " + name + "!");
+                }
+                return index;
+            }
+
+            // UUIDs are compared without the dashes and case
+            auto normalize = [](const std::string& uuid) {
+                std::string digits;
+                for (char c : uuid) {
+                    if (c != '-') digits += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+                }
+                return digits;
+            };
+            std::string uuid = normalize(name);
+            if (uuid.size() != 2 * VK_UUID_SIZE) {
+                throw std::runtime_error("unknown HT_DEVICE " + name + ", expected an index, a UUID or low-power!");
+            }
+            for (size_t i = 0; i < devices.size(); i++) {
+                if (normalize(deviceUuid(devices[i])) == uuid) {
+                    return i;
+                }
+            }
+            throw std::runtime_error("there is no device with the UUID " + name + "!");
+        }
 
-            int score = 0;
+        // The UUID of a device as hex digits in the usual 8-4-4-4-12 grouping, stable across runs and processes
+        static std::string deviceUuid(VkPhysicalDevice device) {
+            VkPhysicalDeviceIDProperties idProperties{};
+            idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+            VkPhysicalDeviceProperties2 properties{};
+            properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+            properties.pNext = &idProperties;
+            vkGetPhysicalDeviceProperties2(device, &properties);
+
+            std::string uuid;
+            char digits[3];
+            for (uint32_t i = 0; i < VK_UUID_SIZE; i++) {
+                if (i == 4 || i == 6 || i == 8 || i == 10) uuid += '-';
+                std::snprintf(digits, sizeof(digits), "%02x", idProperties.deviceUUID[i]);
+                uuid += digits;
+            }
+            return uuid;
+        }
 
-            // Discrete GPUs have a significant performance advantage
-            if (deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
-                score += 1000;
+        // Prints every device with what the selection sees, for picking one with HT_DEVICE
+        void listPhysicalDevices() {
+            uint32_t deviceCount = 0;
+            vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
+            std::vector<VkPhysicalDevice> devices(deviceCount);
+            vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
+
+            for (uint32_t i = 0; i < deviceCount; i++) {
+                VkPhysicalDeviceProperties properties;
+                vkGetPhysicalDeviceProperties(devices[i], &properties);
+                std::cout << i << ": " << properties.deviceName << " (" << deviceTypeName(properties.deviceType) << ")" << std::endl;
+                std::cout << "    uuid " << deviceUuid(devices[i]) << ", score " << rateDeviceSuitability(devices[i]) << std::endl;
+                std::cout << "    " << capabilityList(queryDeviceCapabilities(devices[i])) << std::endl;
             }
+        }
 
-            // Maximum possible size of textures affects graphics quality
-            score += deviceProperties.limits.maxImageDimension2D;
+        static const char* deviceTypeName(VkPhysicalDeviceType type) {
+            switch (type) {
+                case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return "integrated";
+                case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return "discrete";
+                case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return "virtual";
+                case VK_PHYSICAL_DEVICE_TYPE_CPU: return "cpu";
+                default: return "other";
+            }
+        }
 
-            // Support for sampler anisotropy
-            if (!deviceFeatures.samplerAnisotropy) {
-                return 0;
+        // The names of the capabilities the device has, space separated
+        static std::string capabilityList(const DeviceCapabilities& capabilities) {
+            std::string list;
+            for (const auto& [name, capability] : CAPABILITY_NAMES) {
+                if (capabilities.*capability) {
+                    list += list.empty() ? name : std::string(" ") + name;
+                }
+            }
+            return list;
+        }
+
+        /**
+         * Prints the picked device and which of the fast paths are on
+         * 
+         * A fast path is on when it is configured and the device has what it needs, the subsystems make that
+         * decision as they are created from deviceCapabilities.
+         */
+        void printDeviceReport() {
+            std::cout << "device: " << deviceProperties.deviceName << " (" << deviceTypeName(deviceProperties.deviceType) << ")" << std::endl;
+            std::vector<std::pair<const char*, bool>> fastPaths = {
+                {"bindless", bindless},
+                {"dynamic_rendering", dynamicRendering},
+                {"present_wait", waitForPresent != nullptr},
+                {"gpu_culling", gpuCulling},
+                {"synchronization2", synchronization2},
+                {"async_culling", asyncCulling},
+                {"multi_draw_indirect", config.indirectDraw && deviceCapabilities.multiDrawIndirect},
+                {"msaa", msaaSamples != VK_SAMPLE_COUNT_1_BIT},
+                {"packed_vertices", packedVertices},
+            };
+            std::string enabled, disabled;
+            for (const auto& [name, on] : fastPaths) {
+                std::string& list = on ? enabled : disabled;
+                list += list.empty() ? name : std::string(" ") + name;
+            }
+            std::cout << "fast paths on: " << enabled << std::endl;
+            std::cout << "fast paths off: " << disabled << std::endl;
+        }
+
+        // Checks which optional features the device offers
+        DeviceCapabilities queryDeviceCapabilities(VkPhysicalDevice device) {
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties(device, &properties);
+            VkPhysicalDeviceFeatures features;
+            vkGetPhysicalDeviceFeatures(device, &features);
+
+            DeviceCapabilities capabilities;
+            capabilities.multiDrawIndirect = features.multiDrawIndirect;
+            capabilities.samplerAnisotropy = features.samplerAnisotropy;
+            capabilities.textureCompressionBC = features.textureCompressionBC;
+            capabilities.textureCompressionASTC = features.textureCompressionASTC_LDR;
+            capabilities.textureCompressionETC2 = features.textureCompressionETC2;
+
+            // The Vulkan 1.2 features can only be queried from a 1.2 device
+            if (properties.apiVersion >= VK_API_VERSION_1_2) {
+                VkPhysicalDeviceVulkan12Features features12{};
+                features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+                VkPhysicalDeviceFeatures2 features2{};
+                features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+                features2.pNext = &features12;
+
+                // The present features can only be queried if the extensions exist
+                // Nothing is presented in headless mode
+                VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+                presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+                VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+                presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+                bool presentExtensions = !config.headless && checkDeviceExtensionSupport(device, 
+                    {VK_KHR_PRESENT_ID_EXTENSION_NAME, VK_KHR_PRESENT_WAIT_EXTENSION_NAME});
+                if (presentExtensions) {
+                    features12.pNext = &presentIdFeatures;
+                    presentIdFeatures.pNext = &presentWaitFeatures;
+                }
+
+                // Dynamic rendering is core in 1.3, older devices may offer the extension
+                VkPhysicalDeviceVulkan13Features features13{};
+                features13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+                VkPhysicalDeviceDynamicRenderingFeatures dynamicRenderingFeatures{};
+                dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES;
+                // And so is synchronization2
+                VkPhysicalDeviceSynchronization2Features synchronization2Features{};
+                synchronization2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES;
+                if (properties.apiVersion >= VK_API_VERSION_1_3) {
+                    features13.pNext = features2.pNext;
+                    features2.pNext = &features13;
+                } else {
+                    if (checkDeviceExtensionSupport(device, {VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME})) {
+                        dynamicRenderingFeatures.pNext = features2.pNext;
+                        features2.pNext = &dynamicRenderingFeatures;
+                    }
+                    if (checkDeviceExtensionSupport(device, {VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME})) {
+                        synchronization2Features.pNext = features2.pNext;
+                        features2.pNext = &synchronization2Features;
+                    }
+                }
+                vkGetPhysicalDeviceFeatures2(device, &features2);
+
+                capabilities.drawIndirectCount = features12.drawIndirectCount;
+                capabilities.timelineSemaphore = features12.timelineSemaphore;
+                capabilities.presentWait = presentExtensions && presentIdFeatures.presentId && presentWaitFeatures.presentWait;
+                capabilities.dynamicRenderingCore = features13.dynamicRendering;
+                capabilities.dynamicRendering = features13.dynamicRendering || dynamicRenderingFeatures.dynamicRendering;
+                capabilities.synchronization2Core = features13.synchronization2;
+                capabilities.synchronization2 = features13.synchronization2 || synchronization2Features.synchronization2;
+                capabilities.descriptorIndexing = features12.runtimeDescriptorArray && features12.descriptorBindingPartiallyBound 
+                    && features12.shaderSampledImageArrayNonUniformIndexing;
             }
-            // Application can't function without geometry shaders
-            if (!deviceFeatures.geometryShader) {
+            return capabilities;
+        }
+
+        /**
+         * Checks if the device is suitable for application and scores it
+         * 
+         * Returns 0 when the device lacks something the renderer can't do without, or a capability HT_REQUIRE
+         * asks for. Otherwise the device type decides first, discrete GPUs are faster while integrated ones
+         * draw less power (HT_DEVICE=low-power). Every fast path the device supports adds to the score.
+         */
+        int rateDeviceSuitability(VkPhysicalDevice device) {
+            VkPhysicalDeviceProperties deviceProperties; // For storing the device's property
+            vkGetPhysicalDeviceProperties(device, &deviceProperties); // Gets the device's property
+
+            // Frame pacing and resource recycling are built on a timeline semaphore
+            DeviceCapabilities capabilities = queryDeviceCapabilities(device);
+            if (!capabilities.timelineSemaphore) {
                 return 0;
             }
+            for (const std::string& required : config.requiredCapabilities) {
+                auto entry = std::find_if(CAPABILITY_NAMES.begin(), CAPABILITY_NAMES.end(), 
+                    [&required](const auto& capability) { return required == capability.first; });
+                if (entry == CAPABILITY_NAMES.end()) {
+                    throw std::runtime_error("unknown capability " + required + " in HT_REQUIRE!");
+                }
+                if (!(capabilities.*entry->second)) {
+                    return 0;
+                }
+            }
+
+            int score = 1;
+            bool lowPower = config.device == "low-power";
+            if (deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
+                // Discrete GPUs have a significant performance advantage
+                score += lowPower ? 1000 : 2000;
+            } else if (deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU) {
+                // Sharing the memory and die with the CPU they use far less power
+                score += lowPower ? 2000 : 1000;
+            }
+            // Software renderers (CPU) and virtual GPUs come last
+
+            // The optional fast paths, the renderer falls back without them
+            for (bool DeviceCapabilities::* fastPath : {&DeviceCapabilities::dynamicRendering, &DeviceCapabilities::descriptorIndexing,
+                &DeviceCapabilities::drawIndirectCount, &DeviceCapabilities::multiDrawIndirect, &DeviceCapabilities::presentWait, 
+                &DeviceCapabilities::samplerAnisotropy, &DeviceCapabilities::synchronization2}) {
+                if (capabilities.*fastPath) {
+                    score += 100;
+                }
+            }
 
             // Checking if the device supports the required extensions
-            bool extensionsSupported = checkDeviceExtensionSupport(device);
+            bool extensionsSupported = checkDeviceExtensionSupport(device, getRequiredDeviceExtensions());
             if (!extensionsSupported) {
                 return 0;
             }
 
             // If the swapchain is compatiable with the surface
-            bool swapChainAdequate = false;
-            if (extensionsSupported) {
+            // Headless mode never presents, any device will do
+            bool swapChainAdequate = config.headless;
+            if (extensionsSupported && !config.headless) {
                 SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
                 swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
             }
@@ -751,36 +4177,69 @@ class HelloTriangleApplication {
             
             // Finding a queue families with the required capabilities
             int i = 0; // Index of the current queue family of the physical device
+            bool dedicatedTransfer = false; // True once a transfer only family is found
             for (const auto& queueFamily : queueFamilies) {
                 // Checks for a queue family for drawing
-                if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+                if (!indices.graphicsFamily.has_value() && (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
                     indices.graphicsFamily = i;
                 }
                 // If the device offers a seprate transfer queue
-                // else if (queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) {
-                //     indices.transferFamily = i;
-                // }
+                // A family without graphics or compute is usually backed by the DMA engines
+                // Any other non graphics family is still better than sharing the graphics queue
+                else if (!dedicatedTransfer && (queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) 
+                    && !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+                    dedicatedTransfer = !(queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT);
+                    indices.transferFamily = i;
+                }
+                // A compute family without graphics is usually backed by the async compute engines
+                // One that isn't also the transfer family is preferred, so uploads don't queue behind the compute work
+                if ((queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+                    && (!indices.computeFamily.has_value() || indices.computeFamily == indices.transferFamily)) {
+                    indices.computeFamily = i;
+                }
 
                 // Checks for a queue family for presenting to the surface
-                VkBool32 presentSupport = false;
-                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
-                // Assignes the index when a suitable queue family is found
-                if (presentSupport) {
-                    indices.presentFamily = i;
+                if (!indices.presentFamily.has_value() && surface != VK_NULL_HANDLE) {
+                    VkBool32 presentSupport = false;
+                    vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+                    // Assignes the index when a suitable queue family is found
+                    if (presentSupport) {
+                        indices.presentFamily = i;
+                    }
                 }
 
                 // If the queue families with the requirements is already assigned
-                if (indices.isComplete()) {
+                if (indices.isComplete() && dedicatedTransfer && indices.computeFamily.has_value()) {
                     break;
                 }
 
                 i++;
             }
+            // Graphics queues can always transfer, so uploads fall back to it
+            if (!indices.transferFamily.has_value()) {
+                indices.transferFamily = indices.graphicsFamily;
+            }
+            // Graphics queues can always dispatch, so the compute passes stay on it
+            if (!indices.computeFamily.has_value()) {
+                indices.computeFamily = indices.graphicsFamily;
+            }
+            // Nothing is presented without a surface, the graphics queue stands in
+            if (surface == VK_NULL_HANDLE) {
+                indices.presentFamily = indices.graphicsFamily;
+            }
             return indices;
         } 
 
-        // Loops through the required extensions's list and checks if the device supports them
-        bool checkDeviceExtensionSupport(VkPhysicalDevice device) {
+        // Device extensions the application enables, headless mode doesn't need the swap chain
+        std::vector<const char*> getRequiredDeviceExtensions() {
+            if (config.headless) {
+                return {};
+            }
+            return deviceExtensions;
+        }
+
+        // Loops through the extensions's list and checks if the device supports them
+        bool checkDeviceExtensionSupport(VkPhysicalDevice device, const std::vector<const char*>& extensions) {
             uint32_t extensionCount; // Stores the count of extensions supported by the device
             vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);    // Gets the count from the device
 
@@ -789,7 +4248,7 @@ class HelloTriangleApplication {
             vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data()); // Gets the array of extensions
 
             // Set of the extensions required
-            std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+            std::set<std::string> requiredExtensions(extensions.begin(), extensions.end());
 
             // Erasing the extensions from the requiredExtensions set which are in the availableExtensions vector
             for (const auto& extension : availableExtensions) {
@@ -807,7 +4266,8 @@ class HelloTriangleApplication {
             QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
             // A vector that stores structs of queue creation info
             std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-            std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+            std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(), indices.presentFamily.value(), 
+                indices.transferFamily.value(), indices.computeFamily.value()};
 
             float queuePriority = 1.0f;
             for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -821,7 +4281,46 @@ class HelloTriangleApplication {
             }
 
             VkPhysicalDeviceFeatures deviceFeatures{}; // Features required
-            deviceFeatures.samplerAnisotropy = VK_TRUE;
+            // Optional features, only enabled when the device supports them
+            deviceFeatures.samplerAnisotropy = deviceCapabilities.samplerAnisotropy;
+            deviceFeatures.multiDrawIndirect = deviceCapabilities.multiDrawIndirect;
+            // Whichever compressed formats the device has, so a compressed texture file can be sampled
+            deviceFeatures.textureCompressionBC = deviceCapabilities.textureCompressionBC;
+            deviceFeatures.textureCompressionASTC_LDR = deviceCapabilities.textureCompressionASTC;
+            deviceFeatures.textureCompressionETC2 = deviceCapabilities.textureCompressionETC2;
+
+            VkPhysicalDeviceVulkan12Features features12{};
+            features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+            features12.drawIndirectCount = deviceCapabilities.drawIndirectCount;
+            features12.timelineSemaphore = VK_TRUE;
+            // Descriptor indexing, core in 1.2, for the bindless texture array
+            bindless = config.bindless && deviceCapabilities.descriptorIndexing;
+            features12.runtimeDescriptorArray = bindless;
+            features12.descriptorBindingPartiallyBound = bindless;
+            features12.shaderSampledImageArrayNonUniformIndexing = bindless;
+
+            // Optional, used to pace the frames when available
+            VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+            presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+            presentIdFeatures.presentId = VK_TRUE;
+            VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+            presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+            presentWaitFeatures.presentWait = VK_TRUE;
+            presentIdFeatures.pNext = &presentWaitFeatures;
+
+            // Dynamic rendering, from the 1.3 features or the extension
+            dynamicRendering = config.dynamicRendering && deviceCapabilities.dynamicRendering;
+            VkPhysicalDeviceVulkan13Features features13{};
+            features13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+            VkPhysicalDeviceDynamicRenderingFeatures dynamicRenderingFeatures{};
+            dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES;
+            dynamicRenderingFeatures.dynamicRendering = VK_TRUE;
+
+            // The barriers of the render graphs, they fall back to vkCmdPipelineBarrier without it
+            synchronization2 = deviceCapabilities.synchronization2;
+            VkPhysicalDeviceSynchronization2Features synchronization2Features{};
+            synchronization2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES;
+            synchronization2Features.synchronization2 = VK_TRUE;
 
             // Creating the structure of the logical device to be created
             VkDeviceCreateInfo createInfo{};
@@ -831,14 +4330,54 @@ class HelloTriangleApplication {
             createInfo.pQueueCreateInfos = queueCreateInfos.data(); // Creation structs of the queue families
 
             createInfo.pEnabledFeatures = &deviceFeatures;  // Pointing to the features used
+            // The 1.2 features struct may only be chained on a 1.2 device
+            if (deviceProperties.apiVersion >= VK_API_VERSION_1_2) {
+                createInfo.pNext = &features12;
+            }
 
             // Setting the extension count and status of validation layers
             // It is ignored by up-to-date implementaions
             // Here for backward compatability
 
             // Setting the count of extensions and giving the pointer to the array
-            createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-            createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+            std::vector<const char*> extensions = getRequiredDeviceExtensions();
+            bool presentWait = deviceCapabilities.presentWait && config.presentWait;
+            if (presentWait) {
+                extensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+                extensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+                features12.pNext = &presentIdFeatures;
+            }
+            // Chained in front of the other features, the 1.3 features only once for everything they enable
+            auto chainFeatures = [&](void* features, void** next) {
+                *next = const_cast<void*>(createInfo.pNext);
+                createInfo.pNext = features;
+            };
+            bool features13Chained = false;
+            auto enableFeature13 = [&](VkBool32 VkPhysicalDeviceVulkan13Features::* feature) {
+                features13.*feature = VK_TRUE;
+                if (!features13Chained) {
+                    chainFeatures(&features13, &features13.pNext);
+                    features13Chained = true;
+                }
+            };
+            if (dynamicRendering) {
+                if (deviceCapabilities.dynamicRenderingCore) {
+                    enableFeature13(&VkPhysicalDeviceVulkan13Features::dynamicRendering);
+                } else {
+                    extensions.push_back(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME);
+                    chainFeatures(&dynamicRenderingFeatures, &dynamicRenderingFeatures.pNext);
+                }
+            }
+            if (synchronization2) {
+                if (deviceCapabilities.synchronization2Core) {
+                    enableFeature13(&VkPhysicalDeviceVulkan13Features::synchronization2);
+                } else {
+                    extensions.push_back(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+                    chainFeatures(&synchronization2Features, &synchronization2Features.pNext);
+                }
+            }
+            createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+            createInfo.ppEnabledExtensionNames = extensions.data();
             // Checking if in debug mode or not
             if (enableValidationLayers) {
                 // Setting the count of layers and giving the pointer to the array
@@ -857,6 +4396,42 @@ class HelloTriangleApplication {
             vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
             // Storing the handle of the presentation queue to index 0
             vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+            // Storing the handle of the queue used for uploads to index 0
+            vkGetDeviceQueue(device, indices.transferFamily.value(), 0, &transferQueue);
+            // Storing the handle of the queue the async compute passes run on to index 0
+            // It is the transfer queue when they share a family, which is fine as both are only submitted to from this thread
+            vkGetDeviceQueue(device, indices.computeFamily.value(), 0, &computeQueue);
+
+            graphicsQueueFamily = indices.graphicsFamily.value();
+            transferQueueFamily = indices.transferFamily.value();
+            computeQueueFamily = indices.computeFamily.value();
+
+            // Extension functions aren't exported by the loader
+            if (presentWait) {
+                waitForPresent = (PFN_vkWaitForPresentKHR) vkGetDeviceProcAddr(device, "vkWaitForPresentKHR");
+            }
+            if (dynamicRendering) {
+                const char* suffix = deviceCapabilities.dynamicRenderingCore ? "" : "KHR";
+                cmdBeginRendering = (PFN_vkCmdBeginRendering) vkGetDeviceProcAddr(device, (std::string("vkCmdBeginRendering") + suffix).c_str());
+                cmdEndRendering = (PFN_vkCmdEndRendering) vkGetDeviceProcAddr(device, (std::string("vkCmdEndRendering") + suffix).c_str());
+                if (cmdBeginRendering == nullptr || cmdEndRendering == nullptr) {
+                    throw std::runtime_error("failed to load dynamic rendering functions!");
+                }
+            }
+            if (synchronization2) {
+                const char* name = deviceCapabilities.synchronization2Core ? "vkCmdPipelineBarrier2" : "vkCmdPipelineBarrier2KHR";
+                cmdPipelineBarrier2 = (PFN_vkCmdPipelineBarrier2) vkGetDeviceProcAddr(device, name);
+                if (cmdPipelineBarrier2 == nullptr) {
+                    throw std::runtime_error("failed to load synchronization2 functions!");
+                }
+            }
+            // The frame's passes are timed, the compute queue has no GPU scopes
+            frameGraph.init(cmdPipelineBarrier2, [this](VkCommandBuffer commandBuffer, const char* name) {
+                beginGpuScope(commandBuffer, name);
+            }, [this](VkCommandBuffer commandBuffer) {
+                endGpuScope(commandBuffer);
+            });
+            computeGraph.init(cmdPipelineBarrier2);
         }
 
 
@@ -868,7 +4443,11 @@ class HelloTriangleApplication {
             VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
 
             // Minimum no. of images in the swap chain for it to function. Plus one for overhead
+            // Unless HT_SWAPCHAIN_IMAGES asks for a count, which can't go below the minimum
             uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+            if (config.swapchainImages > 0) {
+                imageCount = std::max(config.swapchainImages, swapChainSupport.capabilities.minImageCount);
+            }
 
             // Making sure the imagecount does not exceed the maximum supported by the implementaion
             // Here 0 means there is no limit
@@ -916,7 +4495,9 @@ class HelloTriangleApplication {
             createInfo.presentMode = presentMode;
             createInfo.clipped = VK_TRUE; // Enabling clipping of pixel , Better performance  
 
-            createInfo.oldSwapchain = VK_NULL_HANDLE; // Incase the we are replacing an existing swap chain 
+            // Incase the we are replacing an existing swap chain
+            // Passing it lets the driver reuse its resources and keep presenting while the new one is created
+            createInfo.oldSwapchain = swapChain;
 
             if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS) {
                 throw std::runtime_error("failed to create swap chain!");
@@ -930,9 +4511,29 @@ class HelloTriangleApplication {
             // Storing format and size for future use
             swapChainImageFormat = surfaceFormat.format;
             swapChainExtent = extent;
+            presentId = 0; // Present ids count per swap chain
 
         }
 
+        /**
+         * Headless mode: creates the images rendered to in place of the swap chain
+         * 
+         * One image per frame in flight, so a frame never draws over an image the GPU is still using.
+         * They can be copied out (e.g. to check the output) since they end in TRANSFER_SRC_OPTIMAL.
+         */
+        void createOffscreenImages() {
+            swapChainImageFormat = VK_FORMAT_R8G8B8A8_SRGB;
+            swapChainExtent = {WIDTH, HEIGHT};
+
+            swapChainImages.resize(config.framesInFlight);
+            offscreenImageAllocations.resize(config.framesInFlight);
+            for (uint32_t i = 0; i < config.framesInFlight; i++) {
+                createImage(swapChainExtent.width, swapChainExtent.height, 1, swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL, 
+                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 
+                    swapChainImages[i], offscreenImageAllocations[i]);
+            }
+        }
+
         // Checks if swapchian supports the surface
         SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device) {
             SwapChainSupportDetails details;
@@ -1009,9 +4610,10 @@ class HelloTriangleApplication {
         * resulting in fewer latency issues than standard vertical sync. This is commonly known as "triple buffering", 
         * although the existence of three buffers alone does not necessarily mean that the framerate is unlocked.
         */
+        // Uses the mode chosen with HT_PRESENT_MODE, mailbox by default
         VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes) {
             for (const auto& availablePresentMode : availablePresentModes) {
-                if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) { // Good if enery usage is not a concern else use VK_PRESENT_MODE_FIFO_RELAXED_KHR
+                if (availablePresentMode == config.presentMode) { // Mailbox is good if enery usage is not a concern else use VK_PRESENT_MODE_FIFO_RELAXED_KHR
                     return availablePresentMode;
                 }
             }
@@ -1043,12 +4645,87 @@ class HelloTriangleApplication {
                 return actualExtent;
             }
         }
+        /**
+         * Picks the depth format and the sample count of the render targets
+         * 
+         * The depth format is the most precise one that can be a depth attachment. The sample count is the 
+         * largest supported one up to HT_MSAA, for color and depth alike. Also sets up the render target pool.
+         */
+        void chooseRenderTargetFormats() {
+            depthFormat = VK_FORMAT_UNDEFINED;
+            for (VkFormat format : {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT}) {
+                VkFormatProperties properties;
+                vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+                if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+                    depthFormat = format;
+                    break;
+                }
+            }
+            if (depthFormat == VK_FORMAT_UNDEFINED) {
+                throw std::runtime_error("failed to find a depth format!");
+            }
+
+            const VkPhysicalDeviceLimits& limits = deviceProperties.limits;
+            VkSampleCountFlags counts = limits.framebufferColorSampleCounts & limits.framebufferDepthSampleCounts;
+            msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+            for (uint32_t samples = config.msaaSamples; samples > 1; samples /= 2) {
+                if (counts & samples) {
+                    msaaSamples = static_cast<VkSampleCountFlagBits>(samples);
+                    break;
+                }
+            }
+
+            renderTargets.init([this](const RenderTargetKey& key) { return createRenderTarget(key); }, 
+                [this](RenderTarget& target) { deferDestroyImage(target.image, target.view, target.allocation); });
+        }
+
+        /**
+         * Takes the depth and multisampled color targets for the current extent from the pool
+         * 
+         * Both are transient: they are cleared at the start of the frame and never stored, the multisampled
+         * color is resolved into the swap chain image within the subpass. On tile based GPUs they then only
+         * live in tile memory and never take up or write to DRAM.
+         */
+        void createRenderTargets() {
+            RenderTargetKey depthKey{swapChainExtent.width, swapChainExtent.height, depthFormat, msaaSamples, 
+                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT};
+            depthTarget = renderTargets.acquire(depthKey);
+
+            if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+                RenderTargetKey colorKey{swapChainExtent.width, swapChainExtent.height, swapChainImageFormat, msaaSamples, 
+                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT};
+                colorTarget = renderTargets.acquire(colorKey);
+            }
+        }
+
+        // Lazily allocated memory is only committed when a tile has to spill, if the device has any
+        RenderTarget createRenderTarget(const RenderTargetKey& key) {
+            RenderTarget target;
+            target.key = key;
+            createImage(key.width, key.height, 1, key.format, VK_IMAGE_TILING_OPTIMAL, key.usage, 
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, target.image, target.allocation, key.samples);
+            VkImageAspectFlags aspect = key.usage & VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+            target.view = createImageView(target.image, key.format, 1, aspect);
+            return target;
+        }
+
+        // The aspects a barrier on the depth target has to name
+        VkImageAspectFlags depthAspects() const {
+            bool stencil = depthFormat == VK_FORMAT_D32_SFLOAT_S8_UINT || depthFormat == VK_FORMAT_D24_UNORM_S8_UINT;
+            return VK_IMAGE_ASPECT_DEPTH_BIT | (stencil ? VK_IMAGE_ASPECT_STENCIL_BIT : 0);
+        }
+
         // to specify how many color and depth buffers there will be, how many samples to use for 
         // each of them and how their contents should be handled throughout the rendering operations
+        // Dynamic rendering describes the attachments when recording instead, see recordCommandBuffer()
         void createRenderPass() {
+            if (dynamicRendering) return;
+            bool multisampled = msaaSamples != VK_SAMPLE_COUNT_1_BIT;
+
+            // The multisampled color target, or the swap chain image without MSAA
             VkAttachmentDescription colorAttachment{};
             colorAttachment.format = swapChainImageFormat;
-            colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+            colorAttachment.samples = msaaSamples;
 
             // The loadOp and storeOp determine what to do with the data in the attachment before 
             // rendering and after rendering.
@@ -1063,7 +4740,8 @@ class HelloTriangleApplication {
             // 
             // VK_ATTACHMENT_STORE_OP_STORE: Rendered contents will be stored in memory and can be read later
             // VK_ATTACHMENT_STORE_OP_DONT_CARE: Contents of the framebuffer will be undefined after the rendering operation
-            colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+            // The samples are resolved before the end of the subpass, so they don't have to be stored
+            colorAttachment.storeOp = multisampled ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
 
             // The loadOp and storeOp apply to color and depth data, and stencilLoadOp / stencilStoreOp apply to stencil data.
             colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
@@ -1075,32 +4753,72 @@ class HelloTriangleApplication {
             // VK_IMAGE_LAYOUT_PRESENT_SRC_KHR:             Images to be presented in the swap chain
             // VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:        Images to be used as destination for a memory copy operation
             colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;      // Don't care what the image layout is before render pass
-            colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;  // The render pass after render pass
+            // The layout after render pass
+            colorAttachment.finalLayout = multisampled ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : finalColorLayout();
 
             VkAttachmentReference colorAttachmentRef{};
-            colorAttachmentRef.attachment = 0; // Referencing the attachment at index 0; the only one 
+            colorAttachmentRef.attachment = 0; // Referencing the attachment at index 0
             colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL; // Best layout for using attachment as color buffer
 
+            // Like the multisampled color, depth is cleared at the start and thrown away at the end
+            VkAttachmentDescription depthAttachment{};
+            depthAttachment.format = depthFormat;
+            depthAttachment.samples = msaaSamples;
+            depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+            depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+            VkAttachmentReference depthAttachmentRef{};
+            depthAttachmentRef.attachment = 1;
+            depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+            // With MSAA, the swap chain image the samples are resolved into
+            // Every pixel is written by the resolve, so the old contents don't need to be loaded
+            VkAttachmentDescription resolveAttachment{};
+            resolveAttachment.format = swapChainImageFormat;
+            resolveAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+            resolveAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            resolveAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+            resolveAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            resolveAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            resolveAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            resolveAttachment.finalLayout = finalColorLayout();
+
+            VkAttachmentReference resolveAttachmentRef{};
+            resolveAttachmentRef.attachment = 2;
+            resolveAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
             VkSubpassDescription subpass{};
             subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS; // Explicitly using a graphics subpass
             subpass.colorAttachmentCount = 1;
             subpass.pColorAttachments = &colorAttachmentRef;
+            subpass.pDepthStencilAttachment = &depthAttachmentRef;
+            // The resolve happens at the end of the subpass, on tilers straight out of tile memory
+            subpass.pResolveAttachments = multisampled ? &resolveAttachmentRef : nullptr;
 
             VkSubpassDependency dependency{};
             dependency.srcSubpass = VK_SUBPASS_EXTERNAL; // Implicit subpasses before rendering
             dependency.dstSubpass = 0;  // Index of the first subpass, our only subpass
 
+            // The frame graph leaves the attachments to this dependency, see buildFrameGraph()
             // Wait for the swap chain to finish reading from the image before we can access it.
-            dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT; // Waiting on the color attachment output stage 
-            dependency.srcAccessMask = 0; // Where this can occur
+            // The depth and multisampled color targets are shared by the frames in flight, so the previous
+            // frame's writes to them have to finish first as well
+            dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+            dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+            dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+            dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
-            dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-            dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+            std::array<VkAttachmentDescription, 3> attachments = {colorAttachment, depthAttachment, resolveAttachment};
 
             VkRenderPassCreateInfo renderPassInfo{};
             renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-            renderPassInfo.attachmentCount = 1; // No. of attachments
-            renderPassInfo.pAttachments = &colorAttachment; // Pointer to array of attachments
+            renderPassInfo.attachmentCount = multisampled ? 3 : 2; // No. of attachments
+            renderPassInfo.pAttachments = attachments.data(); // Pointer to array of attachments
             renderPassInfo.subpassCount = 1;    // No. of subpasses
             renderPassInfo.pSubpasses = &subpass;   // Pointer to array of subpasses
             renderPassInfo.dependencyCount = 1;
@@ -1112,6 +4830,12 @@ class HelloTriangleApplication {
             }
         }
 
+        // Layout the color image is left in after rendering, ready to be presented
+        // Offscreen images are left ready to be copied out instead of presented
+        VkImageLayout finalColorLayout() const {
+            return config.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        }
+
         // Creates image views for the images in the swap chain
         void createImageViews() {
             // Resizing vector to fit all the images in the swap chain
@@ -1127,7 +4851,8 @@ class HelloTriangleApplication {
         void createDescriptorSetLayout() {
             VkDescriptorSetLayoutBinding uboLayoutBinding{};
             uboLayoutBinding.binding = 0; // Binding of the uniform buffer in the vertex shader
-            uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            // Dynamic, the offset into the uniform buffer is given when the set is bound
+            uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
             // The binding/ shader variable can represent an array of uniform buffers that each define separate transformation
             uboLayoutBinding.descriptorCount = 1;
 
@@ -1137,36 +4862,126 @@ class HelloTriangleApplication {
 
             uboLayoutBinding.pImmutableSamplers = nullptr; // Used for image sampling descriptors
 
+            // Bindless mode has an array of every texture, as large as the device allows all shader stages
+            if (bindless) {
+                const VkPhysicalDeviceLimits& limits = deviceProperties.limits;
+                bindlessTextureCount = std::min({MAX_BINDLESS_TEXTURES, limits.maxPerStageDescriptorSamplers, 
+                    limits.maxPerStageDescriptorSampledImages, limits.maxDescriptorSetSampledImages});
+            }
             VkDescriptorSetLayoutBinding samplerLayoutBinding{};
             samplerLayoutBinding.binding = 1;
-            samplerLayoutBinding.descriptorCount = 1;
+            samplerLayoutBinding.descriptorCount = bindlessTextureCount;
             samplerLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
             samplerLayoutBinding.pImmutableSamplers = nullptr;
             samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
-            std::array<VkDescriptorSetLayoutBinding, 2> bindings = {uboLayoutBinding, samplerLayoutBinding};
+            // Per instance model matrices, indexed with gl_InstanceIndex
+            VkDescriptorSetLayoutBinding instanceLayoutBinding{};
+            instanceLayoutBinding.binding = 2;
+            instanceLayoutBinding.descriptorCount = 1;
+            // Dynamic, animated instances have a slot per frame
+            instanceLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+            instanceLayoutBinding.pImmutableSamplers = nullptr;
+            instanceLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+            std::array<VkDescriptorSetLayoutBinding, 3> bindings = {uboLayoutBinding, samplerLayoutBinding, instanceLayoutBinding};
             VkDescriptorSetLayoutCreateInfo layoutInfo{};
             layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
             layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
             layoutInfo.pBindings = bindings.data();
 
-            if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &descriptorSetLayout) != VK_SUCCESS) {
-                throw std::runtime_error("failed to create descriptor set layout!");
+            // The unused elements of the texture array may stay unwritten
+            std::array<VkDescriptorBindingFlags, 3> bindingFlags = {0, VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT, 0};
+            VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{};
+            bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+            bindingFlagsInfo.bindingCount = static_cast<uint32_t>(bindingFlags.size());
+            bindingFlagsInfo.pBindingFlags = bindingFlags.data();
+            if (bindless) {
+                layoutInfo.pNext = &bindingFlagsInfo;
+            }
+
+            if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &descriptorSetLayout) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create descriptor set layout!");
+            }
+        }
+
+        // The stages of the graphics pipeline
+        std::array<ShaderStageFiles, 2> graphicsShaderFiles() const {
+            ShaderStageFiles vertex{"shaders/vertex_shader.vert", "shaders/vert.spv", VK_SHADER_STAGE_VERTEX_BIT, {}};
+            // The bindless variant samples the texture array, see compile.sh
+            ShaderStageFiles fragment{"shaders/fragment_shader.frag", bindless ? "shaders/frag_bindless.spv" : "shaders/frag.spv", 
+                VK_SHADER_STAGE_FRAGMENT_BIT, {}};
+            if (bindless) {
+                fragment.defines.push_back("BINDLESS");
+            }
+            return {vertex, fragment};
+        }
+
+        // Starts creating the pipeline the scene is drawn with, initVulkan picks it up once everything else is set up
+        void createGraphicsPipeline() {
+            createGraphicsPipelineLayout();
+
+            auto shaderFiles = graphicsShaderFiles();
+            graphicsPipelineDesc.vertexShader = shaderFiles[0].binary;
+            graphicsPipelineDesc.fragmentShader = shaderFiles[1].binary;
+            graphicsPipelineDesc.packedVertices = packedVertices;
+            graphicsPipelineDesc.colorFormat = swapChainImageFormat;
+            graphicsPipelineDesc.depthFormat = depthFormat;
+            graphicsPipelineDesc.samples = msaaSamples;
+
+            uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+            pipelines.start([this](const PipelineDesc& desc) { return createPipeline(desc); }, std::max(1u, cores / 2));
+            pipelines.prewarm(graphicsPipelineDesc);
+        }
+
+        // Creates the pipeline of a description, runs on the registry's compile threads
+        VkPipeline createPipeline(const PipelineDesc& desc) {
+            // Reading the byte code and storing them
+            auto vertShaderCode = readFile(desc.vertexShader); // For storing vertex shader byte code
+            auto fragShaderCode = readFile(desc.fragmentShader); // For storing fragment shader byte code
+
+            // Wrapping the bytecode
+            // The compilation and linking of the SPIR-V bytecode to machine code for execution by the GPU 
+            // doesn't happen until the graphics pipeline is created. That means that we're allowed to destroy 
+            // the shader modules again as soon as pipeline creation is finished, which is why we'll make them 
+            // local variables here instead of class members
+            VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);   
+            VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+
+            VkPipeline pipeline = buildGraphicsPipeline(desc, vertShaderModule, fragShaderModule);
+
+            // Cleaning up the shader modules after creation of pipeline
+            vkDestroyShaderModule(device, fragShaderModule, nullptr);
+            vkDestroyShaderModule(device, vertShaderModule, nullptr);
+            return pipeline;
+        }
+
+        void createGraphicsPipelineLayout() {
+            // The per draw constants, 128 bytes are guaranteed to be available
+            VkPushConstantRange pushConstantRange{};
+            pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+            pushConstantRange.offset = 0;
+            pushConstantRange.size = sizeof(DrawConstants);
+
+            VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+            pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+            pipelineLayoutInfo.setLayoutCount = 1; 
+            pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+            pipelineLayoutInfo.pushConstantRangeCount = 1;
+            pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+            if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create pipeline layout!");
             }
         }
 
-        void createGraphicsPipeline() {
-            // Reading the byte code and storing them
-            auto vertShaderCode = readFile("shaders/vert.spv"); // For storing vertex shader byte code
-            auto fragShaderCode = readFile("shaders/frag.spv"); // For storing fragment shader byte code
-
-            // Wrapping the bytecode
-            // The compilation and linking of the SPIR-V bytecode to machine code for execution by the GPU 
-            // doesn't happen until the graphics pipeline is created. That means that we're allowed to destroy 
-            // the shader modules again as soon as pipeline creation is finished, which is why we'll make them 
-            // local variables in the createGraphicsPipeline function instead of class members
-            VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);   
-            VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+        /**
+         * Creates a graphics pipeline out of its description and shader modules
+         * 
+         * Only reads state that doesn't change after initialisation, so the compile and hot reload threads 
+         * can call it. The pipeline cache is internally synchronized.
+         */
+        VkPipeline buildGraphicsPipeline(const PipelineDesc& desc, VkShaderModule vertShaderModule, VkShaderModule fragShaderModule) {
 
             // Assigning the shaders to the graphics pipeline stage
 
@@ -1193,8 +5008,8 @@ class HelloTriangleApplication {
             // Since we are using hard coded data, we insert null pointers
             VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
             vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-            auto bindingDescription = Vertex::getBindingDescription();
-            auto attributeDescriptions = Vertex::getAttributeDescriptions();
+            auto bindingDescription = desc.packedVertices ? PackedVertex::getBindingDescription() : Vertex::getBindingDescription();
+            auto attributeDescriptions = desc.packedVertices ? PackedVertex::getAttributeDescriptions() : Vertex::getAttributeDescriptions();
 
             vertexInputInfo.vertexBindingDescriptionCount = 1; // One binding. Should do the same as attribute description when more
             vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
@@ -1226,7 +5041,7 @@ class HelloTriangleApplication {
             // VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP: 
             //      the second and third vertex of every triangle are used as first two vertices of 
             //      the next triangle
-            inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+            inputAssembly.topology = desc.topology;
 
             // If you set the primitiveRestartEnable member to VK_TRUE, then it's possible to break up 
             // lines and triangles in the _STRIP topology modes by using a special index of 0xFFFF or 0xFFFFFFFF.
@@ -1271,18 +5086,17 @@ class HelloTriangleApplication {
             */
             rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
             rasterizer.lineWidth = 1.0f; // Thicknes of lines in terms of fragmet shader
-            rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+            rasterizer.cullMode = desc.cullMode;
             rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
         
 
             rasterizer.depthBiasEnable = VK_FALSE;
-            // Multisampling for anitaliasing
-            // Requires a GPU feature
-            // Disabled for now
+            // Multisampling for anitaliasing, matching the samples of the render targets
+            // Sample shading would also smooth the texture, but requires a GPU feature
             VkPipelineMultisampleStateCreateInfo multisampling{};
             multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
             multisampling.sampleShadingEnable = VK_FALSE;
-            multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+            multisampling.rasterizationSamples = desc.samples;
             multisampling.minSampleShading = 1.0f; // Optional
             multisampling.pSampleMask = nullptr; // Optional
             multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
@@ -1298,6 +5112,12 @@ class HelloTriangleApplication {
             colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
             colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
             colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
+            if (desc.blend) {
+                // Classic alpha blending: color = srcAlpha * src + (1 - srcAlpha) * dst
+                colorBlendAttachment.blendEnable = VK_TRUE;
+                colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+                colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+            }
 
             // The structure references the array of structures for all of the framebuffers and allows 
             // you to set blend constants that you can use as blend factors in the aforementioned calculations.
@@ -1320,23 +5140,20 @@ class HelloTriangleApplication {
                 VK_DYNAMIC_STATE_SCISSOR
             };
 
+            // Keeps the closest fragment, the depth buffer is cleared to the far plane (1.0)
+            VkPipelineDepthStencilStateCreateInfo depthStencil{};
+            depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+            depthStencil.depthTestEnable = desc.depthFormat != VK_FORMAT_UNDEFINED;
+            depthStencil.depthWriteEnable = desc.depthFormat != VK_FORMAT_UNDEFINED && !desc.blend; // Blended geometry is sorted instead
+            depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+            depthStencil.depthBoundsTestEnable = VK_FALSE;
+            depthStencil.stencilTestEnable = VK_FALSE;
+
             VkPipelineDynamicStateCreateInfo dynamicState{};
             dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
             dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
             dynamicState.pDynamicStates = dynamicStates.data();
 
-            // Empty pipeline layout for future use
-            VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-            pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-            pipelineLayoutInfo.setLayoutCount = 1; 
-            pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
-            pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-            pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
-
-            if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
-                throw std::runtime_error("failed to create pipeline layout!");
-            }
-
             VkGraphicsPipelineCreateInfo pipelineInfo{};
             pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
             // Referencing the structs of shader stages
@@ -1348,7 +5165,7 @@ class HelloTriangleApplication {
             pipelineInfo.pViewportState = &viewportState;
             pipelineInfo.pRasterizationState = &rasterizer;
             pipelineInfo.pMultisampleState = &multisampling;
-            pipelineInfo.pDepthStencilState = nullptr; // Optional
+            pipelineInfo.pDepthStencilState = &depthStencil;
             pipelineInfo.pColorBlendState = &colorBlending;
             pipelineInfo.pDynamicState = &dynamicState;
             // Referencing the pipeline layout
@@ -1357,53 +5174,190 @@ class HelloTriangleApplication {
             pipelineInfo.renderPass = renderPass;
             pipelineInfo.subpass = 0; // Index of subpass where where this graphics pipeline is used
 
+            // Without a render pass the pipeline is told the attachment formats directly
+            VkPipelineRenderingCreateInfo renderingInfo{};
+            renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+            renderingInfo.colorAttachmentCount = 1;
+            renderingInfo.pColorAttachmentFormats = &desc.colorFormat;
+            renderingInfo.depthAttachmentFormat = desc.depthFormat;
+            if (dynamicRendering) {
+                pipelineInfo.pNext = &renderingInfo;
+                pipelineInfo.renderPass = VK_NULL_HANDLE;
+            }
+
             // Used where deriving pipelines
             // VK_PIPELINE_CREATE_DERIVATIVE_BIT flag is also specified in the flags field of VkGraphicsPipelineCreateInfo
             // Right now only one pipeline is used so they are not needed
             pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
             pipelineInfo.basePipelineIndex = -1; // Optional
 
-            if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS) {
+            VkPipeline pipeline;
+            if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
                 throw std::runtime_error("failed to create graphics pipeline!");
             }
+            return pipeline;
+        }
 
-            // Cleaning up the shader modules after creation of pipeline
+        // Starts watching the graphics shaders, see AppConfig::shaderHotReload
+        void startShaderHotReload() {
+            if (!config.shaderHotReload || config.headless) return;
+
+            std::vector<std::string> paths;
+            for (const ShaderStageFiles& files : graphicsShaderFiles()) {
+                paths.push_back(watchedShaderFile(files));
+            }
+            shaderWatcher.start(paths, [this]() { reloadGraphicsPipelines(); });
+        }
+
+        /**
+         * Runs on the watcher thread: compiles the changed shaders and rebuilds every registered pipeline using them
+         * 
+         * A shader that doesn't compile keeps the current pipelines, the errors are printed so the shader can
+         * be fixed while the program runs.
+         */
+        void reloadGraphicsPipelines() {
+            auto shaderFiles = graphicsShaderFiles();
+            VkShaderModule vertShaderModule = VK_NULL_HANDLE;
+            VkShaderModule fragShaderModule = VK_NULL_HANDLE;
+            std::vector<std::pair<PipelineDesc, VkPipeline>> rebuilt;
+            try {
+                std::vector<uint32_t> vertShaderCode = loadShaderStage(shaderFiles[0]);
+                std::vector<uint32_t> fragShaderCode = loadShaderStage(shaderFiles[1]);
+                vertShaderModule = createShaderModule(vertShaderCode.data(), vertShaderCode.size() * sizeof(uint32_t));
+                fragShaderModule = createShaderModule(fragShaderCode.data(), fragShaderCode.size() * sizeof(uint32_t));
+                for (const PipelineDesc& desc : pipelines.descriptions()) {
+                    if (desc.vertexShader != shaderFiles[0].binary || desc.fragmentShader != shaderFiles[1].binary) continue;
+                    rebuilt.emplace_back(desc, buildGraphicsPipeline(desc, vertShaderModule, fragShaderModule));
+                }
+                std::cout << "reloaded " << rebuilt.size() << " graphics pipelines" << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                for (auto& [desc, pipeline] : rebuilt) {
+                    vkDestroyPipeline(device, pipeline, nullptr);
+                }
+                rebuilt.clear();
+            }
             vkDestroyShaderModule(device, fragShaderModule, nullptr);
             vkDestroyShaderModule(device, vertShaderModule, nullptr);
+            if (rebuilt.empty()) return;
+
+            // A second edit before the next frame replaces the first pipelines, which were never used
+            std::lock_guard<std::mutex> lock(reloadMutex);
+            for (auto& [desc, pipeline] : reloadedPipelines) {
+                vkDestroyPipeline(device, pipeline, nullptr);
+            }
+            reloadedPipelines = std::move(rebuilt);
         }
 
-        // Helper function for reading the shader byte code
-        static std::vector<char> readFile(const std::string& filename) {
-            // ate: Start reading at the end of the file
-            // binary: Read the file as binary file (avoid text transformations)
-            std::ifstream file(filename, std::ios::ate | std::ios::binary);
+        // Called at the start of a frame, the frames in flight finish with the old pipelines
+        void swapReloadedPipeline() {
+            std::lock_guard<std::mutex> lock(reloadMutex);
+            if (reloadedPipelines.empty()) return;
+            for (auto& [desc, pipeline] : reloadedPipelines) {
+                std::shared_future<VkPipeline> previous = pipelines.replace(desc, pipeline);
+                if (previous.valid()) {
+                    deferDestroyPipeline(previous);
+                }
+            }
+            reloadedPipelines.clear();
+            graphicsPipeline = pipelines.get(graphicsPipelineDesc);
+        }
+
+        /**
+         * Creates the pipeline cache, seeded with the data saved by the last run if it is usable
+         * 
+         * The driver only accepts cache data it wrote itself, so the header is checked against the device first.
+         * A missing, truncated or foreign file just gives an empty cache and the pipelines are compiled again.
+         */
+        void createPipelineCache() {
+            // The driver reads the cache data straight from the mapped file
+            FileView cacheData;
+            if (!cacheData.open(PIPELINE_CACHE_FILE) || !isPipelineCacheCompatible(cacheData)) {
+                cacheData = FileView();
+            }
+
+            VkPipelineCacheCreateInfo cacheInfo{};
+            cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+            cacheInfo.initialDataSize = cacheData.size();
+            cacheInfo.pInitialData = cacheData.data();
+
+            if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+                // The driver may still reject the data, starting from an empty cache
+                cacheInfo.initialDataSize = 0;
+                cacheInfo.pInitialData = nullptr;
+                if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to create pipeline cache!");
+                }
+            }
+        }
+
+        // Checks if the cache data was written by the same driver and GPU
+        bool isPipelineCacheCompatible(const FileView& cacheData) {
+            VkPipelineCacheHeaderVersionOne header;
+            if (cacheData.size() < sizeof(header)) {
+                return false;
+            }
+            memcpy(&header, cacheData.data(), sizeof(header)); // The data has no alignment guarantees
+
+            return header.headerSize >= sizeof(header) 
+                && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+                && header.vendorID == deviceProperties.vendorID
+                && header.deviceID == deviceProperties.deviceID
+                // The UUID changes with the driver version
+                && memcmp(header.pipelineCacheUUID, deviceProperties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+        }
+
+        // Writes the pipeline cache to disk
+        // Written to a temporary file first so a crash doesn't leave a half written cache behind
+        void savePipelineCache() {
+            size_t dataSize = 0;
+            if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0) {
+                return;
+            }
+            std::vector<char> cacheData(dataSize);
+            if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, cacheData.data()) != VK_SUCCESS) {
+                return;
+            }
 
+            std::string tempFile = std::string(PIPELINE_CACHE_FILE) + ".tmp";
+            std::ofstream file(tempFile, std::ios::binary | std::ios::trunc);
             if (!file.is_open()) {
-                throw std::runtime_error("failed to open file!");
+                std::cerr << "failed to write pipeline cache!" << std::endl;
+                return;
             }
-            // Using read position to find the file size as we are reading from the end
-            size_t fileSize = (size_t) file.tellg(); 
-            std::vector<char> buffer(fileSize);
+            file.write(cacheData.data(), dataSize);
+            file.close();
 
-            file.seekg(0); // Seeking the beginning of the file
-            file.read(buffer.data(), fileSize); // Reading the bytes to buffer
+            if (!file || std::rename(tempFile.c_str(), PIPELINE_CACHE_FILE) != 0) {
+                std::cerr << "failed to write pipeline cache!" << std::endl;
+                std::remove(tempFile.c_str());
+            }
+        }
 
-            file.close();   // Close the file
+        // Helper function for reading the shader byte code
+        // Maps the file, throws if it can't be opened
+        static FileView readFile(const std::string& filename) {
+            FileView file;
+            if (!file.open(filename)) {
+                throw std::runtime_error("failed to open file " + filename + "!");
+            }
+            return file;  // Return the mapped contents of the file
+        }
 
-            return buffer;  // Return the contents of the file
+        VkShaderModule createShaderModule(const FileView& code) {
+            return createShaderModule(reinterpret_cast<const uint32_t*>(code.data()), code.size());
         }
 
         /// For wrapping the shader code in a VkShaderModule object
-        /// @param code pointer to the buffer with the bytecode and the length of it
-        VkShaderModule createShaderModule(const std::vector<char>& code) {
+        /// @param code pointer to the buffer with the bytecode and the length of it in bytes
+        VkShaderModule createShaderModule(const uint32_t* code, size_t codeSize) {
 
             VkShaderModuleCreateInfo createInfo{};
             createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO; // Type of create info
-            createInfo.codeSize = code.size(); // Bytecode size in bytes
+            createInfo.codeSize = codeSize; // Bytecode size in bytes
 
-            // The create info accepts bytecode pointer in uint32_5 instead of char pointer we are providing
-            // Hence recasting the pointer into uint32_t
-            createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+            // The create info accepts bytecode pointer in uint32_t, file mappings are page aligned
+            createInfo.pCode = code;
 
             VkShaderModule shaderModule;    // For storing the shader module created
             if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
@@ -1413,20 +5367,27 @@ class HelloTriangleApplication {
             return shaderModule;
         }
 
+        // Dynamic rendering binds the image views directly, without framebuffers
         void createFramebuffers() {
+            if (dynamicRendering) return;
+
             // Resizing the framebuffer to hold all the image views
             swapChainFramebuffers.resize(swapChainImageViews.size());
 
             // Iterating through the image views and creating framebuffers for them
+            // The render targets are shared by all the framebuffers, only the swap chain image differs
+            bool multisampled = colorTarget.image != VK_NULL_HANDLE;
             for (size_t i = 0; i < swapChainImageViews.size(); i++) {
                 VkImageView attachments[] = {
-                    swapChainImageViews[i]
+                    multisampled ? colorTarget.view : swapChainImageViews[i],
+                    depthTarget.view,
+                    swapChainImageViews[i]  // Resolve target
                 };
 
                 VkFramebufferCreateInfo framebufferInfo{};
                 framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
                 framebufferInfo.renderPass = renderPass; // Renderpass to be compatible with
-                framebufferInfo.attachmentCount = 1;    // No. of attachment same as render pass
+                framebufferInfo.attachmentCount = multisampled ? 3 : 2;    // No. of attachment same as render pass
                 framebufferInfo.pAttachments = attachments; // Type of attachment same as render pass
                 framebufferInfo.width = swapChainExtent.width;
                 framebufferInfo.height = swapChainExtent.height;
@@ -1458,6 +5419,14 @@ class HelloTriangleApplication {
             if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
                 throw std::runtime_error("failed to create command pool!");
             }
+
+            // Upload command buffers are short lived and reset individually when their batch is reused
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+            poolInfo.queueFamilyIndex = queueFamilyIndices.transferFamily.value();
+
+            if (vkCreateCommandPool(device, &poolInfo, nullptr, &transferCommandPool) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create command pool!");
+            }
         }
 
         /**
@@ -1467,16 +5436,25 @@ class HelloTriangleApplication {
          * @param usage Flags defining what the buffer is used for
          * @param properties The required properties of the memory for the application to run
          * @param buffer Pointer to the buffer object
-         * @param bufferMemory Pointer to the buffer memory
+         * @param bufferAllocation The region of device memory the buffer is bound to
+         * @param queueFamilies Queue families using the buffer at the same time, with more than one it is concurrent
          */
         void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, 
-                VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+                VkBuffer& buffer, MemoryAllocation& bufferAllocation, std::vector<uint32_t> queueFamilies = {}) {
             VkBufferCreateInfo bufferInfo{};
             bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
             bufferInfo.size = size;
 
             bufferInfo.usage = usage; // Multiple usage can be defined using bitwise OR
             bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; // If it can be shared between queue families
+            // A concurrent buffer needs no ownership transfers, the families have to be unique
+            std::sort(queueFamilies.begin(), queueFamilies.end());
+            queueFamilies.erase(std::unique(queueFamilies.begin(), queueFamilies.end()), queueFamilies.end());
+            if (queueFamilies.size() > 1) {
+                bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+                bufferInfo.queueFamilyIndexCount = static_cast<uint32_t>(queueFamilies.size());
+                bufferInfo.pQueueFamilyIndices = queueFamilies.data();
+            }
             // The flags parameter is used to configure sparse buffer memory, which is not relevant right now. 
             // We'll leave it at the default value of 0
             if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
@@ -1487,84 +5465,195 @@ class HelloTriangleApplication {
             VkMemoryRequirements memRequirements;
             vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-            VkMemoryAllocateInfo allocInfo{};
-            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-            allocInfo.allocationSize = memRequirements.size;
-            allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties); 
+            // Not calling vkAllocateMemory for every individual buffer
+            // The allocator splits a few big allocations among all the buffers using offsets
+            bufferAllocation = memoryAllocator.allocate(memRequirements, 
+                findMemoryType(memRequirements.memoryTypeBits, properties), true);
 
-            // It should be noted that in a real world application, you're not supposed to actually 
-            // call "vkAllocateMemory" for every individual buffer
-            // 
-            // The right way to allocate memory for a large number of objects at the same time is to create 
-            // a custom allocator that splits up a single allocation among many different objects by using the 
-            // offset parameters that we've seen in many functions.
-            // You can either implement such an allocator yourself, or use the VulkanMemoryAllocator library 
-            // provided by the GPUOpen initiative
-            if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
-                throw std::runtime_error("failed to allocate vertex buffer memory!");
+            // Binding the memory region to the buffer
+            vkBindBufferMemory(device, buffer, bufferAllocation.memory, bufferAllocation.offset);
+        }
+
+        /**
+         * Starts reading and decoding the texture on the asset loader threads
+         * 
+         * The compressed COMPRESSED_TEXTURE_FILE is preferred when it exists, it needs no decoding and has its
+         * mip levels already. Called first thing in initVulkan() so the decode overlaps the device setup.
+         */
+        void requestTexture() {
+            if (std::filesystem::exists(COMPRESSED_TEXTURE_FILE)) {
+                textureLoad = assetLoader.load<TextureData>(COMPRESSED_TEXTURE_FILE, parseKtx2);
+            } else {
+                textureLoad = assetLoader.load<TextureData>(TEXTURE_FILE, decodeImage);
             }
-            // Binding the memory to the buffer
-            vkBindBufferMemory(device, buffer, bufferMemory, 0);
         }
 
         void createTextureImage() {
-            int texWidth, texHeight, texChannels;
-            // STBI_rgb_alpha forces to load alpha channel even if there are none
-            // texChannels stores the actual number of channels in the image
-            stbi_uc* pixels = stbi_load("textures/texture.jpg", &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-            // The pixels are stored row by row 4 bytes per pixel, 1 byte per channel(rgba)
-            VkDeviceSize imageSize = texWidth * texHeight * 4;
+            TextureData texture = textureLoad.get(); // Rethrows a reading or decoding error
+
+            // Compressed formats are only sampleable if their texture compression feature is supported
+            VkFormatProperties formatProperties;
+            vkGetPhysicalDeviceFormatProperties(physicalDevice, texture.format, &formatProperties);
+            if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+                std::cerr << COMPRESSED_TEXTURE_FILE << " has a format the device can't sample, using " << TEXTURE_FILE << std::endl;
+                texture = assetLoader.load<TextureData>(TEXTURE_FILE, decodeImage).get();
+                vkGetPhysicalDeviceFormatProperties(physicalDevice, texture.format, &formatProperties);
+            }
+
+            textureFormat = texture.format;
+            textureMipLevels = static_cast<uint32_t>(texture.levels.size());
+            if (texture.generateMipmaps) {
+                // Every level halves the size until it is 1x1
+                textureMipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texture.width, texture.height)))) + 1;
+                // The levels are blitted with linear filtering, without support the texture keeps the stored levels
+                VkFormatFeatureFlags blitFeatures = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | 
+                    VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+                if ((formatProperties.optimalTilingFeatures & blitFeatures) != blitFeatures) {
+                    textureMipLevels = static_cast<uint32_t>(texture.levels.size());
+                }
+            }
 
-            if (!pixels) {
-                throw std::runtime_error("failed to load texture image!");
+            createImage(texture.width, texture.height, textureMipLevels, textureFormat, VK_IMAGE_TILING_OPTIMAL, 
+                // We also want to be able to access the image from the shader to color our mesh, so the usage 
+                // should include VK_IMAGE_USAGE_SAMPLED_BIT.
+                // The mip levels are blitted from the level above, so it is also a transfer source
+                VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageAllocation);
+
+            transitionImageLayout(textureImage, textureFormat, VK_IMAGE_LAYOUT_UNDEFINED, 
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, textureMipLevels); // Transfer the image texture to optimal layout for destination
+
+            // Staging right before the copies so the region belongs to the copies' submission
+            // All stored levels share one staging region, each level starting at a multiple of the texel or block size
+            VkDeviceSize alignment = std::max<VkDeviceSize>(16, deviceProperties.limits.optimalBufferCopyOffsetAlignment);
+            VkDeviceSize stagingSize = 0;
+            for (const auto& level : texture.levels) {
+                stagingSize = (stagingSize + alignment - 1) / alignment * alignment + level.second;
+            }
+            StagingRegion staging = allocateStaging(stagingSize, alignment);
+
+            VkDeviceSize offset = 0;
+            for (uint32_t i = 0; i < texture.levels.size(); i++) {
+                offset = (offset + alignment - 1) / alignment * alignment;
+                memcpy(static_cast<char*>(staging.data) + offset, texture.bytes() + texture.levels[i].first, texture.levels[i].second);
+                // The extent of a level is the real size, even if it isn't a multiple of the block size
+                copyBufferToImage(staging.buffer, textureImage, std::max(1u, texture.width >> i), std::max(1u, texture.height >> i), 
+                    staging.offset + offset, i);
+                offset += texture.levels[i].second;
             }
 
-            VkBuffer stagingBuffer;
-            VkDeviceMemory stagingBufferMemory;
+            if (textureMipLevels > texture.levels.size()) {
+                generateMipmaps(textureImage, texture.width, texture.height, textureMipLevels); // Also transitions for shader access
+            } else {
+                transitionImageLayout(textureImage, textureFormat, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
+                    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, textureMipLevels); // Transistion layout for shader access
+            }
+            // The decoded pixels are freed when texture goes out of scope, they are in the staging ring now
+        }
 
-            createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, // Used as transfer source
-                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, // Visible for cpu
-                stagingBuffer, stagingBufferMemory);
-            
-            void* data;
-            vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-                memcpy(data, pixels, static_cast<size_t>(imageSize));
-            vkUnmapMemory(device, stagingBufferMemory);
+        /**
+         * Fills the mip levels below the first one by blitting every level from the one above it
+         * 
+         * Expects every level in TRANSFER_DST_OPTIMAL with level 0 uploaded, and leaves them all in
+         * SHADER_READ_ONLY_OPTIMAL. Blits need a graphics queue, so with a separate transfer family the image
+         * is handed to the graphics queue first and the blits are recorded there.
+         */
+        void generateMipmaps(VkImage image, int32_t width, int32_t height, uint32_t mipLevels) {
+            if (separateTransferQueue()) {
+                VkImageMemoryBarrier barrier{};
+                barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+                barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                barrier.dstAccessMask = 0;
+                barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+                barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+                barrier.srcQueueFamilyIndex = transferQueueFamily;
+                barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+                barrier.image = image;
+                barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1};
+                uploadRecorder.imageBarrier(UploadRecorder::AFTER_COPIES, barrier, 
+                    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
 
-            stbi_image_free(pixels); // Cleaning up the variable since the data is loaded to the staging buffer memory
+                barrier.srcAccessMask = 0;
+                barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+                uploadRecorder.imageBarrier(UploadRecorder::ACQUIRE, barrier, 
+                    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+            }
 
-            createImage(texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, 
-                // We also want to be able to access the image from the shader to color our mesh, so the usage 
-                // should include VK_IMAGE_USAGE_SAMPLED_BIT.
-                VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
-                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
-            
+            uploadRecorder.graphicsCommands([this, image, width, height, mipLevels](VkCommandBuffer commandBuffer) {
+                recordMipmaps(commandBuffer, image, width, height, mipLevels);
+            });
+        }
 
-            transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, 
-                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL); // Transfer the image texture to optimal layout for destination
-            // Copy the image from staging buffer to image object
-            copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
+        // Records the blits of generateMipmaps(), on a graphics queue command buffer
+        void recordMipmaps(VkCommandBuffer commandBuffer, VkImage image, int32_t width, int32_t height, uint32_t mipLevels) {
+            VkImageMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.image = image;
+            barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}; // One level at a time
+
+            int32_t mipWidth = width;
+            int32_t mipHeight = height;
+            for (uint32_t i = 1; i < mipLevels; i++) {
+                // The level above has been written (copied or blitted), it becomes the blit source
+                barrier.subresourceRange.baseMipLevel = i - 1;
+                barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+                barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+                barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+                vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                    0, nullptr, 0, nullptr, 1, &barrier);
+
+                // Halving the size, a level never goes below 1 pixel
+                VkImageBlit blit{};
+                blit.srcOffsets[0] = {0, 0, 0};
+                blit.srcOffsets[1] = {mipWidth, mipHeight, 1};
+                blit.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, i - 1, 0, 1};
+                blit.dstOffsets[0] = {0, 0, 0};
+                blit.dstOffsets[1] = {std::max(1, mipWidth / 2), std::max(1, mipHeight / 2), 1};
+                blit.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, i, 0, 1};
+                vkCmdBlitImage(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 
+                    image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+
+                // The source level is done and can be sampled
+                barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+                barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+                barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+                vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                    0, nullptr, 0, nullptr, 1, &barrier);
 
-            transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
-                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL); // Transistion layout for shader access
+                mipWidth = std::max(1, mipWidth / 2);
+                mipHeight = std::max(1, mipHeight / 2);
+            }
 
-            vkDestroyBuffer(device, stagingBuffer, nullptr);
-            vkFreeMemory(device, stagingBufferMemory, nullptr);
+            // The last level is only written, never blitted from
+            barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                0, nullptr, 0, nullptr, 1, &barrier);
         }
 
         /** 
          * For creating image objet and allocating memory for it
          * @param width witdth of the image
          * @param height height of the image
+         * @param mipLevels number of mip levels, the first one is width x height
          * @param format format of the image
          * @param tiling how the texels are laid out in vulkan memory
          * @param usage how the image object will be used
          * @param properties properties of the memory where image will be stored
          * @param image reference to the vulkan image object
-         * @param imageMemory reference to the vulkan image object memory
+         * @param imageAllocation reference to the region of device memory the image is bound to
+         * @param numSamples samples per pixel, more than one for multisampled render targets
         */ 
-        void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, 
-            VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
+        void createImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkFormat format, VkImageTiling tiling, 
+            VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, MemoryAllocation& imageAllocation,
+            VkSampleCountFlagBits numSamples = VK_SAMPLE_COUNT_1_BIT) {
         // Creating 
             VkImageCreateInfo imageInfo{};
             imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -1572,7 +5661,7 @@ class HelloTriangleApplication {
             imageInfo.extent.width = width;
             imageInfo.extent.height = height;
             imageInfo.extent.depth = 1; // Not 3D image (voxel)
-            imageInfo.mipLevels = 1; // No multisampling
+            imageInfo.mipLevels = mipLevels;
             imageInfo.arrayLayers = 1; // Not an array
             imageInfo.format = format;
 
@@ -1593,7 +5682,7 @@ class HelloTriangleApplication {
             imageInfo.usage = usage;
             // Image is only accessed by queue family that supports graphics
             imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; 
-            imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;  // For multisampling
+            imageInfo.samples = numSamples;  // For multisampling
             imageInfo.flags = 0; // Optional
 
             if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS) {
@@ -1604,31 +5693,32 @@ class HelloTriangleApplication {
             VkMemoryRequirements memRequirements;
             vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-            VkMemoryAllocateInfo allocInfo{};
-            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-            allocInfo.allocationSize = memRequirements.size;
-            allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-            if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-                throw std::runtime_error("failed to allocate image memory!");
+            // Lazily allocated memory is a preference, desktop GPUs don't have it
+            if ((properties & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) && !hasMemoryType(memRequirements.memoryTypeBits, properties)) {
+                properties &= ~VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
             }
 
-            vkBindImageMemory(device, image, imageMemory, 0);
+            // Optimal images are kept in different blocks from buffers
+            imageAllocation = memoryAllocator.allocate(memRequirements, 
+                findMemoryType(memRequirements.memoryTypeBits, properties), tiling == VK_IMAGE_TILING_LINEAR);
+
+            vkBindImageMemory(device, image, imageAllocation.memory, imageAllocation.offset);
         }
 
         void createTextureImageView() {
-            textureImageView = createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB);
+            textureImageView = createImageView(textureImage, textureFormat, textureMipLevels);
+            textureViews.push_back(textureImageView);
         }
 
-        VkImageView createImageView(VkImage image, VkFormat format) {
+        VkImageView createImageView(VkImage image, VkFormat format, uint32_t mipLevels = 1, VkImageAspectFlags aspectFlags = VK_IMAGE_ASPECT_COLOR_BIT) {
             VkImageViewCreateInfo viewInfo{};
             viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
             viewInfo.image = image;
             viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
             viewInfo.format = format;
-            viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            viewInfo.subresourceRange.aspectMask = aspectFlags;
             viewInfo.subresourceRange.baseMipLevel = 0;
-            viewInfo.subresourceRange.levelCount = 1;
+            viewInfo.subresourceRange.levelCount = mipLevels;
             viewInfo.subresourceRange.baseArrayLayer = 0;
             viewInfo.subresourceRange.layerCount = 1;
 
@@ -1658,12 +5748,10 @@ class HelloTriangleApplication {
             samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
             samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
             samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-            samplerInfo.anisotropyEnable = VK_TRUE;
+            samplerInfo.anisotropyEnable = deviceCapabilities.samplerAnisotropy;
             // The maxAnisotropy field limits the amount of texel samples that can be used to calculate the 
             // final color. A lower value results in better performance, but lower quality results.
-            VkPhysicalDeviceProperties properties{};
-            vkGetPhysicalDeviceProperties(physicalDevice, &properties);
-            samplerInfo.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
+            samplerInfo.maxAnisotropy = deviceCapabilities.samplerAnisotropy ? deviceProperties.limits.maxSamplerAnisotropy : 1.0f;
 
             samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
             // The unnormalizedCoordinates field specifies which coordinate system you want to use to address 
@@ -1672,109 +5760,608 @@ class HelloTriangleApplication {
             // using the [0, 1) range on all axes.
             samplerInfo.unnormalizedCoordinates = VK_FALSE;
 
-            samplerInfo.compareEnable = VK_FALSE;
-            samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+            samplerInfo.compareEnable = VK_FALSE;
+            samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+
+            samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+            samplerInfo.mipLodBias = 0.0f;
+            samplerInfo.minLod = 0.0f;
+            samplerInfo.maxLod = static_cast<float>(textureMipLevels); // Every mip level can be used
+
+            if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create texture sampler!");
+            }
+        }
+
+
+        // Starts loading the model file on the asset loader threads, if there is one
+        void requestMesh() {
+            std::string path = config.modelFile;
+            if (path.empty() && std::filesystem::exists(MODEL_FILE)) {
+                path = MODEL_FILE;
+            }
+            if (!path.empty()) {
+                meshLoad = assetLoader.load<MeshData>(path, loadMesh);
+            }
+            packedVertices = config.packedVertices.value_or(path.empty());
+        }
+
+        void loadMeshData() {
+            mesh = meshLoad.valid() ? meshLoad.get() : buildMesh(quadVertices, quadIndices);
+            indexType = mesh.indexType;
+        }
+
+        // Allocates memory for buffer used for vertex data
+        void createVertexBuffer() {
+            VkDeviceSize vertexSize = packedVertices ? sizeof(PackedVertex) : sizeof(Vertex);
+            VkDeviceSize bufferSize = vertexSize * mesh.vertexCount;
+            // A piece of the staging ring visible to the CPU for copying the vertex data to the GPU's buffer
+            StagingRegion staging = allocateStaging(bufferSize, 16);
+            if (packedVertices) {
+                // Packed straight into the ring, there is no packed copy of the mesh
+                PackedVertex* packed = static_cast<PackedVertex*>(staging.data);
+                for (uint32_t i = 0; i < mesh.vertexCount; i++) {
+                    packed[i] = PackedVertex::pack(mesh.vertices[i]);
+                }
+            } else {
+                // Copy the vertex data to the ring, which is always mapped
+                // A .mesh file is copied straight from the mapped file
+                memcpy(staging.data, mesh.vertices, (size_t) bufferSize);
+            }
+
+            // Creating the vertex buffer in the GPU that is not accessible by CPU
+            createBuffer(bufferSize, 
+                // The buffer is used as destination for memory transfer operation and for storing vertex data
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,  
+                vertexBuffer, vertexBufferAllocation);
+            
+            copyBuffer(staging.buffer, vertexBuffer, bufferSize, staging.offset);
+            // Hands the buffer over to the graphics queue for vertex input
+            releaseBufferToGraphics(vertexBuffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+        }
+        // For creating a temporary staging buffer to map the indices data onto
+        // Then creating the actual index buffer and copying the data from the staging buffer
+        // This allows the actual index to be GPU exclusive for better performance
+        void createIndexBuffer() {
+            VkDeviceSize bufferSize = static_cast<VkDeviceSize>(mesh.indexSize()) * mesh.indexCount;
+            // A piece of the staging ring accesible by CPU to copy the data from the indices array
+            StagingRegion staging = allocateStaging(bufferSize, 16);
+
+            // Copying the indices data to the staging ring to then copy to GPU exclusive buffer
+            memcpy(staging.data, mesh.indices, (size_t) bufferSize);
+
+            // Creating the actual buffer exclusive to the GPU
+            createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, 
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferAllocation);
+            // Copying the data from the staging ring to the actual buffer
+            copyBuffer(staging.buffer, indexBuffer, bufferSize, staging.offset);
+            releaseBufferToGraphics(indexBuffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_INDEX_READ_BIT);
+        }
+
+        // Uploads the instance transforms and texture indices to a storage buffer read by the vertex shader
+        void createInstanceBuffer() {
+            VkDeviceSize bufferSize = sizeof(InstanceData) * instanceTransforms.size();
+            instanceSlotSize = bufferSize;
+            if (config.animateInstances) {
+                createAnimatedInstanceBuffer();
+                return;
+            }
+            StagingRegion staging = allocateStaging(bufferSize, 16);
+            // Written straight into the ring
+            InstanceData* instances = static_cast<InstanceData*>(staging.data);
+            for (size_t i = 0; i < instanceTransforms.size(); i++) {
+                instances[i] = {instanceTransforms[i], instanceTextures[i], {}};
+            }
+            createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, instanceBuffer, instanceBufferAllocation);
+            copyBuffer(staging.buffer, instanceBuffer, bufferSize, staging.offset);
+            releaseBufferToGraphics(instanceBuffer, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+        }
+
+        /**
+         * Creates the instance buffer animated instances are written to, one slot per frame in flight
+         * 
+         * The buffer is host visible and stays mapped, the transform system writes the matrices straight into
+         * the frame's slot. Device local host visible memory (resizable BAR, integrated GPUs) is preferred so 
+         * the vertex shader reads it at full speed.
+         */
+        void createAnimatedInstanceBuffer() {
+            // Dynamic offsets have to be multiples of minStorageBufferOffsetAlignment, a power of two
+            VkDeviceSize alignment = deviceProperties.limits.minStorageBufferOffsetAlignment;
+            instanceSlotSize = (sizeof(InstanceData) * instanceTransforms.size() + alignment - 1) & ~(alignment - 1);
+            VkDeviceSize bufferSize = instanceSlotSize * config.framesInFlight;
+
+            VkMemoryPropertyFlags hostVisible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+            VkMemoryPropertyFlags properties = hostVisible | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+            try {
+                createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, properties, instanceBuffer, instanceBufferAllocation);
+            } catch (const std::runtime_error&) {
+                createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostVisible, instanceBuffer, instanceBufferAllocation);
+            }
+
+            // The texture indices never change, only the matrices are rewritten
+            for (uint32_t frame = 0; frame < config.framesInFlight; frame++) {
+                InstanceData* instances = instanceSlot(frame);
+                for (size_t i = 0; i < instanceTransforms.size(); i++) {
+                    instances[i] = {instanceTransforms[i], instanceTextures[i], {}};
+                }
+            }
+        }
+
+        InstanceData* instanceSlot(uint32_t frame) {
+            return reinterpret_cast<InstanceData*>(static_cast<char*>(instanceBufferAllocation.mapped) + instanceSlotSize * frame);
+        }
+
+        // Dynamic offset of the instances drawn by a frame
+        uint32_t instanceOffset(uint32_t frame) const {
+            return config.animateInstances ? static_cast<uint32_t>(instanceSlotSize * frame) : 0;
+        }
+
+        /**
+         * Computes the animated instance matrices of the frame into its slot of the instance buffer
+         * 
+         * Large scenes are split over the recording threads, which are idle until the frame is recorded.
+         * The ranges start at multiples of 4, the transform system's batch size.
+         */
+        void updateInstanceTransforms(uint32_t frame, float time) {
+            if (!config.animateInstances) return;
+
+            InstanceData* instances = instanceSlot(frame);
+            size_t count = instanceTransformSystem.size();
+            const size_t minimumPerThread = 4096; // Below this the hand over costs more than it saves
+            uint32_t threads = static_cast<uint32_t>(std::clamp<size_t>(count / minimumPerThread, 1, recordingThreads.threadCount()));
+            if (threads == 1) {
+                instanceTransformSystem.update(time, 0, count, instances);
+                return;
+            }
+            size_t perThread = ((count + threads - 1) / threads + 3) & ~size_t(3);
+            recordingThreads.run(threads, [&](uint32_t thread) {
+                size_t first = std::min(count, thread * perThread);
+                instanceTransformSystem.update(time, first, std::min(count, first + perThread), instances);
+            });
+        }
+
+        /**
+         * Uploads the draw list as indirect draw commands, along with the number of draws
+         * 
+         * All draws share the vertex and index buffers, so a draw is fully described by its index 
+         * and instance ranges.
+         */
+        void createIndirectBuffers() {
+            std::vector<VkDrawIndexedIndirectCommand> commands(drawList.size());
+            for (size_t i = 0; i < drawList.size(); i++) {
+                commands[i].indexCount = drawList[i].indexCount;
+                commands[i].instanceCount = drawList[i].instanceCount;
+                commands[i].firstIndex = drawList[i].firstIndex;
+                commands[i].vertexOffset = drawList[i].vertexOffset;
+                commands[i].firstInstance = drawList[i].firstInstance;
+            }
+            uint32_t drawCount = static_cast<uint32_t>(commands.size());
+
+            VkDeviceSize bufferSize = sizeof(commands[0]) * commands.size();
+            StagingRegion staging = allocateStaging(bufferSize, 16);
+            memcpy(staging.data, commands.data(), (size_t) bufferSize);
+            createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, 
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indirectBuffer, indirectBufferAllocation);
+            copyBuffer(staging.buffer, indirectBuffer, bufferSize, staging.offset);
+            releaseBufferToGraphics(indirectBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+
+            staging = allocateStaging(sizeof(drawCount), 16);
+            memcpy(staging.data, &drawCount, sizeof(drawCount));
+            createBuffer(sizeof(drawCount), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, 
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, drawCountBuffer, drawCountBufferAllocation);
+            copyBuffer(staging.buffer, drawCountBuffer, sizeof(drawCount), staging.offset);
+            releaseBufferToGraphics(drawCountBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+        }
+
+        /**
+         * Sets up the compute pass that frustum culls the draw list every frame
+         * 
+         * The objects are uploaded once. Each frame in flight gets its own output command and count buffers, 
+         * as the previous frame may still be drawing from its copy.
+         * Occlusion culling would need a depth pyramid, which the transient depth buffer is never stored for.
+         */
+        void createCullingResources() {
+            gpuCulling = config.gpuCulling && config.indirectDraw && deviceCapabilities.drawIndirectCount;
+            if (!gpuCulling) return;
+            // Only worth it with a queue the culling can overlap with
+            asyncCulling = config.asyncCompute("cull") && separateComputeQueue();
+
+            std::vector<CullObject> objects(drawList.size());
+            for (size_t i = 0; i < drawList.size(); i++) {
+                objects[i].boundingSphere = drawList[i].boundingSphere;
+                objects[i].indexCount = drawList[i].indexCount;
+                objects[i].firstIndex = drawList[i].firstIndex;
+                objects[i].vertexOffset = drawList[i].vertexOffset;
+                objects[i].firstInstance = drawList[i].firstInstance;
+                objects[i].instanceCount = drawList[i].instanceCount;
+            }
+
+            VkDeviceSize bufferSize = sizeof(objects[0]) * objects.size();
+            StagingRegion staging = allocateStaging(bufferSize, 16);
+            memcpy(staging.data, objects.data(), (size_t) bufferSize);
+            createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, cullObjectBuffer, cullObjectBufferAllocation, asyncComputeFamilies());
+            copyBuffer(staging.buffer, cullObjectBuffer, bufferSize, staging.offset);
+            // The compute queue waits for the upload on the GPU timeline instead, which makes the copy visible
+            if (!asyncCulling) {
+                releaseBufferToGraphics(cullObjectBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+            }
+
+            // Written by the compute shader, read as indirect commands
+            culledCommandBuffers.resize(config.framesInFlight);
+            culledCommandBuffersAllocation.resize(config.framesInFlight);
+            culledCountBuffers.resize(config.framesInFlight);
+            culledCountBuffersAllocation.resize(config.framesInFlight);
+            for (size_t i = 0; i < config.framesInFlight; i++) {
+                createBuffer(sizeof(VkDrawIndexedIndirectCommand) * drawList.size(), 
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, 
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, culledCommandBuffers[i], culledCommandBuffersAllocation[i],
+                    asyncComputeFamilies());
+                // Cleared with vkCmdFillBuffer before every dispatch
+                createBuffer(sizeof(uint32_t), 
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, culledCountBuffers[i], culledCountBuffersAllocation[i],
+                    asyncComputeFamilies());
+            }
+
+            createCullingPipeline();
+            if (asyncCulling) {
+                createAsyncComputeResources();
+            }
+        }
+
+        // True if the device has a compute only queue family the async compute passes can run on
+        bool separateComputeQueue() const {
+            return computeQueueFamily != graphicsQueueFamily;
+        }
+
+        // Queue families sharing the buffers the async compute passes use, the transfer queue uploads some of them
+        // Empty without async compute, so the buffers stay exclusive
+        std::vector<uint32_t> asyncComputeFamilies() const {
+            if (!asyncCulling) {
+                return {};
+            }
+            return {graphicsQueueFamily, computeQueueFamily, transferQueueFamily};
+        }
+
+        // Creates the command pool and per frame command buffers of the compute queue, and its timeline
+        void createAsyncComputeResources() {
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // Rerecorded every frame
+            poolInfo.queueFamilyIndex = computeQueueFamily;
+            if (vkCreateCommandPool(device, &poolInfo, nullptr, &computeCommandPool) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create command pool!");
+            }
+
+            computeCommandBuffers.resize(config.framesInFlight);
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = computeCommandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = static_cast<uint32_t>(computeCommandBuffers.size());
+            if (vkAllocateCommandBuffers(device, &allocInfo, computeCommandBuffers.data()) != VK_SUCCESS) {
+                throw std::runtime_error("failed to allocate compute command buffers!");
+            }
+
+            computeTimeline = createTimelineSemaphore();
+        }
+
+        /**
+         * Records the frame's async compute passes and submits them to the compute queue
+         * 
+         * They wait on the GPU timeline for the uploads submitted so far, which they may read, and signal the
+         * next compute timeline value. The frame's graphics submission waits on that value at the indirect
+         * draw stage only, so the work before it, like the previous frame's fragment shading, overlaps with them.
+         * The buffers shared with the graphics queue are concurrent, so no ownership has to be transferred, and the
+         * semaphore makes the results visible to the graphics queue, so the graph ends without a barrier.
+         * The frame in flight has finished before this is called, which means its previous compute work has too.
+         */
+        void submitAsyncCompute() {
+            VkCommandBuffer commandBuffer = computeCommandBuffers[currentFrame];
+            vkResetCommandBuffer(commandBuffer, 0);
+
+            VkCommandBufferBeginInfo beginInfo{};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+                throw std::runtime_error("failed to begin recording compute command buffer!");
+            }
+            // The graph has the barriers between the passes, the graphics queue waits for their results on the semaphore
+            FrameGraphResources resources;
+            computeGraph.reset();
+            addCullingPasses(computeGraph, resources);
+            computeGraph.execute(commandBuffer);
+            if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+                throw std::runtime_error("failed to record compute command buffer!");
+            }
+
+            // The latest upload batch, the earlier ones finish before it on the GPU timeline
+            uint64_t waitValue = uploadsInFlight.empty() ? 0 : uploadsInFlight.back().value;
+            uint64_t signalValue = ++computeTimelineValue;
+            VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+            VkTimelineSemaphoreSubmitInfo timelineInfo{};
+            timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+            timelineInfo.waitSemaphoreValueCount = 1;
+            timelineInfo.pWaitSemaphoreValues = &waitValue;
+            timelineInfo.signalSemaphoreValueCount = 1;
+            timelineInfo.pSignalSemaphoreValues = &signalValue;
+
+            VkSubmitInfo submitInfo{};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            submitInfo.pNext = &timelineInfo;
+            submitInfo.waitSemaphoreCount = 1;
+            submitInfo.pWaitSemaphores = &gpuTimeline;
+            submitInfo.pWaitDstStageMask = &waitStage;
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &commandBuffer;
+            submitInfo.signalSemaphoreCount = 1;
+            submitInfo.pSignalSemaphores = &computeTimeline;
+            if (vkQueueSubmit(computeQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+                throw std::runtime_error("failed to submit compute command buffer!");
+            }
+        }
+
+        void createCullingPipeline() {
+            // 0: camera, 1: objects, 2: output commands, 3: output count
+            std::array<VkDescriptorSetLayoutBinding, 4> bindings{};
+            for (uint32_t i = 0; i < bindings.size(); i++) {
+                bindings[i].binding = i;
+                bindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                bindings[i].descriptorCount = 1;
+                bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            }
+
+            VkDescriptorSetLayoutCreateInfo layoutInfo{};
+            layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+            layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+            layoutInfo.pBindings = bindings.data();
+            if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &cullDescriptorSetLayout) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create descriptor set layout!");
+            }
+
+            // The model matrix and the number of objects to test
+            VkPushConstantRange pushConstantRange{};
+            pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            pushConstantRange.offset = 0;
+            pushConstantRange.size = sizeof(CullConstants);
+
+            VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+            pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+            pipelineLayoutInfo.setLayoutCount = 1;
+            pipelineLayoutInfo.pSetLayouts = &cullDescriptorSetLayout;
+            pipelineLayoutInfo.pushConstantRangeCount = 1;
+            pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+            if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &cullPipelineLayout) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create pipeline layout!");
+            }
+
+            auto cullShaderCode = readFile("shaders/cull.spv");
+            VkShaderModule cullShaderModule = createShaderModule(cullShaderCode);
 
-            samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-            samplerInfo.mipLodBias = 0.0f;
-            samplerInfo.minLod = 0.0f;
-            samplerInfo.maxLod = 0.0f;
+            VkComputePipelineCreateInfo pipelineInfo{};
+            pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+            pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+            pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+            pipelineInfo.stage.module = cullShaderModule;
+            pipelineInfo.stage.pName = "main";
+            pipelineInfo.layout = cullPipelineLayout;
 
-            if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler) != VK_SUCCESS) {
-                throw std::runtime_error("failed to create texture sampler!");
+            if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &cullPipeline) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create compute pipeline!");
             }
+
+            vkDestroyShaderModule(device, cullShaderModule, nullptr);
         }
 
+        /**
+         * Adds the culling to a render graph, it has to run outside the render pass
+         * 
+         * The count is cleared, then every visible object appends its draw command. The draws read
+         * both at the indirect stage, the graph adds the barriers in between.
+         */
+        void addCullingPasses(RenderGraph& graph, FrameGraphResources& resources) {
+            resources.culledCommands = graph.importBuffer(culledCommandBuffers[currentFrame]);
+            resources.culledCount = graph.importBuffer(culledCountBuffers[currentFrame]);
+
+            graph.addPass("clear cull count", {
+                {resources.culledCount, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT},
+            }, [this](VkCommandBuffer commandBuffer) {
+                vkCmdFillBuffer(commandBuffer, culledCountBuffers[currentFrame], 0, sizeof(uint32_t), 0);
+            });
+
+            graph.addPass("cull", {
+                // atomicAdd reads and writes
+                {resources.culledCount, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT},
+                {resources.culledCommands, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_WRITE_BIT},
+            }, [this](VkCommandBuffer commandBuffer) {
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+                uint32_t dynamicOffset = uniformOffset(currentFrame);
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, 
+                    &cullDescriptorSets[currentFrame], 1, &dynamicOffset);
+                CullConstants constants{drawConstants.model, static_cast<uint32_t>(drawList.size())};
+                vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+                vkCmdDispatch(commandBuffer, (constants.objectCount + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE, 1, 1);
+            });
+        }
 
-        // Allocates memory for buffer used for vertex data
-        void createVertexBuffer() {
-            VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-            // A temporary buffer visible to the CPU for copying the vertex data to the GPU's buffer
-            VkBuffer stagingBuffer;
-            VkDeviceMemory stagingBufferMemory;
-            createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, // The buffer is used as source for memory transfer operation
-                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, // Buffer is accesible by CPU
-                stagingBuffer, stagingBufferMemory);
-
-            // Mapping the buffer memory into CPU accessible memory with vkMapMemory
-            void* data;
-            vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-            // Copy the vertex data to the mapped memory
-            memcpy(data, vertices.data(), (size_t) bufferSize);
-            // Unmap the memory
-            vkUnmapMemory(device, stagingBufferMemory);
+        // Creates the buffer that every upload is staged through
+        // It is host visible and stays mapped until cleanup
+        void createStagingRing() {
+            createBuffer(STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                stagingRingBuffer, stagingRingAllocation);
 
-            // Creating the vertex buffer in the GPU that is not accessible by CPU
-            createBuffer(bufferSize, 
-                // The buffer is used as destination for memory transfer operation and for storing vertex data
-                VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,  
-                vertexBuffer, vertexBufferMemory);
-            
-            copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-            
-            vkDestroyBuffer(device, stagingBuffer, nullptr);
-            vkFreeMemory(device, stagingBufferMemory, nullptr);
+            stagingRing.init(stagingRingBuffer, stagingRingAllocation.mapped, STAGING_RING_SIZE);
         }
-        // For creating a temporary staging buffer to map the indices data onto
-        // Then creating the actual index buffer and copying the data from the staging buffer
-        // This allows the actual index to be GPU exclusive for better performance
-        void createIndexBuffer() {
-            VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
-            // A temporary buffer accesible by CPU to map and copy the data from the indices array
-            VkBuffer stagingBuffer;
-            VkDeviceMemory stagingBufferMemory;
-            createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
-                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
-                stagingBuffer, stagingBufferMemory);
-
-            // Copying the indices data to the staging buffer to then copy to GPU exclusive buffer
-            void* data;
-            vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-            memcpy(data, indices.data(), (size_t) bufferSize);
-            vkUnmapMemory(device, stagingBufferMemory);
 
-            // Creating the actual buffer exclusive to the GPU
-            createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, 
-                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
-            // Copying the data from the staging buffer to the actual buffer
-            copyBuffer(stagingBuffer, indexBuffer, bufferSize);
-            // Freeing the memory used by the stagingBuffer
-            vkDestroyBuffer(device, stagingBuffer, nullptr);
-            vkFreeMemory(device, stagingBufferMemory, nullptr);
+        // Reserves space in the staging ring for an upload
+        // The region is given back once the submission copying from it has completed
+        StagingRegion allocateStaging(VkDeviceSize size, VkDeviceSize alignment) {
+            StagingRegion region;
+            while (!stagingRing.tryAllocate(size, alignment, region)) {
+                // The ring is full, the open batch is flushed so its regions can be reclaimed
+                if (!uploadRecorder.empty()) {
+                    submitUpload();
+                }
+                uint64_t oldest;
+                if (!stagingRing.oldestInFlight(oldest)) {
+                    throw std::runtime_error("staging ring is full!");
+                }
+                waitForUpload(oldest);
+            }
+            return region;
         }
 
-        VkCommandBuffer beginSingleTimeCommands() {
+        // Command buffers and sync objects for one upload submission
+        UploadBatch createUploadBatch() {
+            UploadBatch batch{};
+
             VkCommandBufferAllocateInfo allocInfo{};
             allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
             allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-            allocInfo.commandPool = commandPool;
             allocInfo.commandBufferCount = 1;
+            // The copies run on the transfer queue family
+            allocInfo.commandPool = transferCommandPool;
+            if (vkAllocateCommandBuffers(device, &allocInfo, &batch.transferCommandBuffer) != VK_SUCCESS) {
+                throw std::runtime_error("failed to allocate upload command buffer!");
+            }
+
+            // With a separate transfer family the graphics queue has to acquire the resources afterwards
+            if (separateTransferQueue()) {
+                allocInfo.commandPool = commandPool;
+                if (vkAllocateCommandBuffers(device, &allocInfo, &batch.acquireCommandBuffer) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to allocate upload command buffer!");
+                }
+
+                VkSemaphoreCreateInfo semaphoreInfo{};
+                semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+                if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &batch.transferFinished) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to create upload semaphore!");
+                }
+            }
+            return batch;
+        }
 
-            VkCommandBuffer commandBuffer;
-            vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+        /**
+         * Records everything queued in uploadRecorder into one batch and submits it without waiting
+         *
+         * The copies go to the transfer queue. If it belongs to another queue family, the graphics queue
+         * waits on a semaphore and runs the acquire barriers, so any frame submitted afterwards sees the data.
+         * The submission on the graphics queue signals the next GPU timeline value, which pollUploads()
+         * checks to find out when the staging space is free again.
+         */
+        void submitUpload() {
+            if (uploadRecorder.empty()) return;
+
+            // Reusing a finished batch, otherwise creating a new one
+            UploadBatch batch;
+            if (!freeUploadBatches.empty()) {
+                batch = freeUploadBatches.back();
+                freeUploadBatches.pop_back();
+            } else {
+                batch = createUploadBatch();
+            }
+            batch.value = ++gpuTimelineValue;
 
             VkCommandBufferBeginInfo beginInfo{};
             beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
             beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-            vkBeginCommandBuffer(commandBuffer, &beginInfo);
+            vkBeginCommandBuffer(batch.transferCommandBuffer, &beginInfo);
+            if (separateTransferQueue()) {
+                vkBeginCommandBuffer(batch.acquireCommandBuffer, &beginInfo);
+            }
 
-            return commandBuffer;
-        }
+            uploadRecorder.record(batch.transferCommandBuffer, batch.acquireCommandBuffer);
 
-        void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
-            vkEndCommandBuffer(commandBuffer);
+            if (vkEndCommandBuffer(batch.transferCommandBuffer) != VK_SUCCESS) {
+                throw std::runtime_error("failed to record upload command buffer!");
+            }
 
             VkSubmitInfo submitInfo{};
             submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
             submitInfo.commandBufferCount = 1;
-            submitInfo.pCommandBuffers = &commandBuffer;
+            submitInfo.pCommandBuffers = &batch.transferCommandBuffer;
+
+            // Signals the GPU timeline from the graphics queue, keeping its values in submission order
+            VkTimelineSemaphoreSubmitInfo timelineInfo{};
+            timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+            timelineInfo.signalSemaphoreValueCount = 1;
+            timelineInfo.pSignalSemaphoreValues = &batch.value;
+
+            if (separateTransferQueue()) {
+                if (vkEndCommandBuffer(batch.acquireCommandBuffer) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to record upload command buffer!");
+                }
+
+                submitInfo.signalSemaphoreCount = 1;
+                submitInfo.pSignalSemaphores = &batch.transferFinished;
+                if (vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to submit upload command buffer!");
+                }
+
+                // The acquire barriers wait for the copies at the stages that use the resources
+                VkPipelineStageFlags waitStage = uploadRecorder.acquireStages();
+                if (waitStage == 0) {
+                    waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+                }
+                VkSubmitInfo acquireInfo{};
+                acquireInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                acquireInfo.waitSemaphoreCount = 1;
+                acquireInfo.pWaitSemaphores = &batch.transferFinished;
+                acquireInfo.pWaitDstStageMask = &waitStage;
+                acquireInfo.commandBufferCount = 1;
+                acquireInfo.pCommandBuffers = &batch.acquireCommandBuffer;
+                // The binary wait semaphore ignores its value
+                uint64_t waitValue = 0;
+                timelineInfo.waitSemaphoreValueCount = 1;
+                timelineInfo.pWaitSemaphoreValues = &waitValue;
+                acquireInfo.signalSemaphoreCount = 1;
+                acquireInfo.pSignalSemaphores = &gpuTimeline;
+                acquireInfo.pNext = &timelineInfo;
+                if (vkQueueSubmit(graphicsQueue, 1, &acquireInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to submit upload acquire command buffer!");
+                }
+            } else {
+                // The transfer queue is the graphics queue here
+                submitInfo.signalSemaphoreCount = 1;
+                submitInfo.pSignalSemaphores = &gpuTimeline;
+                submitInfo.pNext = &timelineInfo;
+                if (vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to submit upload command buffer!");
+                }
+            }
+
+            // The staging regions written so far are read by this batch
+            stagingRing.submit(batch.value);
+            uploadsInFlight.push_back(batch);
+            uploadRecorder.clear();
+        }
 
-            vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-            vkQueueWaitIdle(graphicsQueue);
+        // Recycles the upload batches the GPU has finished, in submission order, without blocking
+        void pollUploads() {
+            uint64_t completed = completedGpuValue();
+            while (!uploadsInFlight.empty() && uploadsInFlight.front().value <= completed) {
+                freeUploadBatches.push_back(uploadsInFlight.front());
+                uploadsInFlight.pop_front();
+            }
+            stagingRing.reclaim(completed);
+        }
+
+        // Blocks until the upload batch with the given value has finished
+        // Only used when the staging ring has run out of space
+        void waitForUpload(uint64_t value) {
+            waitForGpuValue(value);
+            pollUploads();
+        }
 
-            vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+        // True if uploads run on a queue family other than graphics, requiring ownership transfers
+        bool separateTransferQueue() const {
+            return transferQueueFamily != graphicsQueueFamily;
         }
 
         /**
@@ -1785,27 +6372,66 @@ class HelloTriangleApplication {
          * - VK_BUFFER_USAGE_TRANSFER_SRC_BIT for Source
          * - VK_BUFFER_USAGE_TRANSFER_DST_BIT for destination
          * 
+         * The copy is queued in uploadRecorder and runs with the next upload batch
+         * 
          * @param srcBuffer Source of the data
          * @param dstBuffer Destination of the data
          * @param size Size of the buffers
+         * @param srcOffset Where the data starts in the source, e.g. the offset of a staging region
          */
-        void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-            // Creating a temporary command buffer to perform memory transfer from staging buffer to GPU buffer
-            VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
+        void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size, VkDeviceSize srcOffset = 0) {
             VkBufferCopy copyRegion{};
-            copyRegion.srcOffset = 0; // Optional
+            copyRegion.srcOffset = srcOffset;
             copyRegion.dstOffset = 0; // Optional
             copyRegion.size = size;
-            vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+            uploadRecorder.copyBuffer(srcBuffer, dstBuffer, copyRegion);
+        }
+
+        /**
+         * Makes an uploaded buffer available to the graphics queue
+         * 
+         * With a separate transfer family the buffer is released by the transfer queue and acquired by 
+         * the graphics queue. Otherwise a plain barrier makes the copy visible.
+         * 
+         * @param buffer The buffer written by copyBuffer
+         * @param dstStage Stage that reads the buffer, e.g. VK_PIPELINE_STAGE_VERTEX_INPUT_BIT
+         * @param dstAccess How the buffer is read, e.g. VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT
+         */
+        void releaseBufferToGraphics(VkBuffer buffer, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+            VkBufferMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = dstAccess;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.buffer = buffer;
+            barrier.offset = 0;
+            barrier.size = VK_WHOLE_SIZE;
+
+            if (!separateTransferQueue()) {
+                uploadRecorder.bufferBarrier(UploadRecorder::AFTER_COPIES, barrier, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage);
+                return;
+            }
 
-            endSingleTimeCommands(commandBuffer);           
+            // Release half: the destination access is ignored on the releasing queue
+            barrier.dstAccessMask = 0;
+            barrier.srcQueueFamilyIndex = transferQueueFamily;
+            barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+            uploadRecorder.bufferBarrier(UploadRecorder::AFTER_COPIES, barrier, 
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+            // Acquire half: the source access is ignored on the acquiring queue
+            // It waits on the semaphore at dstStage, so the barrier starts from that stage too
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = dstAccess;
+            uploadRecorder.bufferBarrier(UploadRecorder::ACQUIRE, barrier, dstStage, dstStage);
         }
 
         // Change to image layout to copy the image from the staging buffer to device buffer
+        // Queued in uploadRecorder, where it is merged with the barriers of the other uploads
         void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, 
-            VkImageLayout newLayout) {
-            VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+            VkImageLayout newLayout, uint32_t mipLevels = 1) {
+            UploadRecorder::Phase phase;
 
             VkImageMemoryBarrier barrier{};
             barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -1820,7 +6446,7 @@ class HelloTriangleApplication {
             // When using array or multisampling otherwise use these values
             barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
             barrier.subresourceRange.baseMipLevel = 0;
-            barrier.subresourceRange.levelCount = 1;
+            barrier.subresourceRange.levelCount = mipLevels;
             barrier.subresourceRange.baseArrayLayer = 0;
             barrier.subresourceRange.layerCount = 1;
 
@@ -1840,48 +6466,51 @@ class HelloTriangleApplication {
 
                 sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
                 destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+                phase = UploadRecorder::BEFORE_COPIES;
             } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
                 barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
                 barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
 
                 sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
                 destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+                phase = UploadRecorder::AFTER_COPIES;
+
+                // The transfer queue can't wait on the fragment shader stage
+                // It releases the image and the graphics queue acquires it, both doing the same layout change
+                if (separateTransferQueue()) {
+                    barrier.dstAccessMask = 0;
+                    barrier.srcQueueFamilyIndex = transferQueueFamily;
+                    barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+                    uploadRecorder.imageBarrier(UploadRecorder::AFTER_COPIES, barrier, 
+                        sourceStage, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+                    barrier.srcAccessMask = 0;
+                    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+                    uploadRecorder.imageBarrier(UploadRecorder::ACQUIRE, barrier, destinationStage, destinationStage);
+                    return;
+                }
             } else {
                 throw std::invalid_argument("unsupported layout transition!");
             }
 
-            vkCmdPipelineBarrier(
-                commandBuffer,
-                sourceStage, destinationStage,
-                0,
-                0, nullptr,
-                0, nullptr,
-                1, &barrier
-            );
-
-            endSingleTimeCommands(commandBuffer);
+            uploadRecorder.imageBarrier(phase, barrier, sourceStage, destinationStage);
         }
 
-        void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-            VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
+        void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, VkDeviceSize bufferOffset = 0, 
+            uint32_t mipLevel = 0) {
             VkBufferImageCopy region{};
-            region.bufferOffset = 0;
+            region.bufferOffset = bufferOffset;
             region.bufferRowLength = 0;
             region.bufferImageHeight = 0;
 
             region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            region.imageSubresource.mipLevel = 0;
+            region.imageSubresource.mipLevel = mipLevel;
             region.imageSubresource.baseArrayLayer = 0;
             region.imageSubresource.layerCount = 1;
 
             region.imageOffset = {0, 0, 0};
             region.imageExtent = {width,height,1};
-            vkCmdCopyBufferToImage( commandBuffer, buffer, image, 
-                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, // The destination buffer is already in optimal layout
-                1, &region);
-
-            endSingleTimeCommands(commandBuffer);
+            uploadRecorder.copyBufferToImage(buffer, image, region);
         }
 
         // combine the requirements of the buffer and our own application requirements 
@@ -1905,34 +6534,46 @@ class HelloTriangleApplication {
             throw std::runtime_error("failed to find suitable memory type!");
         }
 
-        void createUniformBuffers() {
-            VkDeviceSize bufferSize = sizeof(UniformBufferObject);
-
-            uniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-            uniformBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
-            uniformBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+        bool hasMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+            VkPhysicalDeviceMemoryProperties memProperties;
+            vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+            for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+                if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+                    return true;
+                }
+            }
+            return false;
+        }
 
-            for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-                createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
-                    uniformBuffers[i], uniformBuffersMemory[i]);
+        void createUniformBuffers() {
+            // Dynamic offsets have to be multiples of minUniformBufferOffsetAlignment, a power of two
+            VkDeviceSize alignment = deviceProperties.limits.minUniformBufferOffsetAlignment;
+            uniformSlotSize = (sizeof(UniformBufferObject) + alignment - 1) & ~(alignment - 1);
 
-                vkMapMemory(device, uniformBuffersMemory[i], 0, bufferSize, 0, &uniformBuffersMapped[i]);
-            }
+            createBuffer(uniformSlotSize * config.framesInFlight, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
+                uniformBuffer, uniformBufferAllocation, asyncComputeFamilies()); // The culling reads the camera
+            // The allocator keeps host visible blocks mapped, so the pointer stays valid
+            uniformSlotVersions.assign(config.framesInFlight, 0);
         }
 
         void createDescriptorPool() {
-            std::array<VkDescriptorPoolSize, 2> poolSizes{};
-            poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-            poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+            // One set for drawing, and each frame has one for culling
+            std::array<VkDescriptorPoolSize, 4> poolSizes{};
+            poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+            poolSizes[0].descriptorCount = static_cast<uint32_t>(config.framesInFlight + 1);
             poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-            poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+            poolSizes[1].descriptorCount = bindlessTextureCount;
+            poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            poolSizes[2].descriptorCount = static_cast<uint32_t>(config.framesInFlight * 3);
+            poolSizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC; // The instances
+            poolSizes[3].descriptorCount = 1;
 
             VkDescriptorPoolCreateInfo poolInfo{};
             poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
             poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
             poolInfo.pPoolSizes = poolSizes.data();
-            poolInfo.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+            poolInfo.maxSets = static_cast<uint32_t>(config.framesInFlight + 1);
 
             if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS) {
                 throw std::runtime_error("failed to create descriptor pool!");
@@ -1940,46 +6581,97 @@ class HelloTriangleApplication {
         }
 
         void createDescriptorSets() {
-            std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, descriptorSetLayout);
             VkDescriptorSetAllocateInfo allocInfo{};
             allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
             allocInfo.descriptorPool = descriptorPool;
-            allocInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
-            allocInfo.pSetLayouts = layouts.data();
+            allocInfo.descriptorSetCount = 1;
+            allocInfo.pSetLayouts = &descriptorSetLayout;
 
-            descriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
-            if (vkAllocateDescriptorSets(device, &allocInfo, descriptorSets.data()) != VK_SUCCESS) {
+            if (vkAllocateDescriptorSets(device, &allocInfo, &descriptorSet) != VK_SUCCESS) {
                 throw std::runtime_error("failed to allocate descriptor sets!");
             }  
 
-            for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-                VkDescriptorBufferInfo bufferInfo{};
-                bufferInfo.buffer = uniformBuffers[i];
-                bufferInfo.offset = 0;
-                bufferInfo.range = sizeof(UniformBufferObject);
-
-                VkDescriptorImageInfo imageInfo{};
-                imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                imageInfo.imageView = textureImageView;
-                imageInfo.sampler = textureSampler;
-
-                std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
-
-                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                descriptorWrites[0].dstSet = descriptorSets[i];
-                descriptorWrites[0].dstBinding = 0;
-                descriptorWrites[0].dstArrayElement = 0;
-                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-                descriptorWrites[0].descriptorCount = 1;
-                descriptorWrites[0].pBufferInfo = &bufferInfo;
-
-                descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                descriptorWrites[1].dstSet = descriptorSets[i];
-                descriptorWrites[1].dstBinding = 1;
-                descriptorWrites[1].dstArrayElement = 0;
-                descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                descriptorWrites[1].descriptorCount = 1;
-                descriptorWrites[1].pImageInfo = &imageInfo;
+            // A single slot, the dynamic offset moves it to the frame's slot
+            VkDescriptorBufferInfo bufferInfo{};
+            bufferInfo.buffer = uniformBuffer;
+            bufferInfo.offset = 0;
+            bufferInfo.range = sizeof(UniformBufferObject);
+
+            // Every texture shares the sampler, without bindless there is room for the first
+            std::vector<VkDescriptorImageInfo> imageInfos;
+            for (VkImageView view : textureViews) {
+                imageInfos.push_back({textureSampler, view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL});
+            }
+            imageInfos.resize(std::min<size_t>(imageInfos.size(), bindlessTextureCount));
+
+            VkDescriptorBufferInfo instanceBufferInfo{};
+            instanceBufferInfo.buffer = instanceBuffer;
+            instanceBufferInfo.offset = 0;
+            instanceBufferInfo.range = sizeof(InstanceData) * instanceTransforms.size(); // One slot
+
+            std::array<VkWriteDescriptorSet, 3> descriptorWrites{};
+
+            descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[0].dstSet = descriptorSet;
+            descriptorWrites[0].dstBinding = 0;
+            descriptorWrites[0].dstArrayElement = 0;
+            descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+            descriptorWrites[0].descriptorCount = 1;
+            descriptorWrites[0].pBufferInfo = &bufferInfo;
+
+            descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[1].dstSet = descriptorSet;
+            descriptorWrites[1].dstBinding = 1;
+            descriptorWrites[1].dstArrayElement = 0;
+            descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            descriptorWrites[1].descriptorCount = static_cast<uint32_t>(imageInfos.size());
+            descriptorWrites[1].pImageInfo = imageInfos.data();
+
+            descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[2].dstSet = descriptorSet;
+            descriptorWrites[2].dstBinding = 2;
+            descriptorWrites[2].dstArrayElement = 0;
+            descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+            descriptorWrites[2].descriptorCount = 1;
+            descriptorWrites[2].pBufferInfo = &instanceBufferInfo;
+
+            vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), 
+                descriptorWrites.data(), 0, nullptr);
+        }
+
+        // Points the culling pass of every frame at the camera and its own output buffers
+        void createCullingDescriptorSets() {
+            if (!gpuCulling) return;
+
+            std::vector<VkDescriptorSetLayout> layouts(config.framesInFlight, cullDescriptorSetLayout);
+            VkDescriptorSetAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            allocInfo.descriptorPool = descriptorPool;
+            allocInfo.descriptorSetCount = static_cast<uint32_t>(config.framesInFlight);
+            allocInfo.pSetLayouts = layouts.data();
+
+            cullDescriptorSets.resize(config.framesInFlight);
+            if (vkAllocateDescriptorSets(device, &allocInfo, cullDescriptorSets.data()) != VK_SUCCESS) {
+                throw std::runtime_error("failed to allocate descriptor sets!");
+            }
+
+            for (size_t i = 0; i < config.framesInFlight; i++) {
+                std::array<VkDescriptorBufferInfo, 4> bufferInfos{};
+                bufferInfos[0] = {uniformBuffer, 0, sizeof(UniformBufferObject)}; // Moved to the frame's slot when bound
+                bufferInfos[1] = {cullObjectBuffer, 0, VK_WHOLE_SIZE};
+                bufferInfos[2] = {culledCommandBuffers[i], 0, VK_WHOLE_SIZE};
+                bufferInfos[3] = {culledCountBuffers[i], 0, VK_WHOLE_SIZE};
+
+                std::array<VkWriteDescriptorSet, 4> descriptorWrites{};
+                for (uint32_t binding = 0; binding < descriptorWrites.size(); binding++) {
+                    descriptorWrites[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                    descriptorWrites[binding].dstSet = cullDescriptorSets[i];
+                    descriptorWrites[binding].dstBinding = binding;
+                    descriptorWrites[binding].dstArrayElement = 0;
+                    descriptorWrites[binding].descriptorType = binding == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                    descriptorWrites[binding].descriptorCount = 1;
+                    descriptorWrites[binding].pBufferInfo = &bufferInfos[binding];
+                }
 
                 vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), 
                     descriptorWrites.data(), 0, nullptr);
@@ -1987,7 +6679,7 @@ class HelloTriangleApplication {
         }
 
         void createCommandBuffer() {
-            commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+            commandBuffers.resize(config.framesInFlight);
             VkCommandBufferAllocateInfo allocInfo{};
             allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
             allocInfo.commandPool = commandPool;    // Reference to the command pool managing the command buffer
@@ -2005,10 +6697,116 @@ class HelloTriangleApplication {
             }
         }
 
+        // Creates a command pool and a secondary command buffer for every recording thread in every frame in flight
+        // Pools can't be used from two threads at once, so each thread only ever records from its own
+        void createThreadCommandPools() {
+            uint32_t threadCount = std::clamp(std::thread::hardware_concurrency(), 1u, MAX_RECORDING_THREADS);
+
+            threadCommandPools.resize(config.framesInFlight);
+            secondaryCommandBuffers.resize(config.framesInFlight);
+            for (size_t i = 0; i < config.framesInFlight; i++) {
+                threadCommandPools[i].resize(threadCount);
+                secondaryCommandBuffers[i].resize(threadCount);
+                for (uint32_t thread = 0; thread < threadCount; thread++) {
+                    VkCommandPoolCreateInfo poolInfo{};
+                    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+                    // Rerecorded every frame and reset as a whole pool instead of per buffer
+                    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+                    poolInfo.queueFamilyIndex = graphicsQueueFamily;
+                    if (vkCreateCommandPool(device, &poolInfo, nullptr, &threadCommandPools[i][thread]) != VK_SUCCESS) {
+                        throw std::runtime_error("failed to create command pool!");
+                    }
+
+                    VkCommandBufferAllocateInfo allocInfo{};
+                    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                    allocInfo.commandPool = threadCommandPools[i][thread];
+                    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+                    allocInfo.commandBufferCount = 1;
+                    if (vkAllocateCommandBuffers(device, &allocInfo, &secondaryCommandBuffers[i][thread]) != VK_SUCCESS) {
+                        throw std::runtime_error("failed to allocate command buffers!");
+                    }
+                }
+            }
+
+            recordingThreads.start(threadCount);
+        }
+
+        /**
+         * Fills the draw list and the instance transforms
+         * 
+         * Right now the whole index buffer is a single draw, with config.instanceCount instances 
+         * spread over a square grid on the XY plane.
+         */
+        void createDrawList() {
+            uint32_t indexCount = mesh.indexCount;
+            glm::vec4 meshSphere = mesh.boundingSphere();
+
+            instanceTransforms.clear();
+            instanceTextures.clear();
+            instanceTransformSystem.clear();
+            // The quad is 1 unit wide, larger meshes are spread out so they don't overlap
+            const float spacing = std::max(1.5f, meshSphere.w * 2.0f);
+            uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(config.instanceCount))));
+            float gridOffset = (columns - 1) * spacing * 0.5f; // Centering the grid on the origin
+            for (uint32_t i = 0; i < config.instanceCount; i++) {
+                glm::vec3 position((i % columns) * spacing - gridOffset, (i / columns) * spacing - gridOffset, 0.0f);
+                instanceTransforms.push_back(glm::translate(glm::mat4(1.0f), position));
+                instanceTextures.push_back(0); // The mesh has a single texture
+                if (config.animateInstances) {
+                    // Between 45 and 135 degrees a second, every other one the other way round
+                    float spin = glm::radians(45.0f + 90.0f * ((i * 7) % 16) / 15.0f) * (i % 2 == 0 ? 1.0f : -1.0f);
+                    instanceTransformSystem.add(position, 0.0f, 1.0f, spin);
+                }
+            }
+
+            // A mesh spinning about Z stays within a sphere about the axis, reaching as far out as the mesh does
+            if (config.animateInstances) {
+                meshSphere = glm::vec4(0.0f, 0.0f, meshSphere.z, meshSphere.w + glm::length(glm::vec2(meshSphere.x, meshSphere.y)));
+            }
+
+            drawList.clear();
+            drawList.push_back({indexCount, 0, 0, config.instanceCount, 0,
+                computeInstancesBoundingSphere(meshSphere, 0, config.instanceCount)});
+        }
+
+        // Sphere enclosing a mesh's bounding sphere moved to every one of the instances
+        glm::vec4 computeInstancesBoundingSphere(glm::vec4 meshSphere, uint32_t firstInstance, uint32_t instanceCount) {
+            std::vector<glm::vec4> spheres(instanceCount);
+            glm::vec3 minimum(std::numeric_limits<float>::max());
+            glm::vec3 maximum(std::numeric_limits<float>::lowest());
+            for (uint32_t i = 0; i < instanceCount; i++) {
+                const glm::mat4& transform = instanceTransforms[firstInstance + i];
+                glm::vec3 center = glm::vec3(transform * glm::vec4(glm::vec3(meshSphere), 1.0f));
+                float scale = std::max({glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])), 
+                    glm::length(glm::vec3(transform[2]))});
+                spheres[i] = glm::vec4(center, meshSphere.w * scale);
+                minimum = glm::min(minimum, center - spheres[i].w);
+                maximum = glm::max(maximum, center + spheres[i].w);
+            }
+            glm::vec3 center = (minimum + maximum) * 0.5f;
+
+            float radius = 0.0f;
+            for (const auto& sphere : spheres) {
+                radius = std::max(radius, glm::length(glm::vec3(sphere) - center) + sphere.w);
+            }
+            return glm::vec4(center, radius);
+        }
+
         /// Writes the commands we want to execute into a command buffer
         /// @param commandBuffer The command buffer to write the commands into
         /// @param imageIndex The index of the current swapchain image we want to write to
         void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+            // Splitting the draw list into one slice per thread and recording them in parallel
+            // Small draw lists use fewer threads, each slice should be worth the hand over
+            uint32_t sliceCount = std::min(recordingThreads.threadCount(), static_cast<uint32_t>(drawList.size()));
+            // Indirect draws are a single call, there is nothing to split
+            if (config.indirectDraw) {
+                sliceCount = std::min(sliceCount, 1u);
+            }
+            recordingThreads.run(sliceCount, [&](uint32_t slice) {
+                recordDrawSlice(slice, sliceCount, imageIndex);
+            });
+
             // Begin recording the command buffer
             // If already recording, resets the recording operation
             // It is not possible to append command buffers
@@ -2031,6 +6829,87 @@ class HelloTriangleApplication {
                 throw std::runtime_error("failed to begin recording command buffer!");
             }
 
+            // Queries have to be reset before they are written again
+            if (timestampQueryPool != VK_NULL_HANDLE) {
+                gpuScopeNames[currentFrame].clear();
+                vkCmdResetQueryPool(commandBuffer, timestampQueryPool, currentFrame * MAX_GPU_SCOPES * 2, MAX_GPU_SCOPES * 2);
+            }
+
+            // The passes of the frame with the barriers between them
+            frameGraph.reset();
+            buildFrameGraph(frameGraph, imageIndex, sliceCount);
+            frameGraph.execute(commandBuffer);
+
+            // Stop recording the commands
+            if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+                throw std::runtime_error("failed to record command buffer!");
+            }
+        }
+
+        /**
+         * Adds the passes of a frame to the graph: the culling, the rendering and the layout change for presenting
+         * 
+         * With dynamic rendering the graph does every barrier. A render pass object changes the layouts of its
+         * attachments and waits for the acquired image and the previous frame through its subpass dependency,
+         * so without dynamic rendering the graph only synchronizes the buffers the draws read.
+         * 
+         * @param imageIndex The swap chain image drawn to
+         * @param sliceCount Secondary command buffers recorded for the draw list
+         */
+        FrameGraphResources buildFrameGraph(RenderGraph& graph, uint32_t imageIndex, uint32_t sliceCount) {
+            FrameGraphResources resources;
+            // Waits for the presentation engine at the same stage the acquire semaphore is waited on
+            // The old contents are cleared, so the image can start out undefined
+            resources.target = graph.importImage(swapChainImages[imageIndex], VK_IMAGE_ASPECT_COLOR_BIT, 
+                VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT);
+            // The render targets wait for the previous frame, which used them too
+            const VkPipelineStageFlags2 depthStages = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+            resources.depth = graph.importImage(depthTarget.image, depthAspects(), VK_IMAGE_LAYOUT_UNDEFINED, 
+                depthStages, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
+            bool multisampled = msaaSamples != VK_SAMPLE_COUNT_1_BIT;
+            if (multisampled) {
+                resources.color = graph.importImage(colorTarget.image, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+                    VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT);
+            }
+
+            // The draws read the culled commands from the compute queue otherwise, the semaphore orders them
+            std::vector<RenderGraph::Use> uses;
+            if (gpuCulling && !asyncCulling) {
+                addCullingPasses(graph, resources);
+                uses.push_back({resources.culledCommands, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT});
+                uses.push_back({resources.culledCount, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT});
+            }
+
+            // With MSAA the samples are averaged into the swap chain image, which is written at the color output stage too
+            // A render pass leaves the attachments in their final layouts
+            uses.push_back({resources.target, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                dynamicRendering ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : finalColorLayout()});
+            uses.push_back({resources.depth, depthStages, 
+                VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL});
+            if (multisampled) {
+                uses.push_back({resources.color, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                    VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL});
+            }
+            graph.addPass("render", std::move(uses), [this, imageIndex, sliceCount](VkCommandBuffer commandBuffer) {
+                if (dynamicRendering) {
+                    recordDynamicRendering(commandBuffer, imageIndex, sliceCount);
+                } else {
+                    recordRenderPass(commandBuffer, imageIndex, sliceCount);
+                }
+            }, !dynamicRendering);
+
+            // Makes the image ready to be presented (or copied out in headless mode)
+            if (dynamicRendering) {
+                graph.addPass("present", {
+                    {resources.target, VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, finalColorLayout()},
+                });
+            }
+            return resources;
+        }
+
+        // Draws the recorded slices in the render pass
+        void recordRenderPass(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t sliceCount) {
             // Starting a render pass
             VkRenderPassBeginInfo renderPassInfo{};
             renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
@@ -2042,10 +6921,12 @@ class HelloTriangleApplication {
             renderPassInfo.renderArea.offset = {0, 0};
             renderPassInfo.renderArea.extent = swapChainExtent;
 
-            // Clear values to use for VK_ATTACHMENT_LOAD_OP_CLEAR
-            VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, 1.0f}}}; // Black with 100% opacity
-            renderPassInfo.clearValueCount = 1;
-            renderPassInfo.pClearValues = &clearColor;
+            // Clear values to use for VK_ATTACHMENT_LOAD_OP_CLEAR, in the order of the attachments
+            std::array<VkClearValue, 2> clearValues{};
+            clearValues[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}}; // Black with 100% opacity
+            clearValues[1].depthStencil = {1.0f, 0}; // The far plane
+            renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+            renderPassInfo.pClearValues = clearValues.data();
 
             // Record the begin render pass command
             // The final parameter controls how the drawing commands within the render pass will be provided. 
@@ -2057,85 +6938,269 @@ class HelloTriangleApplication {
             // 
             // VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS: 
             //              The render pass commands will be executed from secondary command buffers.
-            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+                // The draws were recorded by the threads above
+                if (sliceCount > 0) {
+                    vkCmdExecuteCommands(commandBuffer, sliceCount, secondaryCommandBuffers[currentFrame].data());
+                }
 
-                // Record command to bind graphics pipeline
-                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+            vkCmdEndRenderPass(commandBuffer);  // End the render pass
+        }
 
-                // Specifying the viewport as we are using dynamic viewport
-                VkViewport viewport{};
-                viewport.x = 0.0f;
-                viewport.y = 0.0f;
-                viewport.width = static_cast<float>(swapChainExtent.width);
-                viewport.height = static_cast<float>(swapChainExtent.height);
-                viewport.minDepth = 0.0f;
-                viewport.maxDepth = 1.0f;
-                vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-                // Specifyng the scissor as we are using dynamic scissor
-                VkRect2D scissor{};
-                scissor.offset = {0, 0};
-                scissor.extent = swapChainExtent;
-                vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+        /**
+         * Draws the recorded slices with dynamic rendering instead of a render pass
+         * 
+         * The render pass did the layout changes and the wait for the acquired image through its attachment
+         * description and subpass dependency, here the frame graph puts the barriers around it.
+         */
+        void recordDynamicRendering(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t sliceCount) {
+            bool multisampled = colorTarget.image != VK_NULL_HANDLE;
+
+            // With MSAA the samples are averaged into the swap chain image at the end of rendering and
+            // never stored, the swap chain image is drawn to directly otherwise
+            VkRenderingAttachmentInfo colorAttachment{};
+            colorAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+            colorAttachment.imageView = swapChainImageViews[imageIndex];
+            colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+            colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+            colorAttachment.clearValue = {{{0.0f, 0.0f, 0.0f, 1.0f}}}; // Black with 100% opacity
+            if (multisampled) {
+                colorAttachment.imageView = colorTarget.view;
+                colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                colorAttachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+                colorAttachment.resolveImageView = swapChainImageViews[imageIndex];
+                colorAttachment.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            }
+
+            VkRenderingAttachmentInfo depthAttachment{};
+            depthAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+            depthAttachment.imageView = depthTarget.view;
+            depthAttachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+            depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+            depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            depthAttachment.clearValue.depthStencil = {1.0f, 0}; // The far plane
+
+            VkRenderingInfo renderingInfo{};
+            renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+            renderingInfo.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT; // Draws come from the recording threads
+            renderingInfo.renderArea.offset = {0, 0};
+            renderingInfo.renderArea.extent = swapChainExtent;
+            renderingInfo.layerCount = 1;
+            renderingInfo.colorAttachmentCount = 1;
+            renderingInfo.pColorAttachments = &colorAttachment;
+            renderingInfo.pDepthAttachment = &depthAttachment;
+
+            cmdBeginRendering(commandBuffer, &renderingInfo);
+                if (sliceCount > 0) {
+                    vkCmdExecuteCommands(commandBuffer, sliceCount, secondaryCommandBuffers[currentFrame].data());
+                }
+            cmdEndRendering(commandBuffer);
+        }
 
-                /**
-                 * Recording the command to draw
-                 * =============================
-                 * It has the following parameters, aside from the command buffer:
-                 * 
-                 * vertexCount:     Size of the vertices array
-                 * instanceCount:   Used for instanced rendering, use 1 if you're not doing that.
-                 * firstVertex:     Used as an offset into the vertex buffer, defines the lowest value of gl_VertexIndex.
-                 * firstInstance:   Used as an offset for instanced rendering, defines the lowest value of gl_InstanceIndex
-                */ 
-                VkBuffer vertexBuffers[] = {vertexBuffer};
-                VkDeviceSize offsets[] = {0};
-                vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+        /**
+         * Records one slice of the draw list into the secondary command buffer of a thread
+         * Runs on the recording thread with the index thread, which owns the command pools it uses
+         * 
+         * @param thread Index of the recording thread, also selects the slice
+         * @param sliceCount Number of slices the draw list is split into
+         * @param imageIndex Swapchain image the render pass draws to
+         */
+        void recordDrawSlice(uint32_t thread, uint32_t sliceCount, uint32_t imageIndex) {
+            // The frame's fence has been waited on, so the GPU is done with everything allocated from this pool
+            // Resetting the pool recycles all its command buffers at once
+            vkResetCommandPool(device, threadCommandPools[currentFrame][thread], 0);
+            VkCommandBuffer commandBuffer = secondaryCommandBuffers[currentFrame][thread];
+
+            // Secondary command buffers inside a render pass have to name the render pass they continue
+            VkCommandBufferInheritanceInfo inheritanceInfo{};
+            inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+            inheritanceInfo.renderPass = renderPass;
+            inheritanceInfo.subpass = 0;
+            inheritanceInfo.framebuffer = VK_NULL_HANDLE;
+            if (!dynamicRendering) {
+                inheritanceInfo.framebuffer = swapChainFramebuffers[imageIndex]; // Optional, but may help the driver
+            }
 
-                vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT16);
+            // With dynamic rendering they describe the attachments of the vkCmdBeginRendering call instead
+            VkCommandBufferInheritanceRenderingInfo renderingInfo{};
+            renderingInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+            renderingInfo.colorAttachmentCount = 1;
+            renderingInfo.pColorAttachmentFormats = &swapChainImageFormat;
+            renderingInfo.depthAttachmentFormat = depthFormat;
+            renderingInfo.rasterizationSamples = msaaSamples;
+            if (dynamicRendering) {
+                inheritanceInfo.renderPass = VK_NULL_HANDLE;
+                inheritanceInfo.pNext = &renderingInfo;
+            }
 
-                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1,
-                    &descriptorSets[currentFrame], 0, nullptr);
+            VkCommandBufferBeginInfo beginInfo{};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+            beginInfo.pInheritanceInfo = &inheritanceInfo;
 
-                vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+            if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+                throw std::runtime_error("failed to begin recording command buffer!");
+            }
 
-            vkCmdEndRenderPass(commandBuffer);  // End the render pass
+            // State isn't inherited from the primary command buffer, every secondary sets it again
+            // Record command to bind graphics pipeline
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+
+            // Specifying the viewport as we are using dynamic viewport
+            VkViewport viewport{};
+            viewport.x = 0.0f;
+            viewport.y = 0.0f;
+            viewport.width = static_cast<float>(swapChainExtent.width);
+            viewport.height = static_cast<float>(swapChainExtent.height);
+            viewport.minDepth = 0.0f;
+            viewport.maxDepth = 1.0f;
+            vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+            // Specifyng the scissor as we are using dynamic scissor
+            VkRect2D scissor{};
+            scissor.offset = {0, 0};
+            scissor.extent = swapChainExtent;
+            vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+            VkBuffer vertexBuffers[] = {vertexBuffer};
+            VkDeviceSize offsets[] = {0};
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+
+            vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, indexType);
+
+            // The same set every frame, the dynamic offsets select the frame's camera and instances
+            // They are given in binding order
+            std::array<uint32_t, 2> dynamicOffsets = {uniformOffset(currentFrame), instanceOffset(currentFrame)};
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1,
+                &descriptorSet, static_cast<uint32_t>(dynamicOffsets.size()), dynamicOffsets.data());
+            vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(drawConstants), &drawConstants);
+
+            /**
+             * Recording the command to draw
+             * =============================
+             * It has the following parameters, aside from the command buffer:
+             * 
+             * indexCount:      Number of indices to draw
+             * instanceCount:   Number of copies, each reading its own transform with gl_InstanceIndex
+             * firstIndex:      Used as an offset into the index buffer
+             * vertexOffset:    Added to the vertex index before indexing into the vertex buffer
+             * firstInstance:   Used as an offset for instanced rendering, defines the lowest value of gl_InstanceIndex
+            */ 
+            if (config.indirectDraw) {
+                recordIndirectDraws(commandBuffer);
+            } else {
+                recordDirectDraws(commandBuffer, thread, sliceCount);
+            }
 
-            // Stop recording the commands
             if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
                 throw std::runtime_error("failed to record command buffer!");
             }
         }
 
+        // Records one vkCmdDrawIndexed for every draw in the slice
+        void recordDirectDraws(VkCommandBuffer commandBuffer, uint32_t thread, uint32_t sliceCount) {
+            // Spreading the draws evenly, if it doesn't divide the slices differ by at most one draw
+            size_t begin = drawList.size() * thread / sliceCount;
+            size_t end = drawList.size() * (thread + 1) / sliceCount;
+            for (size_t i = begin; i < end; i++) {
+                const DrawItem& draw = drawList[i];
+                vkCmdDrawIndexed(commandBuffer, draw.indexCount, draw.instanceCount, draw.firstIndex, draw.vertexOffset, draw.firstInstance);
+            }
+        }
+
+        // Issues the whole draw list from indirectBuffer with as few calls as the device allows
+        void recordIndirectDraws(VkCommandBuffer commandBuffer) {
+            const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+            uint32_t drawCount = static_cast<uint32_t>(drawList.size());
+
+            // A single call can't draw more than maxDrawIndirectCount commands
+            uint32_t maxDraws = std::max(deviceProperties.limits.maxDrawIndirectCount, 1u);
+
+            if (gpuCulling) {
+                // Only the draws that survived culling this frame
+                vkCmdDrawIndexedIndirectCount(commandBuffer, culledCommandBuffers[currentFrame], 0, 
+                    culledCountBuffers[currentFrame], 0, std::min(drawCount, maxDraws), stride);
+            } else if (deviceCapabilities.drawIndirectCount && drawCount <= maxDraws) {
+                // The GPU reads how many commands to draw, drawCount is only the upper bound
+                vkCmdDrawIndexedIndirectCount(commandBuffer, indirectBuffer, 0, drawCountBuffer, 0, drawCount, stride);
+            } else if (deviceCapabilities.multiDrawIndirect) {
+                for (uint32_t first = 0; first < drawCount; first += maxDraws) {
+                    vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffer, first * stride, 
+                        std::min(maxDraws, drawCount - first), stride);
+                }
+            } else {
+                // Without multiDrawIndirect every call draws a single command
+                for (uint32_t i = 0; i < drawCount; i++) {
+                    vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffer, i * stride, 1, stride);
+                }
+            }
+        }
+
         // Creates objects used for syncronisation
         void createSyncObjects() {
             // Resizeing the vectors to accoring to max frames in flight
-            imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-            renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-            inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+            imageAvailableSemaphores.resize(config.framesInFlight);
+            renderFinishedSemaphores.resize(config.framesInFlight);
+            // The timeline starts at 0, so the first use of every frame doesn't wait
+            frameTimelineValues.assign(config.framesInFlight, 0);
 
             VkSemaphoreCreateInfo semaphoreInfo{};
             semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-            VkFenceCreateInfo fenceInfo{};
-            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-            // Flagging the fence to start as signaled to allow the first frame to render
-            fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT; 
-
             // Creating syncronisation objects for each frame in flight
-            for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            for (size_t i = 0; i < config.framesInFlight; i++) {
                 if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
                     vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS){
                     throw std::runtime_error("failed to create semaphores!");
                 }
-                if (vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
-                    throw std::runtime_error("failed to create fence!");
-                }
+            }
+        }
+
+        // Creates a timeline semaphore starting at 0, like the one every graphics queue submission signals
+        VkSemaphore createTimelineSemaphore() {
+            VkSemaphoreTypeCreateInfo typeInfo{};
+            typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+            typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+            typeInfo.initialValue = 0;
+
+            VkSemaphoreCreateInfo semaphoreInfo{};
+            semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            semaphoreInfo.pNext = &typeInfo;
+            VkSemaphore semaphore;
+            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create timeline semaphore!");
+            }
+            return semaphore;
+        }
+
+        // Latest GPU timeline value the GPU has finished, doesn't block
+        uint64_t completedGpuValue() {
+            uint64_t value = 0;
+            if (vkGetSemaphoreCounterValue(device, gpuTimeline, &value) != VK_SUCCESS) {
+                throw std::runtime_error("failed to read timeline semaphore!");
+            }
+            return value;
+        }
+
+        // Blocks until the GPU has finished the submission that signals value
+        void waitForGpuValue(uint64_t value) {
+            VkSemaphoreWaitInfo waitInfo{};
+            waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+            waitInfo.semaphoreCount = 1;
+            waitInfo.pSemaphores = &gpuTimeline;
+            waitInfo.pValues = &value;
+            if (vkWaitSemaphores(device, &waitInfo, UINT64_MAX) != VK_SUCCESS) {
+                throw std::runtime_error("failed to wait for timeline semaphore!");
             }
         }
 
         // Clean up the incompatable swapchain
         // Also cleans up frame buffers and imageviews as they are reliant on the swap chain
         void cleanupSwapChain() {
+            renderTargets.release(depthTarget);
+            renderTargets.release(colorTarget);
+
             for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
                 vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
             }
@@ -2144,33 +7209,150 @@ class HelloTriangleApplication {
                 vkDestroyImageView(device, swapChainImageViews[i], nullptr);
             }
 
+            if (config.headless) {
+                for (size_t i = 0; i < swapChainImages.size(); i++) {
+                    vkDestroyImage(device, swapChainImages[i], nullptr);
+                    memoryAllocator.free(offscreenImageAllocations[i]);
+                }
+                swapChainImages.clear();
+                offscreenImageAllocations.clear();
+                return;
+            }
+
             vkDestroySwapchainKHR(device, swapChain, nullptr);
         }
-        // Recreating swapchain when it is no longer compatiable with the surface
-        // For example when resizing the window
+        /**
+         * Recreating swapchain when it is no longer compatiable with the surface
+         * For example when resizing the window
+         * 
+         * Doesn't wait for the device: the old swap chain is handed to the new one as oldSwapchain and retired
+         * with its image views and framebuffers. Frames already submitted keep using them, the deletion queue
+         * frees them once those frames have finished.
+         */
         void recreateSwapChain() {
             // Ideling the recreation when the window is minimized
+            // The main loop sleeps until the window is restored, the next frame tries again
             int width = 0, height = 0;
             glfwGetFramebufferSize(window, &width, &height); // Gets the size of the window
-            while (width == 0 || height == 0) {
-                glfwGetFramebufferSize(window, &width, &height); // Gets the size of the window
-                glfwWaitEvents();
+            if (width == 0 || height == 0) {
+                framebufferResized = true;
+                return;
             }
 
-            vkDeviceWaitIdle(device);
-
-            cleanupSwapChain();
+            // Everything up to the latest submission may still use the old swap chain
+            // Waiting for the submission after it also makes sure the last present to the old swap chain was queued before
+            deferDestroy([this, oldSwapChain = swapChain, imageViews = std::move(swapChainImageViews), 
+                framebuffers = std::move(swapChainFramebuffers)]() {
+                for (VkFramebuffer framebuffer : framebuffers) {
+                    vkDestroyFramebuffer(device, framebuffer, nullptr);
+                }
+                for (VkImageView imageView : imageViews) {
+                    vkDestroyImageView(device, imageView, nullptr);
+                }
+                vkDestroySwapchainKHR(device, oldSwapChain, nullptr);
+            });
+            swapChainImageViews.clear();
+            swapChainFramebuffers.clear();
 
             createSwapChain();
             createImageViews();
+            renderTargets.release(depthTarget);
+            renderTargets.release(colorTarget);
+            createRenderTargets();
             createFramebuffers();
         }
+
+        /**
+         * Destroys an object once every submission so far and the one being recorded have finished
+         * 
+         * For objects that are replaced at runtime, the frames in flight keep using the old one while the
+         * next frame already uses the new one. The frame loop flushes the queue after every frame wait.
+         */
+        void deferDestroy(std::function<void()> destroy) {
+            deletionQueue.retire(gpuTimelineValue + 1, std::move(destroy));
+        }
+
+        // Typed helpers for deferDestroy()
+        void deferDestroyImage(VkImage image, VkImageView view, MemoryAllocation allocation) {
+            deferDestroy([this, image, view, allocation]() mutable {
+                vkDestroyImageView(device, view, nullptr);
+                vkDestroyImage(device, image, nullptr);
+                memoryAllocator.free(allocation);
+            });
+        }
+
+        // The pipeline may still be compiling on a worker, then it is retired again instead of waited for
+        void deferDestroyPipeline(std::shared_future<VkPipeline> pipeline) {
+            deferDestroy([this, pipeline]() {
+                if (pipeline.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                    deferDestroyPipeline(pipeline);
+                    return;
+                }
+                try {
+                    vkDestroyPipeline(device, pipeline.get(), nullptr);
+                } catch (const std::exception&) {
+                    // The compile had failed, there is nothing to destroy
+                }
+            });
+        }
     };
 
-int main() {
-    HelloTriangleApplication app; // Creates the application instance
+// Throws if a self test check doesn't hold
+void expect(bool condition, const std::string& check) {
+    if (!condition) {
+        throw std::runtime_error("self test failed: " + check + "!");
+    }
+}
+
+// A read after a write at the same stage and access still needs the write made visible to it
+void testRenderGraphReadAfterWrite() {
+    RenderGraph graph;
+    graph.init([](VkCommandBuffer, const VkDependencyInfo*) {}); // Only the counts are checked
+    RenderGraph::Resource count = graph.importBuffer(VK_NULL_HANDLE);
+    graph.addPass("write", {{count, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT}});
+    graph.addPass("read", {{count, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT}});
+    graph.execute(VK_NULL_HANDLE);
+    expect(graph.barriers() == 1, "a compute read after a compute write gets one barrier");
+}
+
+// "v x y z w" has the optional weight, not a vertex color, and "v x y z r g b" has the color
+void testObjPositionWeight() {
+    const std::string path = "tests/weighted_positions.obj";
+    FileView file;
+    expect(file.open(path), path + " can be opened");
+    MeshData mesh = loadObj(std::move(file), path);
+    expect(mesh.vertexCount == 4 && mesh.indexCount == 6, "the weighted quad has 4 vertices and 2 triangles");
+    expect(mesh.vertices[0].pos == glm::vec3(-0.5f, -0.5f, 0.0f), "the weight isn't read as part of the position");
+    expect(mesh.vertices[0].color == glm::vec3(1.0f), "the weight isn't read as a color");
+    expect(mesh.vertices[3].color == glm::vec3(0.0f, 0.0f, 1.0f), "three values after the position are the color");
+}
+
+// The checks of "make check", they run on the CPU only
+void runSelfTests() {
+    testRenderGraphReadAfterWrite();
+    testObjPositionWeight();
+    std::cout << "self tests passed" << std::endl;
+}
 
+int main(int argc, char** argv) {
     try {
+        AppConfig config = AppConfig::fromArguments(argc, argv);
+        if (config.selfTest) {
+            runSelfTests();
+            return EXIT_SUCCESS;
+        }
+        if (!config.convertSource.empty()) {
+            FileView file;
+            if (!file.open(config.convertSource)) {
+                throw std::runtime_error("failed to open file " + config.convertSource + "!");
+            }
+            MeshData mesh = loadObj(std::move(file), config.convertSource);
+            writeMeshFile(mesh, config.convertTarget);
+            std::cout << config.convertTarget << ": " << mesh.vertexCount << " vertices, " << mesh.indexCount << " indices" << std::endl;
+            return EXIT_SUCCESS;
+        }
+
+        HelloTriangleApplication app(config); // Creates the application instance
         app.run(); // Running the application
     } catch (const std::exception& e) {
         // Catching errors
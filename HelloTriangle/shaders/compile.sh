@@ -2,5 +2,9 @@
 glslc vertex_shader.vert -o vert.spv 
 # Compiling the fragment shader from glsl to spir-v bytecode
 glslc fragment_shader.frag -o frag.spv
+# The fragment shader sampling the bindless texture array
+glslc -DBINDLESS fragment_shader.frag -o frag_bindless.spv
+# Compiling the culling compute shader
+glslc cull.comp -o cull.spv
 
 # This compiling can be done in the c++ program using libshaderc
\ No newline at end of file
@@ -1,14 +1,28 @@
 #version 460 // Version of shader preprocessor
+#ifdef BINDLESS
+#extension GL_EXT_nonuniform_qualifier : require
+#endif
 
 // Global variables for input and output
+#ifdef BINDLESS
+// Compiled with -DBINDLESS into frag_bindless.spv, every texture in one partially bound array
+layout(binding = 1) uniform sampler2D textures[];
+#else
 layout(binding = 1) uniform sampler2D texSampler;
+#endif
 // Taking in the fragColor from the vertex shader
 layout(location = 0) in vec3 fragColor;
 layout(location = 1) in vec2 fragTexCoord;
+layout(location = 2) flat in uint fragTextureIndex;
 // Specifying the index of the frame buffer
 // Here the index is 0
 layout(location = 0) out vec4 outColor;
 
 void main() {
+#ifdef BINDLESS
+    // The instances of a draw can use different textures, so the index isn't uniform
+    outColor = texture(textures[nonuniformEXT(fragTextureIndex)], fragTexCoord);
+#else
     outColor = texture(texSampler, fragTexCoord);
+#endif
 }
\ No newline at end of file
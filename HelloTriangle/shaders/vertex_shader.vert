@@ -2,26 +2,45 @@
 
 // Global variables for input and output
 
+// The camera, bound with a dynamic offset into the slot of the frame
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 proj;
 } ubo;
 
+// Matches DrawConstants in main.cpp, pushed with the draws
+layout(push_constant) uniform PushConstants {
+    mat4 model;
+} pc;
+
+// Matches InstanceData in main.cpp
+struct InstanceData {
+    mat4 model;
+    uint textureIndex; // Into the bindless texture array
+};
+
+// Every instance, selected with gl_InstanceIndex
+layout(std430, binding = 2) readonly buffer InstanceBuffer {
+    InstanceData data[];
+} instances;
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
 layout(location = 2) in vec2 inTexCoord;
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) flat out uint fragTextureIndex; // Not interpolated, the same for the whole triangle
 
 void main() {
     // gl_VertexIndex is a built in variable that holds the value of the current index
     // The main function is run for every vertex
     // The last values 0.0, 1.0 and dummy z and w components 
     // A MVP transformation is done with the uniform buffer object
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
+    // The instance transform places the copy in the scene before the shared model transform
+    gl_Position = ubo.proj * ubo.view * pc.model * instances.data[gl_InstanceIndex].model * vec4(inPosition, 1.0);
     // Giving the color of the vertices to the global output variable
     fragColor = inColor;
     fragTexCoord = inTexCoord;
+    fragTextureIndex = instances.data[gl_InstanceIndex].textureIndex;
 }
\ No newline at end of file